@@ -0,0 +1,84 @@
+/* bcache.h - Block buffer cache */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <common.h>
+#include <paging.h>
+#include <vfs.h>
+#include <timer.h>
+
+// Devices are cached a page at a time
+#define BCACHE_BLOCK_SHIFT	12
+#define BCACHE_BLOCK_SIZE	(1 << BCACHE_BLOCK_SHIFT)
+
+#define BCACHE_MAX			256		// Buffers kept before reusing old ones
+#define BCACHE_HASH_BITS	7
+#define BCACHE_HASH_SIZE	(1 << BCACHE_HASH_BITS)
+
+#define BUF_UPTODATE		0x01	// Holds what's on disk, or newer
+#define BUF_DIRTY			0x02	// Newer than what's on disk
+#define BUF_LOCKED			0x04	// Under I/O or being modified
+#define BUF_WRITE_ERROR		0x08	// Writing it back failed
+
+// Writeback. The flusher wakes past the background level, or to write
+// back anything that's been dirty too long. Past the limit, writers
+// write back for themselves
+#define BCACHE_DIRTY_BACKGROUND		(BCACHE_MAX / 10)
+#define BCACHE_DIRTY_LIMIT			(BCACHE_MAX * 4 / 10)
+#define BCACHE_DIRTY_EXPIRE			(30 * HZ)
+#define BCACHE_WRITEBACK_INTERVAL	(5 * HZ)
+#define BCACHE_WRITEBACK_BATCH		32
+
+#define RA_MIN_BLOCKS		4		// First window once reads look sequential
+#define RA_MAX_BLOCKS		(BCACHE_MAX / 4)	// Every block in the window is
+											// held locked till it's read
+
+struct buffer {
+	dev_t dev;
+	uint32_t block;				// In BCACHE_BLOCK_SIZE units
+	size_t size;				// Short at the end of a device
+	void *data;
+	uint32_t flags;
+	uint32_t refcount;
+	uint32_t dirtied;			// Tick it last went dirty
+	struct buffer *hash_next;
+	struct buffer *lru_prev;	// Most recently used first
+	struct buffer *lru_next;
+};
+
+void init_bcache(void);
+struct buffer *bget(dev_t dev, uint32_t block);
+struct buffer *bread(dev_t dev, uint32_t block);
+void breadahead(dev_t dev, uint32_t block, uint32_t count);
+void file_readahead(struct file_ra *ra, dev_t dev, uint32_t block,
+	uint32_t count);
+void brelse(struct buffer *buf);
+void lock_buffer(struct buffer *buf);
+void unlock_buffer(struct buffer *buf);
+void bdirty(struct buffer *buf);
+void balance_dirty(void);
+int32_t bwrite(struct buffer *buf);
+int32_t bflush(dev_t dev);
+int32_t bflush_range(dev_t dev, uint32_t block, uint32_t count);
+void binvalidate_range(dev_t dev, uint32_t block, uint32_t count);
+
+#endif /* BCACHE_H */
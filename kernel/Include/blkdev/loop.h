@@ -0,0 +1,65 @@
+/* loop.h - block devices backed by files */
+
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef LOOP_H
+#define LOOP_H
+#include <common.h>
+#include <block.h>
+#include <vfs.h>
+#include <workqueue.h>
+#include <structures/mutex.h>
+
+#define LOOP_MAJOR			3
+#define LOOP_SECTOR_SIZE	512
+
+// Can be overridden at build time with -D
+#ifndef LOOP_COUNT
+#define LOOP_COUNT			4
+#endif
+
+#define LOOP_SET_FD			0x4C00	// Takes a pointer to an int32_t fd
+#define LOOP_CLR_FD			0x4C01
+#define LOOP_SET_STATUS		0x4C02	// Both take a struct loop_info
+#define LOOP_GET_STATUS		0x4C03
+
+#define LO_FLAGS_READ_ONLY	0x01	// Backing file wasn't opened for writing
+#define LO_FLAGS_DIRECT_IO	0x02	// Use O_DIRECT on the backing file
+
+struct loop_info {
+	uint64_t offset;		// Where the device starts in the file. Sector aligned
+	uint64_t sizelimit;		// 0 for the rest of the file
+	uint32_t flags;
+};
+
+struct loop {
+	blkdev_t *blkdev;
+	struct mutex *mutex;	// Taken by the servicer for each request
+	fs_node_t *file;		// Reference to the file we were given
+	fs_node_t *backing;		// Our own copy of it, with our own flags and
+							// readahead. NULL if unbound
+	uint32_t backing_flags;	// What the backing file was opened with
+	struct loop_info info;
+	struct work servicer;	// Drains the request queue
+};
+
+void init_loop(void);
+
+#endif /* LOOP_H */
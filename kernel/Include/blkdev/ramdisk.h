@@ -0,0 +1,48 @@
+/* ramdisk.h - memory backed block devices */
+
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef RAMDISK_H
+#define RAMDISK_H
+#include <common.h>
+#include <block.h>
+#include <workqueue.h>
+
+#define RAMDISK_MAJOR		2
+#define RAMDISK_SECTOR_SIZE	512
+
+// Both can be overridden at build time with -D
+#ifndef RAMDISK_COUNT
+#define RAMDISK_COUNT		2
+#endif
+#ifndef RAMDISK_SIZE
+#define RAMDISK_SIZE		(16 * 1024 * 1024)	// Bytes per disk
+#endif
+
+struct ramdisk {
+	blkdev_t *blkdev;
+	uint32_t npages;
+	void **pages;			// Allocated on first write. Missing ones read as 0
+	struct work servicer;	// Drains the request queue
+};
+
+void init_ramdisk(void);
+
+#endif /* RAMDISK_H */
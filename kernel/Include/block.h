@@ -31,13 +31,51 @@
 #define BLOCK_REQ_RUNNING	2
 #define BLOCK_REQ_FINISHED	3
 #define BLOCK_REQ_INTR		4
+#define BLOCK_REQ_MERGED	5	// Riding along with another request
 
 #define BLOCK_DIR_WRITE		0x01
 #define BLOCK_SYNC			0x02
 
+#define BLOCK_MAX_SECTORS	128	// Merging limit unless the driver sets one
+#define BLOCK_RA_SECTORS	256	// Default readahead limit
+#define BLOCK_RA_MAX_SECTORS	2048	// Most BLKRASET will take
+#define BLK_PLUG_DEVS		8
+
 #define BLOCK_REQ_RESULT(r) r->rc
 
+// ioctls every block device understands, before its driver sees them
+#define BLKGETSCHED		0x1201	// Name of the I/O scheduler, see elevator.h
+#define BLKSETSCHED		0x1202
+#define BLKRAGET		0x1203	// Readahead limit, in sectors
+#define BLKRASET		0x1204
+
 typedef struct blockdev blkdev_t;
+typedef struct request request_t;
+
+#define IOSTAT_BUCKETS		24	// log2 of microseconds. The last is everything
+								// past 4 seconds
+
+/* Kept for each disk and each partition, under the disk's mutex. Indexed
+ * by direction where there's two
+ */
+struct io_stats {
+	uint32_t ios[2];			// Finished requests, reads then writes
+	uint32_t sectors[2];
+	uint32_t merges[2];			// Requests folded into others
+	uint32_t errors;
+	uint32_t in_flight;			// Posted and not finished
+	uint64_t busy_ns;			// Time with anything in flight
+	uint64_t busy_since;
+	uint32_t queue_hist[IOSTAT_BUCKETS];	// Posted till sent to the driver
+	uint32_t service_hist[IOSTAT_BUCKETS];	// Sent till finished
+};
+
+struct io_scheduler;
+
+/* Called once the request's finished, from whatever's driving the device.
+ * The request belongs to it again, so it can be freed there
+ */
+typedef void (*end_io_t)(request_t *req);
 typedef int32_t (*request_handler_t)(blkdev_t*);
 
 typedef struct bio {
@@ -46,21 +84,34 @@ typedef struct bio {
 	uint32_t nsectors;
 } bio_t;
 
-typedef struct {
+struct request {
 	uint32_t flags;
 	uint32_t first_sector;
 	uint32_t nsectors;
 	int32_t status;
-	uint32_t rc;
+	int32_t rc;
 	blkdev_t *dev;
 	list_t *bios;
-	waitqueue_t *wq;
-} request_t;
+	struct part *part;		// For statistics. May be NULL
+	uint64_t queued;		// monotonic_ns when posted
+	uint64_t started;		// And when the driver got it
+	uint32_t stat_sectors;	// Size once it can't grow any more
+	end_io_t end_io;		// NULL if somebody's going to wait on it
+	void *private;			// For end_io
+	struct request *merged;	// Folded into this one, through merge_next
+	struct request *merge_next;
+	uint32_t deadline;		// In ticks
+	struct {
+		struct request *prev;
+		struct request *next;
+	} link[2];				// For the I/O scheduler's queues
+};
 
 struct part {
 	dev_t minor;
 	uint32_t offset;	// in sectors
 	uint32_t size;
+	struct io_stats stats;
 };
 
 typedef struct blockdev {
@@ -70,12 +121,31 @@ typedef struct blockdev {
 	list_t *partitions;
 	size_t sector_size;
 	uint32_t size;		// Size in sectors
+	uint32_t max_sectors;	// Requests aren't merged past this. 0 never merges
+	uint32_t ra_sectors;	// Most a sequential reader gets read ahead
 	mutex_t *mutex;
 	request_handler_t handler;
-	list_t *queue;
+	struct io_scheduler *sched;	// Orders what's pending
+	void *sched_data;
+	request_t *running;		// Handed to the driver and not finished yet
+	struct io_stats stats;	// The whole disk
 	void *private_data;
 } blkdev_t;
 
+/* Requests posted while a task has one of these started are queued, and
+ * merged where they can be, but the driver isn't told until it's finished
+ */
+struct blk_plug {
+	uint32_t ndevs;
+	blkdev_t *devs[BLK_PLUG_DEVS];
+};
+
+// Counts down a batch of requests posted with post_counted_blkdev
+struct blk_completion {
+	uint32_t pending;
+	int32_t error;		// From the first one that failed
+};
+
 struct blkdev_driver {
 	const char *name;
 	struct file_ops ops;
@@ -111,14 +181,23 @@ void free_blkdev(blkdev_t *dev);
 int32_t add_blkdev(blkdev_t *dev);
 blkdev_t *get_blkdev(dev_t dev);
 size_t get_block_size(dev_t dev);
-node_t *next_ready_request_blkdev(blkdev_t *dev);
+uint32_t get_dev_sectors(dev_t dev);
+int32_t ioctl_blkdev(dev_t dev, uint32_t req, void *data);
+request_t *next_ready_request_blkdev(blkdev_t *dev);
 request_t *create_request_blkdev(dev_t dev, uint32_t first_sector,
 	uint32_t flags);
 int32_t add_bio_to_request_blkdev(request_t *req, bio_t *bio);
 int32_t post_request_blkdev(request_t *req);
+int32_t submit_request_blkdev(request_t *req, end_io_t end_io, void *private);
 int32_t wait_request_blkdev(request_t *req);
 int32_t post_and_wait_blkdev(request_t *req);
 int end_request(request_t *req, int32_t error, uint32_t nsectors);
 void free_request(request_t *req);
+void init_completion_blkdev(struct blk_completion *done);
+int32_t post_counted_blkdev(request_t *req, struct blk_completion *done);
+int32_t wait_completion_blkdev(struct blk_completion *done);
+void blk_start_plug(struct blk_plug *plug);
+void blk_finish_plug(struct blk_plug *plug);
+void blk_flush_plug(void);
 
 #endif /* BLOCK_H */
\ No newline at end of file
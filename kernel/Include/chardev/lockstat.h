@@ -0,0 +1,29 @@
+/* lockstat.h - spinlock statistics device */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+#include <common.h>
+
+#define LOCKSTAT_MAJOR	3
+
+void init_lockstat(void);
+
+#endif /* LOCKSTAT_H */
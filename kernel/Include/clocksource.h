@@ -0,0 +1,50 @@
+/* clocksource.h - high resolution time sources */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef CLOCKSOURCE_H
+#define CLOCKSOURCE_H
+
+#include <common.h>
+#include <time.h>
+
+#define NSEC_PER_SEC		1000000000ULL
+#define NSEC_PER_MSEC		1000000
+#define NSEC_PER_USEC		1000
+
+#define CLOCKSOURCE_SHIFT	22
+#define TSC_CALIBRATE_MS	50
+
+/* A free-running counter. Cycles are converted to nanoseconds by
+ * (cycles * mult) >> shift, so reading the clock never has to divide
+ */
+struct clocksource {
+	const char *name;
+	uint64_t (*read)(void);
+	uint32_t mult;
+	uint32_t shift;
+	uint32_t khz;
+};
+
+void init_clocksource(void);
+struct clocksource *get_clocksource(void);
+uint64_t monotonic_ns(void);
+int32_t clock_gettime(clockid_t clk, struct timespec *tp);
+
+#endif /* CLOCKSOURCE_H */
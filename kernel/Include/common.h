@@ -46,7 +46,33 @@ typedef uint32_t nlink_t;
 typedef int64_t off_t;
 typedef int32_t pid_t;
 
-typedef uint8_t spinlock_t;
+/* Ticket lock: waiters are served in the order they arrived. Holders and
+ * waiters aren't preempted, so nobody spins on a ticket that can't be
+ * served. Plain spin_lock leaves the interrupt flag alone, so anything an
+ * interrupt handler might also take has to be held with spin_lock_irqsave.
+ * Building with SPINLOCK_STATS counts acquisitions and contention for each
+ * lock
+ */
+typedef struct spinlock {
+	volatile uint16_t owner;	// Ticket being served
+	volatile uint16_t next;		// Next ticket to hand out
+#ifdef SPINLOCK_STATS
+	const char *name;
+	uint32_t acquired;
+	uint32_t contended;			// Acquisitions that had to wait
+	uint64_t spin_cycles;		// TSC cycles spent waiting
+	struct spinlock *next_stat;	// Every lock that's been taken, for lockstat
+#endif
+} spinlock_t;
+
+#ifdef SPINLOCK_STATS
+#define SPINLOCK_INIT(n) { .owner = 0, .next = 0, .name = (n), \
+	.acquired = 0, .contended = 0, .spin_cycles = 0, .next_stat = NULL }
+#else
+#define SPINLOCK_INIT(n) { .owner = 0, .next = 0 }
+#endif
+
+#define DEFINE_SPINLOCK(lock) spinlock_t lock = SPINLOCK_INIT(#lock)
 
 // Bochs magic breakpoint. Doesn't actually do anything on a real system
 void magic_break(void);
@@ -63,7 +89,30 @@ void outsw(uint16_t port, void *src, int count);
 
 void halt(void);
 void panic(uint32_t line, char *file, char *msg);
-void spin_lock(volatile spinlock_t *lock);
-void spin_unlock(volatile spinlock_t *lock);
+void spin_lock_init(spinlock_t *lock, const char *name);
+void spin_lock(spinlock_t *lock);
+int spin_trylock(spinlock_t *lock);
+void spin_unlock(spinlock_t *lock);
+uint32_t spin_lock_irqsave(spinlock_t *lock);
+void spin_unlock_irqrestore(spinlock_t *lock, uint32_t eflags);
+#ifdef SPINLOCK_STATS
+spinlock_t *lockstat_first(void);
+#endif
+
+// Tells the cpu we're in a spin loop
+static inline void cpu_relax(void) {
+	asm volatile("pause" : : : "memory");
+}
+
+// Disable interrupts, returning the old eflags for irq_restore
+static inline uint32_t irq_save(void) {
+	uint32_t eflags;
+	asm volatile("pushf; pop %0; cli" : "=r"(eflags) : : "memory");
+	return eflags;
+}
+
+static inline void irq_restore(uint32_t eflags) {
+	asm volatile("push %0; popf" : : "r"(eflags) : "memory", "cc");
+}
 
 #endif /* COMMON_H */
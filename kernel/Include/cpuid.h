@@ -21,6 +21,8 @@
 #ifndef CPUID_H
 #define CPUID_H
 
+#include <common.h>
+
 /* Vendor-strings. */
 #define CPUID_VENDOR_OLDAMD			"AMDisbetter!" //early engineering samples of AMD K5 processor
 #define CPUID_VENDOR_AMD			"AuthenticAMD"
@@ -103,11 +105,11 @@
 #define CPUID_EXT_BRAND1			0x80000004
 #define CPUID_EXT_BRAND2			0x80000008
 
-extern inline void cpuid(uint32_t cmd, void *regs) {
+// regs gets ebx, ecx and edx, in that order
+static inline void cpuid(uint32_t cmd, void *regs) {
 	uint32_t *ints = (uint32_t *)regs;
 	asm volatile("cpuid" :
-		"=b"(ints[0]), "=c"(ints[1]), "=d"(ints[2]) :
-		"a"(cmd));
+		"+a"(cmd), "=b"(ints[0]), "=c"(ints[1]), "=d"(ints[2]));
 }
 
 #endif /* CPUID_H */
\ No newline at end of file
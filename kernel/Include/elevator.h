@@ -0,0 +1,59 @@
+/* elevator.h - Pluggable I/O schedulers ordering each block device's queue */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef ELEVATOR_H
+#define ELEVATOR_H
+
+#include <common.h>
+#include <block.h>
+#include <timer.h>
+
+#define IOSCHED_NAME_MAX	16
+#define DEFAULT_IOSCHED		"deadline"
+
+// How long requests can be passed over by the deadline elevator, in ticks
+#define DEADLINE_READ_EXPIRE	(HZ / 2)
+#define DEADLINE_WRITE_EXPIRE	(5 * HZ)
+
+/* Decides what order a device's pending requests go out in. Everything but
+ * init is called with the device's mutex held. Requests handed back by next
+ * or pulled out with remove are no longer the scheduler's. Queues are
+ * linked through the requests themselves, so adding can't fail
+ */
+struct io_scheduler {
+	const char *name;
+	void *(*init)(void);
+	void (*exit)(void *data);
+	void (*add)(void *data, request_t *req);
+	request_t *(*next)(void *data);
+	void (*remove)(void *data, request_t *req);
+	// A queued request req can be folded into, or NULL. Optional
+	request_t *(*find_merge)(void *data, request_t *req, uint32_t max_sectors);
+	// target grew by a merge and may need moving
+	void (*merged)(void *data, request_t *target);
+};
+
+int elv_mergeable(request_t *target, request_t *req, uint32_t max_sectors);
+struct io_scheduler *find_iosched(const char *name);
+int32_t elevator_init(blkdev_t *dev, const char *name);
+void elevator_exit(blkdev_t *dev);
+int32_t elevator_switch(blkdev_t *dev, const char *name);
+
+#endif /* ELEVATOR_H */
@@ -25,7 +25,9 @@
 
 #include <common.h>
 #include <vfs.h>
+#include <task.h>
 
+struct filep *get_filep(int32_t fd);
 off_t lseek(int32_t fd, off_t off, int32_t whence);
 ssize_t user_pread(int32_t fd, char *buf, size_t nbytes, off_t off);
 ssize_t user_read(int32_t fd, char *buf, size_t nbytes);
@@ -38,6 +40,9 @@ int32_t user_stat(const char *path, struct stat *buff);
 int32_t user_chmod(int32_t fd, mode_t mode);
 int32_t user_chown(int32_t fd, uid_t uid, gid_t gid);
 int32_t user_ioctl(int32_t fd, uint32_t request, void *ptr);
+int32_t user_sync(void);
+int32_t user_fsync(int32_t fd);
+int32_t user_fdatasync(int32_t fd);
 int32_t user_link(const char *oldpath, const char *newpath);
 int32_t user_unlink(const char *path);
 int32_t mknod(const char *path, mode_t mode, dev_t dev);
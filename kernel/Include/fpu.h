@@ -0,0 +1,47 @@
+/* fpu.h - lazy FPU/SSE context management */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef FPU_H
+#define FPU_H
+
+#include <common.h>
+
+#define CR0_MP				0x00000002
+#define CR0_EM				0x00000004
+#define CR0_TS				0x00000008
+#define CR0_NE				0x00000020
+#define CR4_OSFXSR			0x00000200
+#define CR4_OSXMMEXCPT		0x00000400
+
+#define FPU_STATE_SIZE		512		// fxsave area. fnsave only needs 108
+#define MXCSR_DEFAULT		0x1F80	// All SSE exceptions masked
+
+typedef struct {
+	uint8_t data[FPU_STATE_SIZE];
+} __attribute__((aligned(16))) fpu_state_t;
+
+struct task;
+
+void init_fpu(void);
+void fpu_switch(struct task *next);
+int32_t fpu_fork(struct task *parent, struct task *child);
+void fpu_release(struct task *task);
+
+#endif /* FPU_H */
@@ -23,10 +23,12 @@
 
 #include <common.h>
 #include <vfs.h>
+#include <rcu.h>
 
 struct dev_file {
 	fs_node_t node;
 	struct dev_file *next;
+	struct rcu_head rcu;		// Lookups don't lock, so freeing waits
 };
 
 void init_devfs(void);
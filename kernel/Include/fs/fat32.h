@@ -90,7 +90,7 @@ struct fat32_boot_record {
 
 	// We add these in
 	struct fat32_inode *inode_list;
-	uint8_t lock;
+	spinlock_t lock;
 } __attribute__((packed));
 
 struct fat32_dirent {
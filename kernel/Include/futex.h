@@ -0,0 +1,37 @@
+/* futex.h - user space locks that only enter the kernel when contended */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <common.h>
+#include <time.h>
+
+#define FUTEX_WAIT			0
+#define FUTEX_WAKE			1
+
+#define FUTEX_HASH_BITS		6
+#define FUTEX_HASH_SIZE		(1 << FUTEX_HASH_BITS)
+
+void init_futex(void);
+int32_t futex(uint32_t *uaddr, int32_t op, uint32_t val,
+	const struct timespec *timeout);
+
+#endif /* FUTEX_H */
@@ -50,6 +50,14 @@
 #define GDT_SYSTEM_32BIT 0x0008
 #define GDT_SYSTEM_BIG 0x0400
 
+#define GDT_NUM_ENTRIES 7
+#define GDT_TLS_ENTRY 6
+
+// Selectors
+#define KERNEL_DATA_SEL 0x10
+#define USER_DATA_SEL 0x23
+#define TLS_SEL 0x33	// User gs. Base follows the running thread
+
 
 typedef struct gdt_entry_struct {
 	uint16_t seg_limit_low; // Lower 16 bits of the limit
@@ -115,5 +123,6 @@ typedef struct tss_entry_struct {
 
 void init_gdt(void);
 void set_kernel_stack(uint32_t esp0);
+void set_tls_base(uint32_t base);
 
 #endif /* GDT_H */
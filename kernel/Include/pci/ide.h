@@ -23,6 +23,8 @@
 #include <common.h>
 #include <structures/mutex.h>
 #include <task.h>
+#include <block.h>
+#include <workqueue.h>
 
 // Status masks
 #define ATA_SR_BSY				0x80
@@ -128,7 +130,9 @@
 #define IDE_SECTOR_SIZE			512
 #define IDE_MAX_TRANSFER_28		255
 #define IDE_MAX_TRANSFER_48		65535
+#define IDE_MAX_SEGMENTS		16	// Bios per PIO command
 #define IDE_TIMEOUT				5
+#define IDE_RT_PRIO				50		// Servicers preempt normal tasks
 
 struct IDEChannelRegisters {
 	uint8_t channel;
@@ -148,7 +152,8 @@ struct IDEDevice {
 	uint32_t commandsets;
 	uint32_t size;			// Drive size in sectors
 	char model[41];			// Model string
-	tasklet_t *servicer;
+	struct work servicer;	// Drains the request queue
+	blkdev_t *blkdev;
 };
 
 struct PRD {
@@ -0,0 +1,55 @@
+/* rcu.h - Read-copy-update for read-mostly tables */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef RCU_H
+#define RCU_H
+
+#include <common.h>
+
+/* Readers take no locks. They can't sleep or be preempted inside a read
+ * section, so on our one cpu, any moment the current task isn't in one
+ * means nobody can still be holding a pointer they found before. That ends
+ * a grace period, after which old versions can be freed
+ */
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *);
+	uint32_t gp;				// Grace period that has to end first
+};
+
+// Read a published pointer once
+#define rcu_dereference(p)	(*(volatile typeof(p) *)&(p))
+
+// Only let readers find it once it's completely filled in
+#define rcu_assign_pointer(p, v) do { \
+	__sync_synchronize(); \
+	(p) = (v); \
+} while (0)
+
+void init_rcu(void);
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *));
+void kfree_rcu(void *ptr);
+void synchronize_rcu(void);
+void rcu_note_switch(void);
+void rcu_tick(void);
+
+#endif /* RCU_H */
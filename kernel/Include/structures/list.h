@@ -42,6 +42,7 @@ node_t *list_insert_after(list_t *list, node_t *node, void *data);
 node_t *list_insert_before(list_t *list, node_t *node, void *data);
 void list_remove(list_t *list, node_t *node);
 node_t *list_dequeue(list_t *list, node_t *node);
+node_t *list_dequeue_rcu(list_t *list, node_t *node);
 node_t *list_find(list_t *list, void *key);
 node_t *list_get_index(list_t *list, uint32_t index);
 void list_merge(list_t *dest, list_t *src);
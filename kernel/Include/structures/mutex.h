@@ -27,9 +27,17 @@
 #define SEM_READ	0
 #define SEM_WRITE	1
 
-typedef struct {
-	uint32_t mutex;
-	waitqueue_t *wq;
+/* Ownership is handed straight to the most important waiter on release, so
+ * a contended unlock wakes exactly one task, and nobody can barge in ahead
+ * of it in the meantime. While anyone waits, the owner runs at the highest
+ * of their priorities, and passes that on to whatever it's waiting for in
+ * turn
+ */
+typedef struct mutex {
+	struct task *owner;			// NULL if unlocked
+	waitqueue_t *wq;			// Exclusive waiters, in arrival order
+	uint32_t prio;				// Highest priority among the waiters
+	struct mutex *pi_next;		// Next in the owner's pi_mutexes
 } mutex_t;
 
 typedef struct {
@@ -38,22 +46,38 @@ typedef struct {
 	waitqueue_t *wq;
 } sem_t;
 
+/* All of the lock's state lives in one word: the number of readers holding
+ * it, whether a writer holds it, and whether anyone is queued. The
+ * uncontended paths are a single atomic op on it. Writers are preferred -
+ * once one is queued, new readers queue up behind it - but when a writer
+ * releases, every reader that queued up in the meantime is let in at once
+ */
+#define RWSEM_READERS	0x3FFFFFFF
+#define RWSEM_WAITERS	0x40000000
+#define RWSEM_WRITER	0x80000000
+
 typedef struct {
-	mutex_t *write;
-	sem_t *semaphore;
+	uint32_t state;
+	struct task *writer;		// Current write owner, if any
+	uint32_t read_waiting;		// Readers queued on rq
+	uint32_t read_batch;		// Bumped each time rq is let in
+	waitqueue_t *rq;			// Queued readers
+	waitqueue_t *wq;			// Queued writers, exclusive
 } rw_sem_t;
 
 mutex_t *create_mutex(uint32_t locked);
 void destroy_mutex(mutex_t *mutex);
 void acquire_mutex(volatile mutex_t *mutex);
+int try_acquire_mutex(volatile mutex_t *mutex);
 void release_mutex(volatile mutex_t *mutex);
+void mutex_prio_changed(struct task *task);
 
 sem_t *create_semaphore(uint32_t max);
 void destroy_semaphore(sem_t *sem);
 void acquire_semaphore(volatile sem_t *sem);
 void release_semaphore(volatile sem_t *sem);
 
-rw_sem_t *create_rw_semaphore(uint32_t max);
+rw_sem_t *create_rw_semaphore(void);
 void destroy_rw_semaphore(rw_sem_t *sem);
 void acquire_semaphore_read(volatile rw_sem_t *sem);
 void acquire_semaphore_write(volatile rw_sem_t *sem);
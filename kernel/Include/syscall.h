@@ -186,6 +186,22 @@ DECL_SYSCALL2(umount, const char*, uint32_t);
 DECL_SYSCALL1(sbrk, uintptr_t);
 DECL_SYSCALL3(execve, const char*, char *const*, char *const*);
 DECL_SYSCALL1(chdir, const char*);
+DECL_SYSCALL2(clock_gettime, clockid_t, struct timespec*);
+DECL_SYSCALL3(clone, uint32_t, uintptr_t, uintptr_t);
+DECL_SYSCALL0(gettid);
+DECL_SYSCALL1(exit_thread, int32_t);
+DECL_SYSCALL1(set_thread_area, uintptr_t);
+DECL_SYSCALL3(waitpid, pid_t, int32_t*, int32_t);
+DECL_SYSCALL4(wait4, pid_t, int32_t*, int32_t, struct rusage*);
+DECL_SYSCALL1(times, struct tms*);
+DECL_SYSCALL2(getrusage, int32_t, struct rusage*);
+DECL_SYSCALL4(futex, uint32_t*, int32_t, uint32_t, const struct timespec*);
+DECL_SYSCALL3(sched_setscheduler, pid_t, int32_t, const struct sched_param*);
+DECL_SYSCALL1(sched_getscheduler, pid_t);
+DECL_SYSCALL2(sched_getparam, pid_t, struct sched_param*);
+DECL_SYSCALL0(sync);
+DECL_SYSCALL1(fsync, int32_t);
+DECL_SYSCALL1(fdatasync, int32_t);
 
 void init_syscalls(void);
 
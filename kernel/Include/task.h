@@ -23,7 +23,11 @@
 
 #include <common.h>
 #include <paging.h>
+#include <idt.h>
 #include <vfs.h>
+#include <time.h>
+#include <fpu.h>
+#include <timer.h>
 #include <structures/list.h>
 #include <structures/tree.h>
 
@@ -31,6 +35,7 @@
 #define KERNEL_STACK_SIZE	0x2000
 #define MAX_OF				32
 #define MAX_PID				32768
+#define TASK_CACHE_SIZE		16
 
 #define SEEK_SET			0
 #define SEEK_CUR			1
@@ -42,11 +47,52 @@
 #define SLEEP_ASLEEP		0x01
 #define SLEEP_INTERRUPTABLE	0x02
 #define SLEEP_INTERRUPTED	0x04
+#define SLEEP_EXCLUSIVE		0x08	// Only one of these is woken at a time
+
+#define TASK_KILLED			0x01	// Exit on the way back to user mode
+#define TASK_ZOMBIE			0x02	// Exited, waiting for the parent
+#define TASK_EXITED			0x04	// Thread's gone. Its time is in the group's
+#define TASK_NOWRITEBACK	0x08	// Services block I/O, so mustn't wait on
+									// the cache's writeback
+
+#define WNOHANG				0x01
+
+#define RUSAGE_SELF			0
+#define RUSAGE_CHILDREN		-1
+#define RUSAGE_THREAD		1
+
+#define SCHED_NORMAL		0
+#define SCHED_FIFO			1	// Runs until it blocks or something higher
+								// priority turns up
+#define SCHED_RR			2	// Same, but takes turns within its priority
+
+#define RT_PRIO_MAX			99
+#define RR_TIMESLICE		(100 * HZ / 1000)
+
+/* Real-time tasks get at most RT_RUNTIME ticks out of every RT_PERIOD
+ * while normal tasks want the cpu, so a runaway one can't lock them out
+ */
+#define RT_PERIOD			(1000 * HZ / 1000)
+#define RT_RUNTIME			(950 * HZ / 1000)
+
+#define SCHED_HIST_BUCKETS	16	// Bucket n counts latencies under 2^n us
+
+// Only whole threads are supported, so these have to be passed together
+#define CLONE_VM			0x00000100
+#define CLONE_FS			0x00000200
+#define CLONE_FILES			0x00000400
+#define CLONE_THREAD		0x00010000
+#define CLONE_SETTLS		0x00080000
+#define CLONE_THREAD_FLAGS	(CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_THREAD)
 
 typedef void (*tasklet_body_t)(void*);
 
+// Claimed by an open that hasn't finished yet
+#define FILEP_RESERVED		((fs_node_t *)1)
+
 struct filep {
-	fs_node_t *file;
+	fs_node_t *file;			// NULL if free. Set and cleared atomically,
+								// since threads share the table
 	off_t off;
 };
 
@@ -54,27 +100,106 @@ typedef struct {
 	list_t *queue;
 } waitqueue_t;
 
+struct rusage {
+	struct timeval ru_utime;
+	struct timeval ru_stime;
+};
+
+struct sched_param {
+	int32_t sched_priority;
+};
+
+struct tms {
+	clock_t tms_utime;
+	clock_t tms_stime;
+	clock_t tms_cutime;
+	clock_t tms_cstime;
+};
+
+struct cputime {
+	uint64_t utime;				// Nanoseconds
+	uint64_t stime;
+};
+
+/* Scheduler accounting, in nanoseconds from monotonic_ns. A task is always
+ * either running, waiting on the run queue or asleep, and last marks when it
+ * entered whichever it's in now
+ */
+struct sched_stats {
+	uint64_t last;
+	uint64_t runtime;
+	uint64_t wait_time;			// Runnable, but not running
+	uint64_t max_wait;
+	uint64_t sleep_time;
+	uint32_t uticks;			// Timer ticks that caught us in user mode
+	uint32_t sticks;			// ...and in the kernel
+	uint32_t nvcsw;				// Gave up the cpu
+	uint32_t nivcsw;			// Had it taken away
+	uint32_t woken;				// Queued by a wakeup rather than preemption
+	uint32_t lat_hist[SCHED_HIST_BUCKETS];	// Wakeup to running latency
+};
+
+// Resources shared by every thread of a process
 typedef struct {
-	pid_t pid;
-	pid_t gid;
-	pid_t sid;
-	uintptr_t esp, ebp;			// Stack and base pointers
-	uintptr_t eip;				// Instruction pointer
-	page_directory_t *page_dir;
+	uint32_t threads;			// Threads that haven't exited yet
+	struct task *leader;		// Thread the group was created with
+	uint32_t exiting;			// Set once any thread calls exit
+	int32_t exit;
 	uintptr_t brk;				// Heap end
 	uintptr_t brk_actual;		// Actual end of the memory allocated for
 								// the heap
 	uintptr_t start;			// Image start
+	char *cwd;
+	struct filep files[MAX_OF];
+	list_t *zombies;			// Exited children nobody has waited on yet
+	waitqueue_t *child_exit;
+	struct cputime dead;		// Threads that have already exited
+	struct cputime children;	// Children that have been waited on
+} thread_group_t;
+
+struct mutex;
+
+typedef struct task {
+	pid_t pid;					// Thread id
+	pid_t tgid;					// Thread group id, pid of the leader
+	pid_t gid;
+	pid_t sid;
+	uintptr_t esp;				// Saved kernel stack pointer
+	uintptr_t kernel_stack;		// Top of the kernel stack, loaded into the TSS
+	registers_t *regs;			// Trap frame of the syscall in progress
+	fpu_state_t *fpu;			// Saved FPU/SSE state, allocated on first use
+	page_directory_t *page_dir;
+	thread_group_t *group;		// NULL for tasklets
+	void *stack;				// Kernel stack of non-leader threads
+	uintptr_t tls;				// Base of the TLS segment
+	uint32_t flags;
 	int32_t exit;
 	int8_t nice;
+	uint32_t policy;			// SCHED_*
+	uint32_t rt_priority;		// 1 to RT_PRIO_MAX if real-time, 0 if not
+	uint32_t inherited_prio;	// Lent by whoever we're working for
+	uint32_t pi_prio;			// Lent by waiters on mutexes we hold
+	uint32_t prio;				// Effective, the highest of the three.
+								// Anything above 0 runs in the real-time class
+	uint32_t time_slice;		// Ticks left for SCHED_RR
 	uid_t ruid, euid, suid;
 	gid_t rgid, egid, sgid;
-	char *cwd;
 	char *cmd;
-	struct filep files[MAX_OF];
-	tree_node_t *treenode;		// Where it is in the process tree
+	tree_node_t *treenode;		// Where it is in the process tree. Threads
+								// share their leader's
 	waitqueue_t *wq;
 	uint32_t sleep_flags;
+	uintptr_t futex;			// Physical address of the futex we're waiting
+								// on, if any
+	struct mutex *blocked_on;	// Mutex we're waiting for, if any
+	struct mutex *pi_mutexes;	// Held mutexes that have waiters
+	uint32_t rcu_nesting;		// RCU read sections we're in. No preemption
+								// while nonzero
+	uint32_t preempt_count;		// Spinlocks held or waited on. Likewise
+	struct blk_plug *plug;		// Holding back block requests, if set
+	struct sched_stats stats;
+	struct cputime exit_time;	// Whole process, children included, once
+								// it's a zombie
 } task_t;
 
 typedef struct {
@@ -87,6 +212,7 @@ typedef struct {
 
 void init_tasking(uintptr_t ebp);
 pid_t fork(void);
+pid_t clone(uint32_t flags, uintptr_t stack, uintptr_t tls);
 tasklet_t *create_tasklet(tasklet_body_t body, const char *name, void *argp);
 int32_t schedule_tasklet(tasklet_t *tasklet);
 void reset_tasklet(tasklet_t *tasklet);
@@ -94,13 +220,37 @@ int32_t reset_and_reschedule(tasklet_t *tasklet);
 void destroy_tasklet(tasklet_t *tasklet);
 int switch_task(int reschedule);
 void exit_task(int32_t status);
+void exit_thread(int32_t status);
+void check_killed(registers_t *regs);
+void check_resched(registers_t *regs);
+void preempt_disable(void);
+void preempt_enable(void);
+int32_t set_scheduler(task_t *task, uint32_t policy, uint32_t prio);
+void sched_inherit(task_t *task, uint32_t prio);
+void sched_uninherit(task_t *task);
+void sched_pi_set(task_t *task, uint32_t prio);
+int32_t sched_setscheduler(pid_t pid, int32_t policy,
+	const struct sched_param *param);
+int32_t sched_getscheduler(pid_t pid);
+int32_t sched_getparam(pid_t pid, struct sched_param *param);
+pid_t wait4(pid_t pid, int32_t *status, int32_t options,
+	struct rusage *rusage);
+pid_t waitpid(pid_t pid, int32_t *status, int32_t options);
+void account_tick(registers_t *regs);
+void task_cputime(task_t *task, struct cputime *ct);
+clock_t times(struct tms *buf);
+int32_t getrusage(int32_t who, struct rusage *usage);
 waitqueue_t *create_waitqueue(void);
 void destroy_waitqueue(waitqueue_t *queue);
 int sleep_thread(waitqueue_t *wq, uint32_t flags);
 void wake_queue(waitqueue_t *wq);
+void wake_queue_all(waitqueue_t *wq);
+void wake_task(task_t *task);
 void switch_user_mode(uint32_t entry, int32_t argc, char **argv, char **envp,
 		uint32_t stack);
 pid_t getpid(void);
+pid_t gettid(void);
+int32_t set_thread_area(uintptr_t base);
 pid_t setpgid(pid_t pid, pid_t pgid);
 pid_t getpgid(pid_t pid);
 pid_t setsid(void);
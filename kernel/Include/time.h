@@ -57,6 +57,22 @@
 typedef unsigned int time_t;
 #endif /* TIME_T */
 
+#define CLOCK_REALTIME	0
+#define CLOCK_MONOTONIC	1
+
+typedef int clockid_t;
+typedef unsigned long clock_t;
+
+struct timeval {
+	time_t tv_sec;
+	long tv_usec;
+};
+
+struct timespec {
+	time_t tv_sec;
+	long tv_nsec;
+};
+
 struct tm {
 	int tm_sec;
 	int tm_min;
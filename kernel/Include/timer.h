@@ -46,14 +46,30 @@
 
 #define HZ			1000
 
+// Timer wheel geometry. The root vector resolves single ticks, each of the
+// outer four covers TVN_BITS more bits of the expiry
+#define TVR_BITS	8
+#define TVN_BITS	6
+#define TVR_SIZE	(1 << TVR_BITS)
+#define TVN_SIZE	(1 << TVN_BITS)
+#define TVR_MASK	(TVR_SIZE - 1)
+#define TVN_MASK	(TVN_SIZE - 1)
+
 struct timer {
-	void (*callback)(void);
+	void (*callback)(struct timer*);
 	uint32_t expires;
+	struct timer *next;		// Wheel slot links, managed by timer.c.
+	struct timer **pprev;	// pprev is NULL whenever the timer isn't pending
 };
 
+#define TIMER_INITIALIZER(cb) { .callback = (cb), .expires = 0, \
+	.next = NULL, .pprev = NULL }
+#define timer_pending(timer) ((timer)->pprev != NULL)
+
 void init_timer(void);
 int add_timer(struct timer *timer);
-void del_timer(struct timer *timer);
+int mod_timer(struct timer *timer, uint32_t expires);
+int del_timer(struct timer *timer);
 void sleep_until(uint32_t expires);
 
 #endif /* TIMER_H */
@@ -43,6 +43,7 @@
 #define O_CREAT			0x08
 #define O_EXCL			0x10
 #define O_TRUNC			0x20
+#define O_DIRECT		0x40	// Skip the cache where the device can
 
 #define VFS_O_EXEC		00001
 #define VFS_O_WRITE		00002
@@ -95,6 +96,14 @@ struct file_ops {
 		mode_t, dev_t);
 	int32_t (*link)(struct fs_node *, struct fs_node *, const char*);
 	int32_t (*unlink)(struct fs_node*, const char*);
+	int32_t (*fsync)(struct fs_node*, int32_t);	// Nonzero for data only
+};
+
+// Readahead for one open file, in cache blocks. See bcache.c
+struct file_ra {
+	uint32_t next;				// Where a sequential reader goes next
+	uint32_t size;				// Window. Grows while reads stay sequential
+	uint32_t end;				// Everything before here's been asked for
 };
 
 typedef struct fs_node {
@@ -116,6 +125,7 @@ typedef struct fs_node {
 	void *private_data;
 	int32_t refcount;
 	nlink_t nlink;
+	struct file_ra ra;			// Per open, like flags
 } fs_node_t;
 
 struct superblock {
@@ -166,6 +176,8 @@ int32_t stat_vfs(struct fs_node *node, struct stat *buff);
 int32_t chmod_vfs(fs_node_t *node, mode_t mode);
 int32_t chown_vfs(fs_node_t *node, uid_t uid, gid_t gid);
 int32_t ioctl_vfs(fs_node_t *node, uint32_t req, void *data);
+int32_t fsync_vfs(fs_node_t *node, int32_t datasync);
+int32_t sync_vfs(void);
 int32_t create_vfs(fs_node_t *parent, const char *fname, uid_t uid, 
 		gid_t gid, mode_t mode, dev_t dev);
 int32_t link_vfs(fs_node_t *parent, fs_node_t *child, const char *fname);
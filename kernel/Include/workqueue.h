@@ -0,0 +1,97 @@
+/* workqueue.h - deferred work run by pools of kernel threads */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <common.h>
+#include <task.h>
+#include <timer.h>
+
+#define WORK_PENDING		0x01	// Queued, or due to be run again
+#define WORK_RUNNING		0x02	// A worker is inside func right now
+
+#define SYSTEM_WQ_WORKERS	2
+
+#define WORK_INITIALIZER(f) { .func = (f), .next = NULL, .flags = 0, \
+	.wq = NULL, .prio = 0 }
+#define DELAYED_WORK_INITIALIZER(f) { .work = WORK_INITIALIZER(f), \
+	.timer = TIMER_INITIALIZER(delayed_work_timer), .wq = NULL }
+
+struct workqueue;
+
+/* A work item is only ever run by one worker at a time. Queueing it while
+ * it's already pending does nothing, and queueing it while it runs makes it
+ * run once more afterwards, so any number of requests for the same target
+ * get batched into as few runs as possible. The item has to stay around
+ * until it's finished: free it only after cancel_work_sync or flush_work
+ */
+struct work {
+	void (*func)(struct work *);
+	struct work *next;
+	uint32_t flags;
+	struct workqueue *wq;			// Queue it was last queued on
+	uint32_t prio;					// Highest priority of anyone waiting on
+									// the next run
+};
+
+struct delayed_work {
+	struct work work;
+	struct timer timer;
+	struct workqueue *wq;
+};
+
+typedef struct workqueue {
+	struct work *head, *tail;		// Pending items, oldest first
+	uint32_t active;				// Items being run right now
+	uint32_t nworkers;
+	uint32_t dying;
+	tasklet_t **workers;
+	waitqueue_t *more_work;			// Idle workers wait here
+	waitqueue_t *done;				// Flushers wait here
+} workqueue_t;
+
+extern workqueue_t *system_wq;
+
+void init_workqueues(void);
+workqueue_t *create_workqueue(const char *name, uint32_t nworkers);
+void destroy_workqueue(workqueue_t *wq);
+void init_work(struct work *work, void (*func)(struct work *));
+void init_delayed_work(struct delayed_work *dwork,
+	void (*func)(struct work *));
+int32_t set_workqueue_scheduler(workqueue_t *wq, uint32_t policy,
+	uint32_t prio);
+int queue_work(workqueue_t *wq, struct work *work);
+int queue_work_inherit(workqueue_t *wq, struct work *work);
+int queue_delayed_work(workqueue_t *wq, struct delayed_work *dwork,
+	uint32_t delay);
+int cancel_work(struct work *work);
+int cancel_work_sync(struct work *work);
+int cancel_delayed_work(struct delayed_work *dwork);
+int cancel_delayed_work_sync(struct delayed_work *dwork);
+void flush_work(struct work *work);
+void flush_workqueue(workqueue_t *wq);
+void delayed_work_timer(struct timer *timer);
+
+#define schedule_work(work) queue_work(system_wq, (work))
+#define schedule_delayed_work(dwork, delay) \
+	queue_delayed_work(system_wq, (dwork), (delay))
+
+#endif /* WORKQUEUE_H */
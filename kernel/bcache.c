@@ -0,0 +1,723 @@
+/* bcache.c - Block buffer cache. Device blocks are kept in memory, looked
+ * up by hash, and the least recently used clean ones get reused first
+ */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <common.h>
+#include <bcache.h>
+#include <block.h>
+#include <task.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <errno.h>
+#include <timer.h>
+#include <printf.h>
+
+extern volatile uint32_t tick;
+extern volatile task_t *current_task;
+
+static struct buffer *bcache_hash[BCACHE_HASH_SIZE];
+static struct buffer *lru_head = NULL;
+static struct buffer *lru_tail = NULL;
+static uint32_t nbuffers = 0;
+
+/* Guards the hash, the LRU list, refcounts and nbuffers. Completions drop
+ * references from real-time servicers, so it's always taken with interrupts
+ * off to keep a holder from being preempted by one
+ */
+static DEFINE_SPINLOCK(bcache_lock);
+
+// Everybody waiting on a locked buffer
+static waitqueue_t *bcache_wq = NULL;
+
+static volatile uint32_t ndirty = 0;
+
+// The flusher sleeps here between passes
+static waitqueue_t *flusher_wq = NULL;
+
+static void flusher(void *argp);
+
+static void flusher_timeout(struct timer *timer) {
+	wake_queue(flusher_wq);
+}
+
+static struct timer flusher_timer = TIMER_INITIALIZER(flusher_timeout);
+
+void init_bcache(void) {
+	uint32_t i;
+	for (i = 0; i < BCACHE_HASH_SIZE; i++)
+		bcache_hash[i] = NULL;
+
+	bcache_wq = create_waitqueue();
+	ASSERT(bcache_wq);
+
+	flusher_wq = create_waitqueue();
+	ASSERT(flusher_wq);
+
+	tasklet_t *task = create_tasklet(flusher, "[bflush]", NULL);
+	ASSERT(task);
+	ASSERT(schedule_tasklet(task) == 0);
+}
+
+static struct buffer **hash_bucket(dev_t dev, uint32_t block) {
+	uint32_t key = ((uint32_t)dev * 31 + block) * 0x9E370001;
+	return &bcache_hash[key >> (32 - BCACHE_HASH_BITS)];
+}
+
+static void hash_insert(struct buffer *buf) {
+	struct buffer **bucket = hash_bucket(buf->dev, buf->block);
+	buf->hash_next = *bucket;
+	*bucket = buf;
+}
+
+static void hash_remove(struct buffer *buf) {
+	struct buffer **iter;
+	for (iter = hash_bucket(buf->dev, buf->block); *iter;
+			iter = &(*iter)->hash_next) {
+		if (*iter == buf) {
+			*iter = buf->hash_next;
+			break;
+		}
+	}
+	buf->hash_next = NULL;
+}
+
+static struct buffer *hash_find(dev_t dev, uint32_t block) {
+	struct buffer *buf;
+	for (buf = *hash_bucket(dev, block); buf; buf = buf->hash_next) {
+		if (buf->dev == dev && buf->block == block)
+			return buf;
+	}
+	return NULL;
+}
+
+static void lru_remove(struct buffer *buf) {
+	if (buf->lru_prev)
+		buf->lru_prev->lru_next = buf->lru_next;
+	else
+		lru_head = buf->lru_next;
+	if (buf->lru_next)
+		buf->lru_next->lru_prev = buf->lru_prev;
+	else
+		lru_tail = buf->lru_prev;
+	buf->lru_prev = buf->lru_next = NULL;
+}
+
+static void lru_push(struct buffer *buf) {
+	buf->lru_prev = NULL;
+	buf->lru_next = lru_head;
+	if (lru_head)
+		lru_head->lru_prev = buf;
+	else
+		lru_tail = buf;
+	lru_head = buf;
+}
+
+// Oldest buffer nobody's using. Clean ones only unless dirty is set
+static struct buffer *find_victim(int dirty) {
+	struct buffer *buf;
+	for (buf = lru_tail; buf; buf = buf->lru_prev) {
+		if (buf->refcount || (buf->flags & BUF_LOCKED))
+			continue;
+		if (!dirty && (buf->flags & BUF_DIRTY))
+			continue;
+		return buf;
+	}
+	return NULL;
+}
+
+static void set_identity(struct buffer *buf, dev_t dev, uint32_t block,
+		size_t size) {
+	buf->dev = dev;
+	buf->block = block;
+	buf->size = size;
+	buf->flags = 0;
+	buf->refcount = 1;
+	hash_insert(buf);
+	lru_push(buf);
+}
+
+static struct buffer *alloc_buffer(void) {
+	struct buffer *buf = (struct buffer *)kmalloc(sizeof(struct buffer));
+	if (!buf)
+		return NULL;
+
+	// Page aligned, so it's a single physically contiguous bio
+	buf->data = kmemalign(PAGE_SIZE, BCACHE_BLOCK_SIZE);
+	if (!buf->data) {
+		kfree(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+static void free_buffer(struct buffer *buf) {
+	kfree(buf->data);
+	kfree(buf);
+}
+
+// A request covering the whole buffer, which has to be locked
+static request_t *buffer_request(struct buffer *buf, uint32_t flags) {
+	size_t sector_size = get_block_size(buf->dev);
+	request_t *req = create_request_blkdev(buf->dev,
+		buf->block * (BCACHE_BLOCK_SIZE / sector_size), flags);
+	if (!req)
+		return NULL;
+
+	bio_t *bio = (bio_t *)kmalloc(sizeof(bio_t));
+	if (!bio) {
+		free_request(req);
+		return NULL;
+	}
+
+	bio->page = resolve_physical((uintptr_t)buf->data);
+	bio->offset = bio->page % PAGE_SIZE;
+	bio->page = (bio->page / PAGE_SIZE) * PAGE_SIZE;
+	bio->nsectors = buf->size / sector_size;
+
+	if (add_bio_to_request_blkdev(req, bio) < 0) {
+		kfree(bio);
+		free_request(req);
+		return NULL;
+	}
+
+	return req;
+}
+
+// Moves the whole buffer to or from the disk. It has to be locked
+static int32_t buffer_io(struct buffer *buf, uint32_t flags) {
+	request_t *req = buffer_request(buf, flags);
+	if (!req)
+		return -ENOMEM;
+
+	int32_t ret = post_and_wait_blkdev(req);
+	free_request(req);
+
+	return ret < 0 ? ret : 0;
+}
+
+/* Find or make the buffer for a block, without reading it in. The caller
+ * holds a reference until brelse. NULL past the end of the device
+ */
+struct buffer *bget(dev_t dev, uint32_t block) {
+	size_t sector_size = get_block_size(dev);
+	uint32_t sectors = get_dev_sectors(dev);
+	if (!sector_size || !sectors)
+		return NULL;
+
+	ASSERT(sector_size <= BCACHE_BLOCK_SIZE &&
+		BCACHE_BLOCK_SIZE % sector_size == 0);
+
+	uint32_t per_block = BCACHE_BLOCK_SIZE / sector_size;
+	if (block >= (sectors + per_block - 1) / per_block)
+		return NULL;
+
+	size_t size = BCACHE_BLOCK_SIZE;
+	if ((block + 1) * per_block > sectors)
+		size = (sectors - block * per_block) * sector_size;
+
+	struct buffer *fresh = NULL;
+	int reuse = 1;
+	while (1) {
+		uint32_t eflags = spin_lock_irqsave(&bcache_lock);
+
+		struct buffer *buf = hash_find(dev, block);
+		if (buf) {
+			buf->refcount++;
+			lru_remove(buf);
+			lru_push(buf);
+			spin_unlock_irqrestore(&bcache_lock, eflags);
+			if (fresh)
+				free_buffer(fresh);
+			return buf;
+		}
+
+		if (fresh) {
+			nbuffers++;
+			set_identity(fresh, dev, block, size);
+			spin_unlock_irqrestore(&bcache_lock, eflags);
+			return fresh;
+		}
+
+		if (nbuffers >= BCACHE_MAX && reuse) {
+			buf = find_victim(0);
+			if (buf) {
+				hash_remove(buf);
+				lru_remove(buf);
+				set_identity(buf, dev, block, size);
+				spin_unlock_irqrestore(&bcache_lock, eflags);
+				return buf;
+			}
+
+			/* Everything old is dirty. Clean one and try again, unless that
+			 * might mean waiting on ourselves
+			 */
+			buf = NULL;
+			if (!current_task || !(current_task->flags & TASK_NOWRITEBACK))
+				buf = find_victim(1);
+			if (buf) {
+				buf->refcount++;
+				spin_unlock_irqrestore(&bcache_lock, eflags);
+				if (bwrite(buf) < 0)
+					reuse = 0;
+				brelse(buf);
+				continue;
+			}
+		}
+
+		// Below the limit, or everything's in use. Grow for now
+		spin_unlock_irqrestore(&bcache_lock, eflags);
+		fresh = alloc_buffer();
+		if (!fresh)
+			return NULL;
+	}
+}
+
+// The block, read in if we don't have it yet
+struct buffer *bread(dev_t dev, uint32_t block) {
+	struct buffer *buf = bget(dev, block);
+	if (!buf || (buf->flags & BUF_UPTODATE))
+		return buf;
+
+	lock_buffer(buf);
+	if (!(buf->flags & BUF_UPTODATE)) {
+		if (buffer_io(buf, 0) < 0) {
+			unlock_buffer(buf);
+			brelse(buf);
+			return NULL;
+		}
+		__sync_or_and_fetch(&buf->flags, BUF_UPTODATE);
+	}
+	unlock_buffer(buf);
+
+	return buf;
+}
+
+static int trylock_buffer(struct buffer *buf) {
+	return !(__sync_fetch_and_or(&buf->flags, BUF_LOCKED) & BUF_LOCKED);
+}
+
+static void readahead_end_io(request_t *req) {
+	struct buffer *buf = (struct buffer *)req->private;
+	if (req->rc == 0)
+		__sync_or_and_fetch(&buf->flags, BUF_UPTODATE);
+	free_request(req);
+
+	// Anyone who wanted it sooner is sleeping in lock_buffer
+	unlock_buffer(buf);
+	brelse(buf);
+}
+
+/* Start blocks on their way in without waiting for them. Each one stays
+ * locked until it's arrived, so bread on it just waits for that
+ */
+void breadahead(dev_t dev, uint32_t block, uint32_t count) {
+	struct blk_plug plug;
+	blk_start_plug(&plug);
+
+	for (; count; block++, count--) {
+		struct buffer *buf = bget(dev, block);
+		if (!buf)
+			break;
+
+		// Already here, or already on its way
+		if ((buf->flags & BUF_UPTODATE) || !trylock_buffer(buf)) {
+			brelse(buf);
+			continue;
+		}
+		if (buf->flags & BUF_UPTODATE) {
+			unlock_buffer(buf);
+			brelse(buf);
+			continue;
+		}
+
+		request_t *req = buffer_request(buf, 0);
+		if (!req) {
+			unlock_buffer(buf);
+			brelse(buf);
+			break;
+		}
+
+		submit_request_blkdev(req, readahead_end_io, buf);
+	}
+
+	// Adjacent blocks merged while we were plugged. Off they go
+	blk_finish_plug(&plug);
+}
+
+/* Called before reading count blocks from block through an open file.
+ * Sequential readers get a window read ahead of them that doubles each
+ * time, up to the device's limit, and is topped up once they're halfway
+ * through it. Anything else halves the window and only what's being read
+ * gets fetched, though still all at once
+ */
+void file_readahead(struct file_ra *ra, dev_t dev, uint32_t block,
+		uint32_t count) {
+	blkdev_t *blockdev = get_blkdev(dev);
+	if (!blockdev || !count)
+		return;
+
+	uint32_t max = (uint64_t)blockdev->ra_sectors * blockdev->sector_size /
+		BCACHE_BLOCK_SIZE;
+	if (max > RA_MAX_BLOCKS)
+		max = RA_MAX_BLOCKS;
+
+	uint32_t per_block = BCACHE_BLOCK_SIZE / blockdev->sector_size;
+	uint32_t nblocks = (get_dev_sectors(dev) + per_block - 1) / per_block;
+
+	uint32_t start = block;
+	uint32_t end = block + count;
+
+	if (block == ra->next) {
+		ra->size = ra->size ? ra->size * 2 : RA_MIN_BLOCKS;
+		if (ra->size > max)
+			ra->size = max;
+		ra->next = end;
+
+		if (ra->end > start)
+			start = ra->end;
+		if (ra->end < ra->next + ra->size / 2)
+			end = ra->next + ra->size;
+		if (end > ra->end)
+			ra->end = end;
+	} else {
+		ra->size /= 2;
+		ra->next = end;
+		ra->end = end;
+	}
+
+	// Nothing past the end of the device
+	if (end > nblocks)
+		end = nblocks;
+	if (start < end)
+		breadahead(dev, start, end - start);
+}
+
+void brelse(struct buffer *buf) {
+	uint32_t eflags = spin_lock_irqsave(&bcache_lock);
+	ASSERT(buf->refcount > 0);
+
+	// Give back what we grew by while everything was busy
+	if (--buf->refcount == 0 && nbuffers > BCACHE_MAX &&
+			!(buf->flags & (BUF_DIRTY | BUF_LOCKED))) {
+		hash_remove(buf);
+		lru_remove(buf);
+		nbuffers--;
+		spin_unlock_irqrestore(&bcache_lock, eflags);
+		free_buffer(buf);
+		return;
+	}
+
+	spin_unlock_irqrestore(&bcache_lock, eflags);
+}
+
+// Exclusive use of the buffer, for I/O or changing its contents
+void lock_buffer(struct buffer *buf) {
+	// Whoever has it may need what we're holding back to finish
+	if (buf->flags & BUF_LOCKED)
+		blk_flush_plug();
+
+	uint32_t eflags = irq_save();
+	while (buf->flags & BUF_LOCKED)
+		sleep_thread(bcache_wq, 0);
+	__sync_or_and_fetch(&buf->flags, BUF_LOCKED);
+	irq_restore(eflags);
+}
+
+void unlock_buffer(struct buffer *buf) {
+	__sync_and_and_fetch(&buf->flags, ~BUF_LOCKED);
+	wake_queue_all(bcache_wq);
+}
+
+static int set_dirty(struct buffer *buf) {
+	if (__sync_fetch_and_or(&buf->flags, BUF_UPTODATE | BUF_DIRTY) & BUF_DIRTY)
+		return 0;
+
+	buf->dirtied = tick;
+	__sync_add_and_fetch(&ndirty, 1);
+	return 1;
+}
+
+static int clear_dirty(struct buffer *buf) {
+	if (!(__sync_fetch_and_and(&buf->flags, ~BUF_DIRTY) & BUF_DIRTY))
+		return 0;
+
+	__sync_sub_and_fetch(&ndirty, 1);
+	return 1;
+}
+
+// Contents are newer than the disk. The flusher writes it back later
+void bdirty(struct buffer *buf) {
+	if (set_dirty(buf) && ndirty >= BCACHE_DIRTY_BACKGROUND)
+		wake_queue(flusher_wq);
+}
+
+// Write the buffer back now if it's dirty
+int32_t bwrite(struct buffer *buf) {
+	int32_t ret = 0;
+
+	lock_buffer(buf);
+	if (clear_dirty(buf)) {
+		ret = buffer_io(buf, BLOCK_DIR_WRITE);
+		if (ret < 0)
+			set_dirty(buf);
+	}
+	unlock_buffer(buf);
+
+	return ret;
+}
+
+static int in_range(struct buffer *buf, dev_t dev, uint32_t block,
+		uint32_t count) {
+	if (dev && buf->dev != dev)
+		return 0;
+
+	return buf->block >= block && buf->block - block < count;
+}
+
+static void writeback_end_io(request_t *req) {
+	struct buffer *buf = (struct buffer *)req->private;
+	if (req->rc < 0) {
+		printf("bcache: error %d writing block %d of device %d %d\n",
+			req->rc, buf->block, MAJOR(buf->dev), MINOR(buf->dev));
+		__sync_or_and_fetch(&buf->flags, BUF_WRITE_ERROR);
+	}
+	free_request(req);
+
+	unlock_buffer(buf);
+	brelse(buf);
+}
+
+/* Start a batch of dirty buffers in range on their way to the disk, in
+ * sector order, without waiting. Only ones dirty since before expired if
+ * it's set. If held isn't NULL, it gets an extra reference to each, to
+ * wait on them with. Returns how many went
+ */
+static uint32_t writeback(dev_t dev, uint32_t block, uint32_t count,
+		int expired, struct buffer **held) {
+	struct buffer *batch[BCACHE_WRITEBACK_BATCH];
+	uint32_t n = 0;
+
+	uint32_t eflags = spin_lock_irqsave(&bcache_lock);
+	struct buffer *buf;
+	// Oldest first
+	for (buf = lru_tail; buf && n < BCACHE_WRITEBACK_BATCH; buf = buf->lru_prev) {
+		if (!(buf->flags & BUF_DIRTY) || (buf->flags & BUF_LOCKED))
+			continue;
+		if (!in_range(buf, dev, block, count))
+			continue;
+		if (expired && (int32_t)(tick - buf->dirtied) < BCACHE_DIRTY_EXPIRE)
+			continue;
+
+		buf->refcount++;
+		batch[n++] = buf;
+	}
+	spin_unlock_irqrestore(&bcache_lock, eflags);
+
+	// Sort by where they are on disk, so they go out in one sweep
+	uint32_t i, j;
+	for (i = 1; i < n; i++) {
+		buf = batch[i];
+		for (j = i; j > 0 && (batch[j - 1]->dev > buf->dev ||
+				(batch[j - 1]->dev == buf->dev &&
+				batch[j - 1]->block > buf->block)); j--)
+			batch[j] = batch[j - 1];
+		batch[j] = buf;
+	}
+
+	struct blk_plug plug;
+	blk_start_plug(&plug);
+
+	uint32_t sent = 0;
+	for (i = 0; i < n; i++) {
+		buf = batch[i];
+		lock_buffer(buf);
+		if (!clear_dirty(buf)) {
+			unlock_buffer(buf);
+			brelse(buf);
+			continue;
+		}
+
+		request_t *req = buffer_request(buf, BLOCK_DIR_WRITE);
+		if (!req) {
+			set_dirty(buf);
+			unlock_buffer(buf);
+			brelse(buf);
+			continue;
+		}
+
+		if (held) {
+			eflags = spin_lock_irqsave(&bcache_lock);
+			buf->refcount++;
+			spin_unlock_irqrestore(&bcache_lock, eflags);
+			held[sent] = buf;
+		}
+		sent++;
+
+		submit_request_blkdev(req, writeback_end_io, buf);
+	}
+
+	blk_finish_plug(&plug);
+
+	return sent;
+}
+
+// Wait for what writeback sent, and give back the references
+static int32_t wait_written(struct buffer **held, uint32_t n) {
+	int32_t ret = 0;
+
+	uint32_t i;
+	for (i = 0; i < n; i++) {
+		lock_buffer(held[i]);
+		if (__sync_fetch_and_and(&held[i]->flags, ~BUF_WRITE_ERROR) &
+				BUF_WRITE_ERROR)
+			ret = -EIO;
+		unlock_buffer(held[i]);
+		brelse(held[i]);
+	}
+
+	return ret;
+}
+
+/* Write back every dirty buffer of a device from block on, or of all of
+ * them if dev is 0, and wait for it to get there
+ */
+int32_t bflush_range(dev_t dev, uint32_t block, uint32_t count) {
+	struct buffer *held[BCACHE_WRITEBACK_BATCH];
+	int32_t ret = 0;
+
+	uint32_t n;
+	while ((n = writeback(dev, block, count, 0, held)) > 0) {
+		int32_t err = wait_written(held, n);
+		if (err < 0)
+			ret = err;
+	}
+
+	// The flusher may have had some on the way already. Its errors are
+	// ours to report too
+	n = 0;
+	uint32_t eflags = spin_lock_irqsave(&bcache_lock);
+	struct buffer *buf;
+	for (buf = lru_head; buf && n < BCACHE_WRITEBACK_BATCH; buf = buf->lru_next) {
+		if (in_range(buf, dev, block, count) &&
+				(buf->flags & (BUF_LOCKED | BUF_WRITE_ERROR))) {
+			buf->refcount++;
+			held[n++] = buf;
+		}
+	}
+	spin_unlock_irqrestore(&bcache_lock, eflags);
+
+	int32_t err = wait_written(held, n);
+	if (err < 0)
+		ret = err;
+
+	return ret;
+}
+
+int32_t bflush(dev_t dev) {
+	return bflush_range(dev, 0, (uint32_t)-1);
+}
+
+// Too much is dirty. Writers write some back themselves until it isn't
+void balance_dirty(void) {
+	struct buffer *held[BCACHE_WRITEBACK_BATCH];
+
+	// Left to the flusher and everyone else
+	if (current_task && (current_task->flags & TASK_NOWRITEBACK))
+		return;
+
+	while (ndirty >= BCACHE_DIRTY_LIMIT) {
+		uint32_t n = writeback(0, 0, (uint32_t)-1, 0, held);
+		if (n == 0)
+			break;
+		wait_written(held, n);
+	}
+}
+
+// Whether the flusher's writeback would find anything to send right now
+static int writeback_due(void) {
+	int expired = (ndirty < BCACHE_DIRTY_BACKGROUND);
+
+	uint32_t eflags = spin_lock_irqsave(&bcache_lock);
+	struct buffer *buf;
+	for (buf = lru_tail; buf; buf = buf->lru_prev) {
+		if (!(buf->flags & BUF_DIRTY) || (buf->flags & BUF_LOCKED))
+			continue;
+		if (!expired || (int32_t)(tick - buf->dirtied) >= BCACHE_DIRTY_EXPIRE)
+			break;
+	}
+	spin_unlock_irqrestore(&bcache_lock, eflags);
+
+	return buf != NULL;
+}
+
+/* Writes back whatever's been dirty too long every so often, and
+ * everything when there's too much of it
+ */
+static void flusher(void *argp) {
+	while (1) {
+		while (writeback(0, 0, (uint32_t)-1,
+				ndirty < BCACHE_DIRTY_BACKGROUND, NULL) > 0)
+			continue;
+
+		// Checked with interrupts off, so a wakeup from bdirty can't slip in
+		// between and be lost
+		uint32_t eflags = irq_save();
+		if (!writeback_due()) {
+			mod_timer(&flusher_timer, tick + BCACHE_WRITEBACK_INTERVAL);
+			sleep_thread(flusher_wq, 0);
+		}
+		irq_restore(eflags);
+	}
+}
+
+/* The disk changed under the cache. Drop what nobody's using, and make
+ * anyone who is read it in again. Dirty buffers are left alone, since
+ * they're newer still
+ */
+void binvalidate_range(dev_t dev, uint32_t block, uint32_t count) {
+	struct buffer *dead = NULL;
+
+	uint32_t eflags = spin_lock_irqsave(&bcache_lock);
+	struct buffer *buf = lru_head;
+	while (buf) {
+		struct buffer *next = buf->lru_next;
+		if (in_range(buf, dev, block, count) && !(buf->flags & BUF_DIRTY)) {
+			if (buf->refcount || (buf->flags & BUF_LOCKED))
+				__sync_and_and_fetch(&buf->flags, ~BUF_UPTODATE);
+			else {
+				hash_remove(buf);
+				lru_remove(buf);
+				nbuffers--;
+				buf->hash_next = dead;
+				dead = buf;
+			}
+		}
+		buf = next;
+	}
+	spin_unlock_irqrestore(&bcache_lock, eflags);
+
+	while (dead) {
+		buf = dead;
+		dead = buf->hash_next;
+		free_buffer(buf);
+	}
+}
@@ -0,0 +1,417 @@
+/* loop.c - Block devices backed by files, so images can be mounted */
+
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <common.h>
+#include <blkdev/loop.h>
+#include <block.h>
+#include <elevator.h>
+#include <bcache.h>
+#include <vfs.h>
+#include <fileops.h>
+#include <paging.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <printf.h>
+#include <errno.h>
+#include <workqueue.h>
+#include <structures/mutex.h>
+#include <task.h>
+
+extern volatile task_t *current_task;
+
+static int32_t open(fs_node_t *node, uint32_t flags) { return 0; }
+static int32_t close(fs_node_t *node) { return 0; }
+static int32_t ioctl(fs_node_t *node, uint32_t req, void *data);
+
+struct file_ops loop_fops = {
+	.open = open,
+	.close = close,
+	.ioctl = ioctl,
+};
+
+static workqueue_t *loop_workqueue = NULL;
+static struct loop *loops[LOOP_COUNT];
+
+static int32_t request_loop(blkdev_t *dev) {
+	struct loop *lo = (struct loop *)dev->private_data;
+
+	queue_work_inherit(loop_workqueue, &lo->servicer);
+
+	return 0;
+}
+
+// Returns the number of sectors moved, or a negative error
+static int32_t loop_access(struct loop *lo, request_t *req) {
+	if (!lo->backing)
+		return -ENXIO;
+	if (req->first_sector + req->nsectors > lo->blkdev->size)
+		return -EIO;
+
+	int write = (req->flags & BLOCK_DIR_WRITE) ? 1 : 0;
+	if (write && (lo->info.flags & LO_FLAGS_READ_ONLY))
+		return -EROFS;
+
+	off_t off = lo->info.offset +
+		(off_t)req->first_sector * LOOP_SECTOR_SIZE;
+	uint32_t done = 0;
+
+	node_t *node;
+	foreach(node, req->bios) {
+		if (done == req->nsectors)
+			break;
+
+		bio_t *bio = (bio_t *)node->data;
+		uint32_t nsects = bio->nsectors;
+		if (nsects > req->nsectors - done)
+			nsects = req->nsectors - done;
+
+		void *map = (void *)kernel_map(bio->page);
+		if (!map)
+			break;
+
+		void *buf = map + bio->offset;
+		size_t len = nsects * LOOP_SECTOR_SIZE;
+		ssize_t ret;
+		if (write)
+			ret = write_vfs(lo->backing, buf, len, off);
+		else {
+			ret = read_vfs(lo->backing, buf, len, off);
+			// Past the end of the file reads as zeroes
+			if (ret >= 0 && (size_t)ret < len) {
+				memset(buf + ret, 0, len - ret);
+				ret = len;
+			}
+		}
+		kernel_unmap((uintptr_t)map);
+
+		if (ret < 0)
+			return done ? (int32_t)done : (int32_t)ret;
+
+		nsects = ret / LOOP_SECTOR_SIZE;
+		off += nsects * LOOP_SECTOR_SIZE;
+		done += nsects;
+		if ((size_t)ret < len)
+			break;
+	}
+
+	return (int32_t)done;
+}
+
+static void loop_work(struct work *work) {
+	struct loop *lo = container_of(work, struct loop, servicer);
+
+	while (1) {
+		request_t *req = next_ready_request_blkdev(lo->blkdev);
+		if (!req)
+			break;
+
+		/* Writing to the file can dirty the cache. Writing back what's in
+		 * it could mean sending requests to ourselves, which we'd never
+		 * get to while we're busy here
+		 */
+		current_task->flags |= TASK_NOWRITEBACK;
+		acquire_mutex(lo->mutex);
+		int32_t sectors_xferred = loop_access(lo, req);
+		release_mutex(lo->mutex);
+		current_task->flags &= ~TASK_NOWRITEBACK;
+
+		if (sectors_xferred < 0)
+			end_request(req, sectors_xferred, 0);
+		else if (sectors_xferred == 0)
+			end_request(req, -EIO, 0);
+		else
+			end_request(req, 0, (uint32_t)sectors_xferred);
+	}
+}
+
+// Backing file size in bytes
+static off_t backing_size(fs_node_t *node) {
+	if (node->mode & VFS_BLOCKDEV)
+		return (off_t)get_dev_sectors(node->dev) * get_block_size(node->dev);
+
+	return node->len;
+}
+
+// Recompute the device size from the file and info. lo->mutex held
+static void loop_resize(struct loop *lo) {
+	blkdev_t *dev = lo->blkdev;
+
+	uint64_t size = 0;
+	if (lo->backing) {
+		off_t len = backing_size(lo->backing);
+		if (len > (off_t)lo->info.offset)
+			size = len - lo->info.offset;
+		if (lo->info.sizelimit && size > lo->info.sizelimit)
+			size = lo->info.sizelimit;
+	}
+
+	struct part *part0 = (struct part *)dev->partitions->head->data;
+	acquire_mutex(dev->mutex);
+	dev->size = size / LOOP_SECTOR_SIZE;
+	part0->size = dev->size;
+	release_mutex(dev->mutex);
+}
+
+/* Cached blocks belong to whatever was bound before, so they go once the
+ * mapping changes. Callers bflush first, while the old mapping's still in
+ * place and without lo->mutex, since the servicer needs it to write them
+ */
+static void loop_drop_cache(struct loop *lo) {
+	binvalidate_range(MKDEV(LOOP_MAJOR, lo->blkdev->minor), 0, 0xFFFFFFFF);
+}
+
+// Only our copy of the node changes, never the caller's
+static void loop_set_direct(struct loop *lo, uint32_t direct) {
+	lo->backing->flags &= ~O_DIRECT;
+	if (direct)
+		lo->backing->flags |= O_DIRECT;
+}
+
+static int32_t loop_set_fd(struct loop *lo, int32_t fd) {
+	struct filep *filep = get_filep(fd);
+	if (!filep)
+		return -EBADF;
+
+	fs_node_t *file = filep->file;
+	if (file->mode & VFS_DIR)
+		return -EINVAL;
+	if ((file->mode & VFS_BLOCKDEV) &&
+			file->dev == MKDEV(LOOP_MAJOR, lo->blkdev->minor))
+		return -EINVAL;
+
+	acquire_mutex(lo->mutex);
+	if (lo->backing) {
+		release_mutex(lo->mutex);
+		return -EBUSY;
+	}
+
+	/* Open files can share a node, and flags and readahead live in it, so
+	 * hold the file but do our I/O through a private copy
+	 */
+	lo->file = clone_file(file);
+	if (!lo->file) {
+		release_mutex(lo->mutex);
+		return -ENOMEM;
+	}
+
+	lo->backing = (fs_node_t *)kmalloc(sizeof(fs_node_t));
+	if (!lo->backing) {
+		close_vfs(lo->file);
+		lo->file = NULL;
+		release_mutex(lo->mutex);
+		return -ENOMEM;
+	}
+	memcpy(lo->backing, lo->file, sizeof(fs_node_t));
+	lo->backing->refcount = -1;
+	memset(&lo->backing->ra, 0, sizeof(struct file_ra));
+
+	lo->backing_flags = lo->backing->flags;
+	memset(&lo->info, 0, sizeof(struct loop_info));
+	if (!(lo->backing_flags & O_WRONLY))
+		lo->info.flags |= LO_FLAGS_READ_ONLY;
+	if (lo->backing_flags & O_DIRECT)
+		lo->info.flags |= LO_FLAGS_DIRECT_IO;
+	loop_resize(lo);
+
+	release_mutex(lo->mutex);
+
+	loop_drop_cache(lo);
+
+	return 0;
+}
+
+static int32_t loop_clr_fd(struct loop *lo) {
+	if (!lo->backing)
+		return -ENXIO;
+
+	bflush(MKDEV(LOOP_MAJOR, lo->blkdev->minor));
+
+	acquire_mutex(lo->mutex);
+	fs_node_t *backing = lo->backing;
+	if (!backing) {
+		release_mutex(lo->mutex);
+		return -ENXIO;
+	}
+
+	fs_node_t *file = lo->file;
+	lo->backing = NULL;
+	lo->file = NULL;
+	loop_resize(lo);
+	release_mutex(lo->mutex);
+
+	loop_drop_cache(lo);
+
+	fsync_vfs(backing, 0);
+	kfree(backing);
+	close_vfs(file);
+
+	return 0;
+}
+
+static int32_t loop_set_status(struct loop *lo, struct loop_info *info) {
+	if (info->offset % LOOP_SECTOR_SIZE)
+		return -EINVAL;
+	if (info->flags & ~(LO_FLAGS_READ_ONLY | LO_FLAGS_DIRECT_IO))
+		return -EINVAL;
+
+	bflush(MKDEV(LOOP_MAJOR, lo->blkdev->minor));
+
+	acquire_mutex(lo->mutex);
+	if (!lo->backing) {
+		release_mutex(lo->mutex);
+		return -ENXIO;
+	}
+
+	// A read only file can't be made writable through us
+	uint32_t flags = info->flags;
+	if (!(lo->backing_flags & O_WRONLY))
+		flags |= LO_FLAGS_READ_ONLY;
+
+	int remap = (info->offset != lo->info.offset);
+	lo->info.offset = info->offset;
+	lo->info.sizelimit = info->sizelimit;
+	lo->info.flags = flags;
+	loop_set_direct(lo, flags & LO_FLAGS_DIRECT_IO);
+	loop_resize(lo);
+	release_mutex(lo->mutex);
+
+	if (remap)
+		loop_drop_cache(lo);
+
+	return 0;
+}
+
+static int32_t ioctl(fs_node_t *node, uint32_t req, void *data) {
+	if (MINOR(node->dev) >= LOOP_COUNT)
+		return -ENODEV;
+
+	struct loop *lo = loops[MINOR(node->dev)];
+	if (!lo)
+		return -ENODEV;
+
+	switch (req) {
+	case LOOP_SET_FD:
+		if (!data)
+			return -EFAULT;
+		return loop_set_fd(lo, *(int32_t *)data);
+	case LOOP_CLR_FD:
+		return loop_clr_fd(lo);
+	case LOOP_SET_STATUS:
+		if (!data)
+			return -EFAULT;
+		return loop_set_status(lo, (struct loop_info *)data);
+	case LOOP_GET_STATUS:
+		if (!data)
+			return -EFAULT;
+		acquire_mutex(lo->mutex);
+		if (!lo->backing) {
+			release_mutex(lo->mutex);
+			return -ENXIO;
+		}
+		memcpy(data, &lo->info, sizeof(struct loop_info));
+		release_mutex(lo->mutex);
+		return 0;
+	}
+
+	return -ENOTTY;
+}
+
+static struct loop *loop_create(uint32_t index) {
+	struct loop *lo = (struct loop *)kmalloc(sizeof(struct loop));
+	if (!lo)
+		return NULL;
+
+	memset(lo, 0, sizeof(struct loop));
+	init_work(&lo->servicer, loop_work);
+
+	lo->mutex = create_mutex(0);
+	if (!lo->mutex) {
+		kfree(lo);
+		return NULL;
+	}
+
+	blkdev_t *dev = alloc_blkdev();
+	if (!dev) {
+		destroy_mutex(lo->mutex);
+		kfree(lo);
+		return NULL;
+	}
+
+	dev->major = LOOP_MAJOR;
+	dev->minor = index;
+	dev->max_part = 1;
+	dev->sector_size = LOOP_SECTOR_SIZE;
+	dev->size = 0;				// Until something's bound
+	dev->handler = request_loop;
+	dev->private_data = lo;
+	lo->blkdev = dev;
+
+	// Whatever's underneath does its own scheduling
+	elevator_switch(dev, "noop");
+
+	struct part *part0 = (struct part *)kmalloc(sizeof(struct part));
+	if (!part0)
+		goto fail;
+
+	memset(part0, 0, sizeof(struct part));
+	part0->minor = dev->minor;
+	if (!list_insert(dev->partitions, part0)) {
+		kfree(part0);
+		goto fail;
+	}
+
+	if (add_blkdev(dev) < 0)
+		goto fail;
+
+	return lo;
+
+fail:
+	free_blkdev(dev);
+	destroy_mutex(lo->mutex);
+	kfree(lo);
+	return NULL;
+}
+
+void init_loop(void) {
+	int32_t ret;
+
+	// A worker for each, so loops stacked on loops can't starve each other
+	loop_workqueue = create_workqueue("[loop]", LOOP_COUNT);
+	if (!loop_workqueue) {
+		printf("loop: error creating workqueue\n");
+		return;
+	}
+
+	while ((ret = register_blkdev(LOOP_MAJOR, "loop", loop_fops)) == -ENOMEM)
+		continue;
+
+	if (ret < 0) {
+		printf("loop: error acquiring major\n");
+		return;
+	}
+
+	uint32_t i;
+	for (i = 0; i < LOOP_COUNT; i++) {
+		loops[i] = loop_create(i);
+		if (!loops[i])
+			printf("loop: error creating loop%u\n", i);
+	}
+}
@@ -0,0 +1,221 @@
+/* ramdisk.c - Block devices kept entirely in memory */
+
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <common.h>
+#include <blkdev/ramdisk.h>
+#include <block.h>
+#include <elevator.h>
+#include <paging.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <printf.h>
+#include <errno.h>
+#include <workqueue.h>
+
+static int32_t open(fs_node_t *node, uint32_t flags) { return 0; }
+static int32_t close(fs_node_t *node) { return 0; }
+
+struct file_ops ramdisk_fops = {
+	.open = open,
+	.close = close,
+};
+
+static workqueue_t *ramdisk_workqueue = NULL;
+
+static int32_t request_ramdisk(blkdev_t *dev) {
+	struct ramdisk *rd = (struct ramdisk *)dev->private_data;
+
+	queue_work_inherit(ramdisk_workqueue, &rd->servicer);
+
+	return 0;
+}
+
+// Copy len bytes between buf and the disk, starting at byte off
+static int32_t ramdisk_copy(struct ramdisk *rd, uint64_t off, void *buf,
+		uint32_t len, int write) {
+	while (len) {
+		uint32_t index = off / PAGE_SIZE;
+		uint32_t in_page = off % PAGE_SIZE;
+		uint32_t chunk = PAGE_SIZE - in_page;
+		if (chunk > len)
+			chunk = len;
+
+		void *page = rd->pages[index];
+		if (write) {
+			if (!page) {
+				page = kvalloc(PAGE_SIZE);
+				if (!page)
+					return -ENOMEM;
+				memset(page, 0, PAGE_SIZE);
+				rd->pages[index] = page;
+			}
+			memcpy(page + in_page, buf, chunk);
+		} else if (page)
+			memcpy(buf, page + in_page, chunk);
+		else
+			memset(buf, 0, chunk);
+
+		off += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+// Returns the number of sectors moved, or a negative error
+static int32_t ramdisk_access(struct ramdisk *rd, request_t *req) {
+	uint64_t sectors = rd->npages * (PAGE_SIZE / RAMDISK_SECTOR_SIZE);
+	if (req->first_sector + req->nsectors > sectors)
+		return -EIO;
+
+	int write = (req->flags & BLOCK_DIR_WRITE) ? 1 : 0;
+	uint64_t off = (uint64_t)req->first_sector * RAMDISK_SECTOR_SIZE;
+	uint32_t done = 0;
+
+	node_t *node;
+	foreach(node, req->bios) {
+		if (done == req->nsectors)
+			break;
+
+		bio_t *bio = (bio_t *)node->data;
+		uint32_t nsects = bio->nsectors;
+		if (nsects > req->nsectors - done)
+			nsects = req->nsectors - done;
+
+		void *map = (void *)kernel_map(bio->page);
+		if (!map)
+			break;
+
+		int32_t ret = ramdisk_copy(rd, off, map + bio->offset,
+			nsects * RAMDISK_SECTOR_SIZE, write);
+		kernel_unmap((uintptr_t)map);
+		if (ret < 0)
+			return done ? (int32_t)done : ret;
+
+		off += nsects * RAMDISK_SECTOR_SIZE;
+		done += nsects;
+	}
+
+	return (int32_t)done;
+}
+
+static void ramdisk_work(struct work *work) {
+	struct ramdisk *rd = container_of(work, struct ramdisk, servicer);
+
+	while (1) {
+		request_t *req = next_ready_request_blkdev(rd->blkdev);
+		if (!req)
+			break;
+
+		int32_t sectors_xferred = ramdisk_access(rd, req);
+
+		if (sectors_xferred < 0)
+			end_request(req, sectors_xferred, 0);
+		else if (sectors_xferred == 0)
+			end_request(req, -EIO, 0);
+		else
+			end_request(req, 0, (uint32_t)sectors_xferred);
+	}
+}
+
+static struct ramdisk *ramdisk_create(uint32_t index, uint32_t size) {
+	struct ramdisk *rd = (struct ramdisk *)kmalloc(sizeof(struct ramdisk));
+	if (!rd)
+		return NULL;
+
+	rd->npages = size / PAGE_SIZE;
+	rd->pages = (void **)kmalloc(rd->npages * sizeof(void *));
+	if (!rd->pages) {
+		kfree(rd);
+		return NULL;
+	}
+	memset(rd->pages, 0, rd->npages * sizeof(void *));
+	init_work(&rd->servicer, ramdisk_work);
+
+	blkdev_t *dev = alloc_blkdev();
+	if (!dev) {
+		kfree(rd->pages);
+		kfree(rd);
+		return NULL;
+	}
+
+	dev->major = RAMDISK_MAJOR;
+	dev->minor = index;
+	dev->max_part = 1;
+	dev->sector_size = RAMDISK_SECTOR_SIZE;
+	dev->size = rd->npages * (PAGE_SIZE / RAMDISK_SECTOR_SIZE);
+	dev->handler = request_ramdisk;
+	dev->private_data = rd;
+	rd->blkdev = dev;
+
+	// Nothing to seek, so there's nothing to gain from sorting
+	elevator_switch(dev, "noop");
+
+	// It starts out blank, so there's no partition table to look for
+	struct part *part0 = (struct part *)kmalloc(sizeof(struct part));
+	if (!part0)
+		goto fail;
+
+	memset(part0, 0, sizeof(struct part));
+	part0->minor = dev->minor;
+	part0->offset = 0;
+	part0->size = dev->size;
+	if (!list_insert(dev->partitions, part0)) {
+		kfree(part0);
+		goto fail;
+	}
+
+	if (add_blkdev(dev) < 0)
+		goto fail;
+
+	return rd;
+
+fail:
+	free_blkdev(dev);
+	kfree(rd->pages);
+	kfree(rd);
+	return NULL;
+}
+
+void init_ramdisk(void) {
+	int32_t ret;
+
+	ramdisk_workqueue = create_workqueue("[ramdisk]", 1);
+	if (!ramdisk_workqueue) {
+		printf("ramdisk: error creating workqueue\n");
+		return;
+	}
+
+	while ((ret = register_blkdev(RAMDISK_MAJOR, "ramdisk", ramdisk_fops))
+			== -ENOMEM)
+		continue;
+
+	if (ret < 0) {
+		printf("ramdisk: error acquiring major\n");
+		return;
+	}
+
+	uint32_t i;
+	for (i = 0; i < RAMDISK_COUNT; i++)
+		if (!ramdisk_create(i, RAMDISK_SIZE))
+			printf("ramdisk: error creating ram%u\n", i);
+}
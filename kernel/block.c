@@ -28,46 +28,74 @@
 #include <kmalloc.h>
 #include <errno.h>
 #include <structures/mutex.h>
+#include <rcu.h>
+#include <elevator.h>
+#include <task.h>
+#include <clocksource.h>
 
-struct blkdev_driver blk_drivers[256];
+extern volatile task_t *current_task;
+
+/* Drivers are published whole and never replaced or freed, and devices are
+ * only ever added, so lookups don't lock anything
+ */
+static struct blkdev_driver *blk_drivers[256];
+
+// Everybody waiting on a request or a batch of them
+static waitqueue_t *blk_wq = NULL;
 
 void init_blockdev(void) {
 	int i;
-	for (i = 0; i < 256; i++) {
-		blk_drivers[i].name = "Default";
-		blk_drivers[i].ops = (struct file_ops){ NULL };
-		blk_drivers[i].devs = NULL;
-	}
+	for (i = 0; i < 256; i++)
+		blk_drivers[i] = NULL;
+
+	blk_wq = create_waitqueue();
+	ASSERT(blk_wq);
 }
 
 struct blkdev_driver *get_blkdev_driver(dev_t major) {
 	if (major <= 0 || major > 256)
 		return NULL;
 
-	if (strcmp(blk_drivers[major - 1].name, "Default") == 0)
-		return NULL;
-
-	return &blk_drivers[major - 1];
+	return rcu_dereference(blk_drivers[major - 1]);
 }
 
-spinlock_t block_lock = 0;
+// Serializes changes to the driver table and device lists
+DEFINE_SPINLOCK(block_lock);
 
 int32_t register_blkdev(dev_t major, const char *name, struct file_ops fops) {
+	if (major > 256)
+		return -1;
+
+	struct blkdev_driver *driver =
+		(struct blkdev_driver *)kmalloc(sizeof(struct blkdev_driver));
+	if (!driver)
+		return -1;
+
+	driver->name = name;
+	driver->ops = fops;
+	driver->devs = list_create();
+	if (!driver->devs) {
+		kfree(driver);
+		return -1;
+	}
+
 	spin_lock(&block_lock);
 	if (major == 0) {
-		for (major = 1; strcmp(blk_drivers[major - 1].name, "Default") != 0;
-				major++)
-			if (major == 256)
+		for (major = 1; blk_drivers[major - 1]; major++)
+			if (major == 256) {
+				spin_unlock(&block_lock);
+				list_destroy(driver->devs);
+				kfree(driver);
 				return -1;
-	}
-
-	blk_drivers[major - 1].devs = list_create();
-	if (!blk_drivers[major - 1].devs) {
+			}
+	} else if (blk_drivers[major - 1]) {
 		spin_unlock(&block_lock);
+		list_destroy(driver->devs);
+		kfree(driver);
 		return -1;
 	}
-	blk_drivers[major - 1].name = name;
-	blk_drivers[major - 1].ops = fops;
+
+	rcu_assign_pointer(blk_drivers[major - 1], driver);
 	spin_unlock(&block_lock);
 
 	printf("Blockdev driver %s added\n", name);
@@ -81,31 +109,55 @@ blkdev_t *get_blkdev(dev_t dev) {
 
 	blkdev_t *blockdev = NULL;
 	node_t *node;
+	rcu_read_lock();
 	foreach(node, driver->devs) {
 		blockdev = (blkdev_t *)node->data;
 		if (MINOR(dev) < blockdev->minor + blockdev->max_part)
 			break;
 	}
 
+	if (blockdev) {
+		foreach(node, blockdev->partitions) {
+			struct part *partition = (struct part *)node->data;
+			if (partition->minor == MINOR(dev))
+				break;
+		}
+		if (!node)
+			blockdev = NULL;
+	}
+	rcu_read_unlock();
+
+	return blockdev;
+
+}
+
+size_t get_block_size(dev_t dev) {
+	blkdev_t *blockdev = get_blkdev(dev);
 	if (!blockdev)
-		return NULL;
+		return 0;
 
+	return blockdev->sector_size;
+}
+
+static struct part *get_part(blkdev_t *blockdev, dev_t dev) {
+	node_t *node;
 	foreach(node, blockdev->partitions) {
 		struct part *partition = (struct part *)node->data;
 		if (partition->minor == MINOR(dev))
-			return blockdev;
+			return partition;
 	}
 
 	return NULL;
-
 }
 
-size_t get_block_size(dev_t dev) {
+// Size of a device or partition in sectors
+uint32_t get_dev_sectors(dev_t dev) {
 	blkdev_t *blockdev = get_blkdev(dev);
 	if (!blockdev)
 		return 0;
 
-	return blockdev->sector_size;
+	struct part *partition = get_part(blockdev, dev);
+	return partition ? partition->size : 0;
 }
 
 blkdev_t *alloc_blkdev(void) {
@@ -114,16 +166,17 @@ blkdev_t *alloc_blkdev(void) {
 		return NULL;
 
 	memset(blockdev, 0, sizeof(blkdev_t));
+	blockdev->max_sectors = BLOCK_MAX_SECTORS;
+	blockdev->ra_sectors = BLOCK_RA_SECTORS;
 
-	blockdev->queue = list_create();
-	if (!blockdev->queue) {
+	if (elevator_init(blockdev, DEFAULT_IOSCHED) < 0) {
 		kfree(blockdev);
 		return NULL;
 	}
 
 	blockdev->partitions = list_create();
 	if (!blockdev->partitions) {
-		list_destroy(blockdev->queue);
+		elevator_exit(blockdev);
 		kfree(blockdev);
 		return NULL;
 	}
@@ -131,7 +184,7 @@ blkdev_t *alloc_blkdev(void) {
 	blockdev->mutex = create_mutex(0);
 	if (!blockdev->mutex) {
 		list_destroy(blockdev->partitions);
-		list_destroy(blockdev->queue);
+		elevator_exit(blockdev);
 		kfree(blockdev);
 		return NULL;
 	}
@@ -139,6 +192,26 @@ blkdev_t *alloc_blkdev(void) {
 	return blockdev;
 }
 
+static request_t *alloc_request(blkdev_t *dev, uint32_t first_sector,
+		uint32_t flags) {
+	request_t *req = (request_t *)kmalloc(sizeof(request_t));
+	if (!req)
+		return NULL;
+
+	memset(req, 0, sizeof(request_t));
+	req->flags = flags;
+	req->first_sector = first_sector;
+	req->status = BLOCK_REQ_UNSCHED;
+	req->dev = dev;
+	req->bios = list_create();
+	if (!req->bios) {
+		kfree(req);
+		return NULL;
+	}
+
+	return req;
+}
+
 int32_t autopopulate_blkdev(blkdev_t *dev) {
 	ASSERT(!dev->partitions->head);
 
@@ -147,6 +220,7 @@ int32_t autopopulate_blkdev(blkdev_t *dev) {
 	if (!part0)
 		return -ENOMEM;
 
+	memset(part0, 0, sizeof(struct part));
 	part0->minor = dev->minor;
 	part0->offset = 0;
 	part0->size = dev->size;
@@ -172,34 +246,13 @@ int32_t autopopulate_blkdev(blkdev_t *dev) {
 	 * we'll have to construct our request manually
 	 */
 
-	request_t *req = (request_t *)kmalloc(sizeof(request_t));
+	request_t *req = alloc_request(dev, 0, 0);
 	if (!req) {
 		kfree(mbr);
 		ret = -ENOMEM;
 		goto fail;
 	}
-
-	req->flags = 0;
-	req->first_sector = 0;
-	req->nsectors = 0;
-	req->status = BLOCK_REQ_UNSCHED;
-	req->rc = 0;
-	req->dev = dev;
-	req->bios = list_create();
-	if (!req->bios) {
-		kfree(req);
-		kfree(mbr);
-		ret = -ENOMEM;
-		goto fail;
-	}
-	req->wq = create_waitqueue();
-	if (!req->wq) {
-		list_destroy(req->bios);
-		kfree(req);
-		kfree(mbr);
-		ret = -ENOMEM;
-		goto fail;
-	}
+	req->part = part0;
 
 	bio_t *bio = (bio_t *)kmalloc(sizeof(bio_t));
 	if (!bio) {
@@ -246,6 +299,7 @@ int32_t autopopulate_blkdev(blkdev_t *dev) {
 				ret = -ENOMEM;
 				goto fail;
 			}
+			memset(partition, 0, sizeof(struct part));
 			partition->minor = dev->minor + i + 1;
 			partition->offset = mbr->partitions[i].rel_sect;
 			partition->size = mbr->partitions[i].nsects;
@@ -271,7 +325,7 @@ void free_blkdev(blkdev_t *dev) {
 	ASSERT(dev);
 
 	list_destroy(dev->partitions);
-	list_destroy(dev->queue);
+	elevator_exit(dev);
 	destroy_mutex(dev->mutex);
 
 	kfree(dev);
@@ -286,22 +340,26 @@ int32_t add_blkdev(blkdev_t *dev) {
 
 	blkdev_t *blockdev = NULL;
 	node_t *node;
+	spin_lock(&block_lock);
 	foreach(node, driver->devs) {
 		blockdev = (blkdev_t *)node->data;
-		if (dev->minor > blockdev->minor &&
-				dev->minor < blockdev->minor + blockdev->max_part)
-			return -EEXIST;
-		if (dev->minor + dev->max_part > blockdev->minor &&
-				dev->minor + dev->max_part < blockdev->minor + blockdev->max_part)
+		if ((dev->minor > blockdev->minor &&
+				dev->minor < blockdev->minor + blockdev->max_part) ||
+				(dev->minor + dev->max_part > blockdev->minor &&
+				dev->minor + dev->max_part < blockdev->minor + blockdev->max_part)) {
+			spin_unlock(&block_lock);
 			return -EEXIST;
+		}
 		if (blockdev->minor > dev->minor)
 			break;
 	}
 
+	// Readers may be walking the list. Insertion publishes safely
 	if (node)
 		node = list_insert_before(driver->devs, node, dev);
 	else
 		node = list_insert(driver->devs, dev);
+	spin_unlock(&block_lock);
 
 	if (!node)
 		return -ENOMEM;
@@ -309,33 +367,118 @@ int32_t add_blkdev(blkdev_t *dev) {
 	return 0;
 }
 
-node_t *next_ready_request_blkdev(blkdev_t *dev) {
-	acquire_mutex(dev->mutex);
+static uint32_t latency_bucket(uint64_t ns) {
+	uint64_t us = ns / NSEC_PER_USEC;
+	uint32_t bucket = 0;
+	while (us && bucket < IOSTAT_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
 
-	node_t *node = NULL;
-	while (1) {
-		node = dev->queue->head;
-		if (!node)
-			break;
+	return bucket;
+}
 
-		request_t *req = (request_t *)node->data;
+/* Statistics are kept for the disk and for the partition the request went
+ * through. Everything here's under the disk's mutex
+ */
+#define foreach_stats(st, dev, req) \
+	for (st = &(dev)->stats; st; \
+		st = (st == &(dev)->stats && (req)->part) ? &(req)->part->stats : NULL)
+
+static void stats_posted(blkdev_t *dev, request_t *req, uint64_t now) {
+	struct io_stats *st;
+	foreach_stats(st, dev, req) {
+		if (st->in_flight++ == 0)
+			st->busy_since = now;
+	}
+}
 
-		if (req->status == BLOCK_REQ_INTR) {
-			list_dequeue(dev->queue, node);
-			kfree(node);
-			wake_queue(req->wq);
+static void stats_merged(blkdev_t *dev, request_t *req) {
+	struct io_stats *st;
+	foreach_stats(st, dev, req)
+		st->merges[req->flags & BLOCK_DIR_WRITE ? 1 : 0]++;
+}
+
+static void stats_started(blkdev_t *dev, request_t *req, uint64_t now) {
+	struct io_stats *st;
+	foreach_stats(st, dev, req)
+		st->queue_hist[latency_bucket(now - req->queued)]++;
+}
+
+// finished is zero if it was taken back before the driver saw it
+static void stats_done(blkdev_t *dev, request_t *req, uint64_t now,
+		int finished) {
+	uint32_t dir = (req->flags & BLOCK_DIR_WRITE) ? 1 : 0;
+
+	struct io_stats *st;
+	foreach_stats(st, dev, req) {
+		if (--st->in_flight == 0)
+			st->busy_ns += now - st->busy_since;
+		if (!finished)
 			continue;
-		}
 
-		if (req->status == BLOCK_REQ_PENDING) {
+		st->ios[dir]++;
+		st->sectors[dir] += req->stat_sectors;
+		if (req->rc < 0)
+			st->errors++;
+		st->service_hist[latency_bucket(now - req->started)]++;
+	}
+}
+
+// Partitions share their disk's queue and settings
+int32_t ioctl_blkdev(dev_t dev, uint32_t req, void *data) {
+	if (req < BLKGETSCHED || req > BLKRASET)
+		return -ENOTTY;
+
+	blkdev_t *blockdev = get_blkdev(dev);
+	if (!blockdev)
+		return -ENODEV;
+	if (!data)
+		return -EFAULT;
+
+	switch (req) {
+	case BLKGETSCHED:
+		acquire_mutex(blockdev->mutex);
+		strncpy((char *)data, blockdev->sched->name, IOSCHED_NAME_MAX);
+		release_mutex(blockdev->mutex);
+		return 0;
+	case BLKSETSCHED:
+		return elevator_switch(blockdev, (const char *)data);
+	case BLKRAGET:
+		*(uint32_t *)data = blockdev->ra_sectors;
+		return 0;
+	case BLKRASET:
+		if (*(uint32_t *)data > BLOCK_RA_MAX_SECTORS ||
+				*(uint32_t *)data > get_dev_sectors(dev))
+			return -EINVAL;
+		blockdev->ra_sectors = *(uint32_t *)data;
+		return 0;
+	}
+
+	return -ENOTTY;
+}
+
+/* What the driver should work on. It keeps getting the same request until
+ * end_request says it's done
+ */
+request_t *next_ready_request_blkdev(blkdev_t *dev) {
+	acquire_mutex(dev->mutex);
+
+	request_t *req = dev->running;
+	if (!req) {
+		req = dev->sched->next(dev->sched_data);
+		if (req) {
 			req->status = BLOCK_REQ_RUNNING;
-			break;
+			req->started = monotonic_ns();
+			req->stat_sectors = req->nsectors;
+			stats_started(dev, req, req->started);
+			dev->running = req;
 		}
 	}
 
 	release_mutex(dev->mutex);
 
-	return node;
+	return req;
 }
 
 request_t *create_request_blkdev(dev_t dev, uint32_t first_sector,
@@ -344,39 +487,14 @@ request_t *create_request_blkdev(dev_t dev, uint32_t first_sector,
 	if (!device)
 		return NULL;
 
-	struct part *partition = NULL;
-	node_t *node;
-	foreach(node, device->partitions) {
-		partition = (struct part *)node->data;
-		if (partition->minor == MINOR(dev))
-			break;
-	}
-
-	if (first_sector > partition->size)
-		return NULL;
-
-	request_t *req = (request_t *)kmalloc(sizeof(request_t));
-	if (!req)
+	struct part *partition = get_part(device, dev);
+	if (!partition || first_sector > partition->size)
 		return NULL;
 
-	req->flags = flags;
-	req->first_sector = first_sector + partition->offset;
-	req->nsectors = 0;
-	req->status = BLOCK_REQ_UNSCHED;
-	req->rc = 0;
-	req->dev = device;
-	req->bios = list_create();
-	if (!req->bios) {
-		kfree(req);
-		return NULL;
-	}
-
-	req->wq = create_waitqueue();
-	if (!req->wq) {
-		kfree(req->bios);
-		kfree(req);
-		return NULL;
-	}
+	request_t *req = alloc_request(device, first_sector + partition->offset,
+		flags);
+	if (req)
+		req->part = partition;
 
 	return req;
 }
@@ -392,35 +510,160 @@ int32_t add_bio_to_request_blkdev(request_t *req, bio_t *bio) {
 	return 0;
 }
 
+// Fold req into a queued request it carries on from or leads into
+static int merge_request(blkdev_t *dev, request_t *req) {
+	if (!dev->sched->find_merge || !req->nsectors)
+		return 0;
+
+	request_t *target =
+		dev->sched->find_merge(dev->sched_data, req, dev->max_sectors);
+	if (!target)
+		return 0;
+
+	if (elv_mergeable(target, req, dev->max_sectors) < 0) {
+		list_merge(req->bios, target->bios);
+		list_t *bios = target->bios;
+		target->bios = req->bios;
+		req->bios = bios;
+		target->first_sector = req->first_sector;
+	} else
+		list_merge(target->bios, req->bios);
+
+	target->nsectors += req->nsectors;
+	if (dev->sched->merged)
+		dev->sched->merged(dev->sched_data, target);
+
+	req->status = BLOCK_REQ_MERGED;
+	stats_merged(dev, req);
+	req->merge_next = target->merged;
+	target->merged = req;
+
+	return 1;
+}
+
+// Whether we're already holding back the driver for dev
+static int in_plug(blkdev_t *dev) {
+	struct blk_plug *plug = current_task->plug;
+	if (!plug)
+		return 0;
+
+	uint32_t i;
+	for (i = 0; i < plug->ndevs; i++)
+		if (plug->devs[i] == dev)
+			return 1;
+
+	return 0;
+}
+
+// Hold off telling the driver if we're plugged. Nonzero if we did
+static int plug_request(blkdev_t *dev) {
+	if (in_plug(dev))
+		return 1;
+
+	struct blk_plug *plug = current_task->plug;
+	if (!plug || plug->ndevs == BLK_PLUG_DEVS)
+		return 0;
+
+	plug->devs[plug->ndevs++] = dev;
+	return 1;
+}
+
 int32_t post_request_blkdev(request_t *req) {
 	ASSERT(req->status == BLOCK_REQ_UNSCHED);
 
-	acquire_mutex(req->dev->mutex);
+	blkdev_t *dev = req->dev;
+	acquire_mutex(dev->mutex);
 
 	req->status = BLOCK_REQ_PENDING;
-	node_t *node = list_insert(req->dev->queue, req);
+	req->queued = monotonic_ns();
+	int merged = merge_request(dev, req);
+	if (!merged) {
+		stats_posted(dev, req, req->queued);
+		dev->sched->add(dev->sched_data, req);
+	}
 
-	release_mutex(req->dev->mutex);
+	release_mutex(dev->mutex);
 
-	if (!node)
-		return -ENOMEM;
+	/* What we joined may be held back in somebody else's plug, and they
+	 * might be asleep waiting on us. Only our own plug can be relied on
+	 */
+	if (merged)
+		return in_plug(dev) ? 0 : dev->handler(dev);
+	if (plug_request(dev))
+		return 0;
+
+	return dev->handler(dev);
+}
+
+// Post without waiting. end_io gets it back once it's done
+int32_t submit_request_blkdev(request_t *req, end_io_t end_io, void *private) {
+	req->end_io = end_io;
+	req->private = private;
+
+	return post_request_blkdev(req);
+}
+
+void blk_start_plug(struct blk_plug *plug) {
+	// Only the outermost plug counts
+	if (current_task->plug)
+		return;
 
-	return req->dev->handler(req->dev);
+	plug->ndevs = 0;
+	current_task->plug = plug;
+}
+
+// Let the drivers at everything queued since blk_start_plug
+void blk_finish_plug(struct blk_plug *plug) {
+	if (current_task->plug != plug)
+		return;
+
+	current_task->plug = NULL;
+
+	uint32_t i;
+	for (i = 0; i < plug->ndevs; i++)
+		plug->devs[i]->handler(plug->devs[i]);
+	plug->ndevs = 0;
+}
+
+// Nothing's going to happen until the driver hears about it
+void blk_flush_plug(void) {
+	struct blk_plug *plug = current_task->plug;
+	if (plug) {
+		blk_finish_plug(plug);
+		blk_start_plug(plug);
+	}
 }
 
 int32_t wait_request_blkdev(request_t *req) {
 	uint32_t interrupted = 0;
 
-	do {
-		if (req->status == BLOCK_REQ_FINISHED)
-			break;
+	ASSERT(!req->end_io);
+	blk_flush_plug();
 
-		interrupted = sleep_thread(req->wq, SLEEP_INTERRUPTABLE);
-	} while (interrupted == 0);
+	uint32_t eflags = irq_save();
+	while (req->status != BLOCK_REQ_FINISHED && !interrupted)
+		interrupted = sleep_thread(blk_wq, SLEEP_INTERRUPTABLE);
+	irq_restore(eflags);
 
 	if (interrupted) {
-		req->status = BLOCK_REQ_INTR;
-		return -EINTR;
+		blkdev_t *dev = req->dev;
+		acquire_mutex(dev->mutex);
+		if (req->status == BLOCK_REQ_PENDING && !req->merged) {
+			// Never got to the driver, so it's ours to take back
+			dev->sched->remove(dev->sched_data, req);
+			stats_done(dev, req, monotonic_ns(), 0);
+			req->status = BLOCK_REQ_INTR;
+			release_mutex(dev->mutex);
+			return -EINTR;
+		}
+		release_mutex(dev->mutex);
+
+		// The driver's still got our pages, or others are riding along
+		// with us. Let it finish
+		eflags = irq_save();
+		while (req->status != BLOCK_REQ_FINISHED)
+			sleep_thread(blk_wq, 0);
+		irq_restore(eflags);
 	}
 
 	return req->rc;
@@ -434,9 +677,71 @@ int32_t post_and_wait_blkdev(request_t *req) {
 	return wait_request_blkdev(req);
 }
 
+void init_completion_blkdev(struct blk_completion *done) {
+	done->pending = 0;
+	done->error = 0;
+}
+
+static void counted_end_io(request_t *req) {
+	struct blk_completion *done = (struct blk_completion *)req->private;
+	int32_t rc = req->rc;
+	free_request(req);
+
+	uint32_t eflags = irq_save();
+	if (rc < 0 && !done->error)
+		done->error = rc;
+	if (--done->pending == 0)
+		wake_queue_all(blk_wq);
+	irq_restore(eflags);
+}
+
+/* Post one of a batch. It's freed when it finishes, so all that's left to
+ * look at afterwards is the batch's first error
+ */
+int32_t post_counted_blkdev(request_t *req, struct blk_completion *done) {
+	uint32_t eflags = irq_save();
+	done->pending++;
+	irq_restore(eflags);
+
+	return submit_request_blkdev(req, counted_end_io, done);
+}
+
+// Until everything in the batch is done. Their pages are in use till then
+int32_t wait_completion_blkdev(struct blk_completion *done) {
+	blk_flush_plug();
+
+	uint32_t eflags = irq_save();
+	while (done->pending)
+		sleep_thread(blk_wq, 0);
+	irq_restore(eflags);
+
+	return done->error;
+}
+
+/* Hand a request back to whoever posted it. Either way, it may be freed
+ * the moment it's marked finished
+ */
+static void finish_request(request_t *req) {
+	end_io_t end_io = req->end_io;
+
+	uint32_t eflags = irq_save();
+	req->status = BLOCK_REQ_FINISHED;
+	if (!end_io)
+		wake_queue_all(blk_wq);
+	irq_restore(eflags);
+
+	if (end_io)
+		end_io(req);
+}
+
+/* The driver moved nsectors of the running request, or failed it outright
+ * with a negative error. Returns nonzero while there's more to do
+ */
 int end_request(request_t *req, int32_t error, uint32_t nsectors) {
-	if (error < 0)
+	if (error < 0) {
+		req->rc = error;
 		nsectors = req->nsectors;
+	}
 
 	req->nsectors -= nsectors;
 	req->first_sector += nsectors;
@@ -460,14 +765,21 @@ int end_request(request_t *req, int32_t error, uint32_t nsectors) {
 		break;
 	}
 
-	if (req->status == BLOCK_REQ_INTR) {
-		wake_queue(req->wq);
-		return 0;
-	}
-
 	if (req->nsectors == 0) {
-		req->status = BLOCK_REQ_FINISHED;
-		wake_queue(req->wq);
+		acquire_mutex(req->dev->mutex);
+		req->dev->running = NULL;
+		stats_done(req->dev, req, monotonic_ns(), 1);
+		release_mutex(req->dev->mutex);
+
+		request_t *merged = req->merged;
+		while (merged) {
+			request_t *next = merged->merge_next;
+			merged->rc = req->rc;
+			finish_request(merged);
+			merged = next;
+		}
+
+		finish_request(req);
 		return 0;
 	}
 
@@ -482,7 +794,6 @@ void free_request(request_t *req) {
 		req->status == BLOCK_REQ_INTR ||
 		req->status == BLOCK_REQ_FINISHED);
 
-	destroy_waitqueue(req->wq);
 	list_destroy(req->bios);
 	kfree(req);
 }
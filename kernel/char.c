@@ -23,42 +23,58 @@
 #include <vfs.h>
 #include <string.h>
 #include <printf.h>
+#include <kmalloc.h>
+#include <rcu.h>
 
-struct chrdev_driver char_drivers[256];		// 1 for every valid major number
+/* 1 for every valid major number. Drivers are published whole and never
+ * replaced or freed, so dispatch doesn't need to lock anything
+ */
+static struct chrdev_driver *char_drivers[256];
 
 void init_chardev(void) {
 	int i;
-	for (i = 0; i < 256; i++) {
-		char_drivers[i].name = "Default";
-		char_drivers[i].ops = (struct file_ops){ NULL };
-	}
+	for (i = 0; i < 256; i++)
+		char_drivers[i] = NULL;
 }
 
 struct chrdev_driver *get_chrdev_driver(dev_t major) {
 	if (major <= 0 || major > 256)
 		return NULL;
 
-	if (strcmp(char_drivers[major - 1].name, "Default") == 0)
-		return NULL;
-
-	return &char_drivers[major - 1];
+	return rcu_dereference(char_drivers[major - 1]);
 }
 
-spinlock_t char_lock = 0;
+DEFINE_SPINLOCK(char_lock);
 
 int32_t register_chrdev(dev_t major, const char *name, struct file_ops fops) {
+	if (major > 256)
+		return -1;
+
+	struct chrdev_driver *driver =
+		(struct chrdev_driver *)kmalloc(sizeof(struct chrdev_driver));
+	if (!driver)
+		return -1;
+
+	driver->name = name;
+	driver->ops = fops;
+
 	spin_lock(&char_lock);
 	// Find an open major number if given zero
 	if (major == 0) {
 		// Max 256
-		for (major = 1; strcmp(char_drivers[major - 1].name, "Default") != 0;
-				major++)
-			if (major == 256)
+		for (major = 1; char_drivers[major - 1]; major++)
+			if (major == 256) {
+				spin_unlock(&char_lock);
+				kfree(driver);
 				return -1;
+			}
+	} else if (char_drivers[major - 1]) {
+		spin_unlock(&char_lock);
+		kfree(driver);
+		return -1;
 	}
 
-	char_drivers[major - 1].name = name;
-	char_drivers[major - 1].ops = fops;
+	rcu_assign_pointer(char_drivers[major - 1], driver);
 	spin_unlock(&char_lock);
 
 	printf("Chardev driver %s added\n", name);
@@ -0,0 +1,152 @@
+/* iostat.c - dumps block device statistics and latency histograms */
+
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <chardev/iostat.h>
+#include <common.h>
+#include <vfs.h>
+#include <char.h>
+#include <block.h>
+#include <rcu.h>
+#include <clocksource.h>
+#include <structures/list.h>
+#include <kmalloc.h>
+#include <printf.h>
+#include <string.h>
+#include <errno.h>
+
+#define LINE_MAX	160
+#define HIST_MAX	(16 + IOSTAT_BUCKETS * 24)
+
+static char *print_stats(char *pos, const char *name, dev_t major,
+		dev_t minor, struct io_stats *st, uint64_t now) {
+	uint64_t busy = st->busy_ns;
+	if (st->in_flight)
+		busy += now - st->busy_since;
+
+	return pos + sprintf(pos,
+		"%-8s %3u:%-4u %8u %9u %7u %8u %9u %7u %5u %5u %9u\n", name, major,
+		minor, st->ios[0], st->sectors[0], st->merges[0], st->ios[1],
+		st->sectors[1], st->merges[1], st->errors, st->in_flight,
+		(uint32_t)(busy / NSEC_PER_MSEC));
+}
+
+// Bucket i holds latencies under 2^i microseconds. Empty ones are skipped
+static char *print_hist(char *pos, const char *what, uint32_t *hist) {
+	pos += sprintf(pos, "  %-7s", what);
+
+	uint32_t i;
+	for (i = 0; i < IOSTAT_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (i == IOSTAT_BUCKETS - 1)
+			pos += sprintf(pos, " +:%u", hist[i]);
+		else
+			pos += sprintf(pos, " %u:%u", 1 << i, hist[i]);
+	}
+
+	return pos + sprintf(pos, "\n");
+}
+
+static ssize_t read(struct fs_node *node, void *dest, size_t count,
+		off_t off) {
+	uint32_t ndisks = 0, nparts = 0;
+	uint32_t major;
+	node_t *dnode, *pnode;
+
+	rcu_read_lock();
+	for (major = 1; major <= 256; major++) {
+		struct blkdev_driver *driver = get_blkdev_driver(major);
+		if (!driver)
+			continue;
+		foreach(dnode, driver->devs) {
+			blkdev_t *dev = (blkdev_t *)dnode->data;
+			ndisks++;
+			foreach(pnode, dev->partitions)
+				nparts++;
+		}
+	}
+	rcu_read_unlock();
+
+	char *buf = (char *)kmalloc(LINE_MAX * (ndisks + nparts + 1) +
+		HIST_MAX * 2 * ndisks);
+	if (!buf)
+		return -ENOMEM;
+
+	/* Counters are read without the disks' mutexes, so they may be a little
+	 * off. Latencies are in microseconds, busy time in milliseconds
+	 */
+	uint64_t now = monotonic_ns();
+	char *pos = buf;
+	pos += sprintf(pos, "%-8s %8s %8s %9s %7s %8s %9s %7s %5s %5s %9s\n",
+		"DEVICE", "DEV", "READS", "RSECT", "RMERGE", "WRITES", "WSECT",
+		"WMERGE", "ERR", "INFLT", "BUSYMS");
+
+	rcu_read_lock();
+	for (major = 1; major <= 256 && ndisks; major++) {
+		struct blkdev_driver *driver = get_blkdev_driver(major);
+		if (!driver)
+			continue;
+		foreach(dnode, driver->devs) {
+			blkdev_t *dev = (blkdev_t *)dnode->data;
+			if (!ndisks)
+				break;
+			ndisks--;
+
+			pos = print_stats(pos, driver->name, dev->major, dev->minor,
+				&dev->stats, now);
+			pos = print_hist(pos, "queue", dev->stats.queue_hist);
+			pos = print_hist(pos, "service", dev->stats.service_hist);
+
+			// The whole disk's partition is the line above
+			foreach(pnode, dev->partitions) {
+				struct part *partition = (struct part *)pnode->data;
+				if (!nparts)
+					break;
+				nparts--;
+				if (partition->minor == dev->minor)
+					continue;
+				pos = print_stats(pos, "", dev->major, partition->minor,
+					&partition->stats, now);
+			}
+		}
+	}
+	rcu_read_unlock();
+
+	size_t len = pos - buf;
+	if (off >= (off_t)len)
+		count = 0;
+	else if (count > len - off)
+		count = len - off;
+
+	if (count)
+		memcpy(dest, buf + off, count);
+
+	kfree(buf);
+	return count;
+}
+
+struct file_ops iostat_ops = {
+	.read = read,
+};
+
+void init_iostat(void) {
+	register_chrdev(IOSTAT_MAJOR, "iostat", iostat_ops);
+}
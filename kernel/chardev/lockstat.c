@@ -0,0 +1,80 @@
+/* lockstat.c - dumps spinlock contention statistics */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <chardev/lockstat.h>
+#include <common.h>
+#include <vfs.h>
+#include <char.h>
+#include <kmalloc.h>
+#include <printf.h>
+#include <string.h>
+#include <errno.h>
+
+#define LINE_MAX	128
+
+#ifdef SPINLOCK_STATS
+static ssize_t read(struct fs_node *node, void *dest, size_t count,
+		off_t off) {
+	uint32_t nlocks = 0;
+	spinlock_t *lock;
+	for (lock = lockstat_first(); lock; lock = lock->next_stat)
+		nlocks++;
+
+	char *buf = (char *)kmalloc((nlocks + 1) * LINE_MAX);
+	if (!buf)
+		return -ENOMEM;
+
+	// Counters are read without the locks, so they may be a little off
+	char *pos = buf;
+	pos += sprintf(pos, "%-24s %10s %10s %10s\n", "LOCK", "ACQUIRED",
+		"CONTENDED", "KCYCLES");
+	for (lock = lockstat_first(); lock && nlocks; lock = lock->next_stat) {
+		pos += sprintf(pos, "%-24s %10u %10u %10u\n", lock->name,
+			lock->acquired, lock->contended,
+			(uint32_t)(lock->spin_cycles >> 10));
+		nlocks--;
+	}
+
+	size_t len = pos - buf;
+	if (off >= (off_t)len)
+		count = 0;
+	else if (count > len - off)
+		count = len - off;
+
+	if (count)
+		memcpy(dest, buf + off, count);
+
+	kfree(buf);
+	return count;
+}
+#else
+static ssize_t read(struct fs_node *node, void *dest, size_t count,
+		off_t off) {
+	return 0;
+}
+#endif
+
+struct file_ops lockstat_ops = {
+	.read = read,
+};
+
+void init_lockstat(void) {
+	register_chrdev(LOCKSTAT_MAJOR, "lockstat", lockstat_ops);
+}
@@ -0,0 +1,128 @@
+/* schedstat.c - dumps per-task and system wide scheduler statistics */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <chardev/schedstat.h>
+#include <common.h>
+#include <vfs.h>
+#include <char.h>
+#include <task.h>
+#include <kmalloc.h>
+#include <printf.h>
+#include <string.h>
+#include <clocksource.h>
+#include <errno.h>
+
+#define LINE_MAX	256
+#define CMD_MAX		32
+
+// Defined in task.c
+extern list_t *processes;
+extern task_t *kidle;
+extern uint32_t nr_switches;
+extern uint32_t sched_lat_hist[SCHED_HIST_BUCKETS];
+
+static uint32_t ns_to_ms(uint64_t ns) {
+	return (uint32_t)(ns / NSEC_PER_MSEC);
+}
+
+static uint32_t ns_to_us(uint64_t ns) {
+	return (uint32_t)(ns / NSEC_PER_USEC);
+}
+
+static char *print_hist(char *pos, uint32_t *hist) {
+	uint32_t i;
+	for (i = 0; i < SCHED_HIST_BUCKETS; i++)
+		pos += sprintf(pos, " %u", hist[i]);
+	pos += sprintf(pos, "\n");
+	return pos;
+}
+
+/* The whole table is regenerated on every read, and the requested window
+ * copied out of it. Reading in small chunks may tear between rows
+ */
+static ssize_t read(struct fs_node *node, void *dest, size_t count,
+		off_t off) {
+	uint32_t eflags = irq_save();
+
+	uint32_t ntasks = 0;
+	node_t *proc;
+	foreach(proc, processes)
+		ntasks++;
+
+	char *buf = (char *)kmalloc((2 * ntasks + 8) * LINE_MAX);
+	if (!buf) {
+		irq_restore(eflags);
+		return -ENOMEM;
+	}
+
+	char *pos = buf;
+	pos += sprintf(pos, "uptime_ms %u idle_ms %u switches %u\n",
+		ns_to_ms(monotonic_ns()), ns_to_ms(kidle->stats.runtime),
+		nr_switches);
+	pos += sprintf(pos, "latency_hist");
+	pos = print_hist(pos, sched_lat_hist);
+
+	pos += sprintf(pos, "%5s %5s %3s %8s %8s %8s %10s %7s %7s %s\n", "PID",
+		"TGID", "PRI", "RUN_MS", "WAIT_MS", "SLEEP_MS", "MAXWAIT_US", "NVCSW",
+		"NIVCSW", "CMD");
+	foreach(proc, processes) {
+		task_t *task = (task_t *)proc->data;
+		struct sched_stats *stats = &task->stats;
+
+		char cmd[CMD_MAX];
+		strncpy(cmd, task->cmd, CMD_MAX - 1);
+		cmd[CMD_MAX - 1] = '\0';
+
+		pos += sprintf(pos, "%5d %5d %3u %8u %8u %8u %10u %7u %7u %s\n",
+			task->pid, task->tgid, task->prio, ns_to_ms(stats->runtime),
+			ns_to_ms(stats->wait_time), ns_to_ms(stats->sleep_time),
+			ns_to_us(stats->max_wait), stats->nvcsw, stats->nivcsw, cmd);
+	}
+
+	// Bucket n counts wakeups that took under 2^n us to get the cpu
+	pos += sprintf(pos, "%5s LATENCY_HIST\n", "PID");
+	foreach(proc, processes) {
+		task_t *task = (task_t *)proc->data;
+		pos += sprintf(pos, "%5d", task->pid);
+		pos = print_hist(pos, task->stats.lat_hist);
+	}
+
+	irq_restore(eflags);
+
+	size_t len = pos - buf;
+	if (off >= (off_t)len)
+		count = 0;
+	else if (count > len - off)
+		count = len - off;
+
+	if (count)
+		memcpy(dest, buf + off, count);
+
+	kfree(buf);
+	return count;
+}
+
+struct file_ops schedstat_ops = {
+	.read = read,
+};
+
+void init_schedstat(void) {
+	register_chrdev(SCHEDSTAT_MAJOR, "schedstat", schedstat_ops);
+}
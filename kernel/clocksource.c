@@ -0,0 +1,133 @@
+/* clocksource.c - TSC calibration and nanosecond timekeeping */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <common.h>
+#include <clocksource.h>
+#include <timer.h>
+#include <time.h>
+#include <cpuid.h>
+#include <printf.h>
+#include <errno.h>
+
+// Defined in timer.c
+extern volatile uint32_t tick;
+
+// Defined in time.c
+extern time_t start_time;
+
+static uint64_t read_jiffies(void) {
+	return tick;
+}
+
+static uint64_t read_tsc(void) {
+	uint64_t ret;
+	asm volatile("rdtsc" : "=A"(ret));
+	return ret;
+}
+
+// Always there. Only good to a tick, but better than nothing
+static struct clocksource jiffies_cs = {
+	.name = "jiffies",
+	.read = read_jiffies,
+	.mult = NSEC_PER_SEC / HZ,
+	.shift = 0,
+	.khz = HZ / 1000,
+};
+
+static struct clocksource tsc_cs = {
+	.name = "tsc",
+	.read = read_tsc,
+};
+
+static struct clocksource *clock = &jiffies_cs;
+static uint64_t clock_base = 0;
+
+// 64x32 multiply, split so the product can't overflow for a long, long time
+static uint64_t cyc2ns(struct clocksource *cs, uint64_t cycles) {
+	uint64_t hi = (cycles >> 32) * cs->mult;
+	uint64_t lo = (cycles & 0xFFFFFFFF) * cs->mult;
+	return (hi << (32 - cs->shift)) + (lo >> cs->shift);
+}
+
+// Counts TSC cycles across a known number of PIT ticks. Needs interrupts on
+static uint32_t calibrate_tsc(void) {
+	uint32_t start = tick;
+	while (tick == start)
+		continue;
+
+	start = tick;
+	uint64_t tsc_start = read_tsc();
+	while (tick - start < TSC_CALIBRATE_MS * HZ / 1000)
+		continue;
+	uint64_t tsc_end = read_tsc();
+
+	return (uint32_t)((tsc_end - tsc_start) / TSC_CALIBRATE_MS);
+}
+
+void init_clocksource(void) {
+	uint32_t regs[3];
+	cpuid(CPUID_GET_FEATURES, regs);
+
+	if (regs[2] & CPUID_FEAT_EDX_TSC) {
+		uint32_t khz = calibrate_tsc();
+		// Slower than this and mult won't fit
+		if (khz >= 1000) {
+			tsc_cs.khz = khz;
+			tsc_cs.shift = CLOCKSOURCE_SHIFT;
+			tsc_cs.mult = ((uint64_t)NSEC_PER_MSEC << CLOCKSOURCE_SHIFT) / khz;
+			clock = &tsc_cs;
+		}
+	}
+
+	clock_base = clock->read();
+
+	printf("Using %s clocksource (%u kHz)\n", clock->name, clock->khz);
+}
+
+struct clocksource *get_clocksource(void) {
+	return clock;
+}
+
+// Nanoseconds since init_clocksource
+uint64_t monotonic_ns(void) {
+	return cyc2ns(clock, clock->read() - clock_base);
+}
+
+int32_t clock_gettime(clockid_t clk, struct timespec *tp) {
+	if (!tp)
+		return -EFAULT;
+
+	uint64_t ns = monotonic_ns();
+
+	switch (clk) {
+	case CLOCK_REALTIME:
+		ns += (uint64_t)start_time * NSEC_PER_SEC;
+		break;
+	case CLOCK_MONOTONIC:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	tp->tv_sec = (time_t)(ns / NSEC_PER_SEC);
+	tp->tv_nsec = (long)(ns % NSEC_PER_SEC);
+
+	return 0;
+}
@@ -21,6 +21,7 @@
 #include <common.h>
 #include <printf.h>
 #include <timer.h>
+#include <task.h>
 
 void magic_break(void) {
 	asm volatile("xchg %%bx, %%bx"::);
@@ -52,11 +53,93 @@ void panic(uint32_t line, char *file, char *msg) {
 	halt();
 }
 
-void spin_lock(volatile spinlock_t *lock) {
-	while (__sync_lock_test_and_set(lock, 1) == 1)
-		continue;
+#ifdef SPINLOCK_STATS
+static spinlock_t *lockstat_list = NULL;
+
+static uint64_t lockstat_cycles(void) {
+	uint64_t ret;
+	asm volatile("rdtsc" : "=A"(ret));
+	return ret;
+}
+
+// Locks join the list the first time they're taken
+static void lockstat_register(spinlock_t *lock) {
+	do {
+		lock->next_stat = lockstat_list;
+	} while (!__sync_bool_compare_and_swap(&lockstat_list, lock->next_stat,
+		lock));
+}
+
+spinlock_t *lockstat_first(void) {
+	return lockstat_list;
+}
+#endif
+
+void spin_lock_init(spinlock_t *lock, const char *name) {
+	*lock = (spinlock_t)SPINLOCK_INIT(name);
+}
+
+void spin_lock(spinlock_t *lock) {
+	preempt_disable();
+	uint16_t ticket = __sync_fetch_and_add(&lock->next, 1);
+
+#ifdef SPINLOCK_STATS
+	uint64_t start = 0;
+	if (lock->owner != ticket)
+		start = lockstat_cycles();
+#endif
+
+	while (lock->owner != ticket)
+		cpu_relax();
+
+#ifdef SPINLOCK_STATS
+	// Only the holder touches these, so no need to be atomic
+	if (start) {
+		lock->contended++;
+		lock->spin_cycles += lockstat_cycles() - start;
+	}
+	if (lock->acquired++ == 0)
+		lockstat_register(lock);
+#endif
+}
+
+// Returns 1 if the lock was taken, 0 if somebody else has it
+int spin_trylock(spinlock_t *lock) {
+	preempt_disable();
+	uint16_t owner = lock->owner;
+
+	// Only take a ticket if it'd be served right away
+	uint32_t old = ((uint32_t)owner << 16) | owner;
+	uint32_t new = ((uint32_t)(uint16_t)(owner + 1) << 16) | owner;
+	if (!__sync_bool_compare_and_swap((volatile uint32_t *)lock, old, new)) {
+		preempt_enable();
+		return 0;
+	}
+
+#ifdef SPINLOCK_STATS
+	if (lock->acquired++ == 0)
+		lockstat_register(lock);
+#endif
+
+	return 1;
+}
+
+void spin_unlock(spinlock_t *lock) {
+	__sync_synchronize();
+	lock->owner++;
+	preempt_enable();
+}
+
+// Interrupts stay off until the matching spin_unlock_irqrestore
+uint32_t spin_lock_irqsave(spinlock_t *lock) {
+	uint32_t eflags = irq_save();
+	spin_lock(lock);
+	return eflags;
 }
 
-void spin_unlock(volatile spinlock_t *lock){
-	__sync_lock_release(lock);
+void spin_unlock_irqrestore(spinlock_t *lock, uint32_t eflags) {
+	__sync_synchronize();
+	lock->owner++;
+	irq_restore(eflags);
+	preempt_enable();
 }
\ No newline at end of file
@@ -0,0 +1,334 @@
+/* elevator.c - I/O schedulers. noop keeps arrival order, deadline sweeps the
+ * disk in one direction but won't let anything wait past its expiry
+ */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <common.h>
+#include <elevator.h>
+#include <block.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <errno.h>
+
+extern volatile uint32_t tick;
+
+struct request_queue {
+	request_t *head;
+	request_t *tail;
+};
+
+// Link req into q before pos, or at the end if pos is NULL
+static void rq_insert(struct request_queue *q, uint32_t which, request_t *pos,
+		request_t *req) {
+	req->link[which].next = pos;
+	req->link[which].prev = pos ? pos->link[which].prev : q->tail;
+
+	if (req->link[which].prev)
+		req->link[which].prev->link[which].next = req;
+	else
+		q->head = req;
+
+	if (pos)
+		pos->link[which].prev = req;
+	else
+		q->tail = req;
+}
+
+static void rq_remove(struct request_queue *q, uint32_t which,
+		request_t *req) {
+	if (req->link[which].prev)
+		req->link[which].prev->link[which].next = req->link[which].next;
+	else
+		q->head = req->link[which].next;
+
+	if (req->link[which].next)
+		req->link[which].next->link[which].prev = req->link[which].prev;
+	else
+		q->tail = req->link[which].prev;
+
+	req->link[which].prev = req->link[which].next = NULL;
+}
+
+/* Whether req carries on straight after target, or leads straight into it,
+ * in the same direction and without growing it past max_sectors. 1 if it
+ * goes behind, -1 in front, 0 if it can't be merged
+ */
+int elv_mergeable(request_t *target, request_t *req, uint32_t max_sectors) {
+	if ((target->flags ^ req->flags) & BLOCK_DIR_WRITE)
+		return 0;
+	if (target->nsectors + req->nsectors > max_sectors)
+		return 0;
+
+	if (target->first_sector + target->nsectors == req->first_sector)
+		return 1;
+	if (req->first_sector + req->nsectors == target->first_sector)
+		return -1;
+
+	return 0;
+}
+
+/* noop: first come, first served. For devices where seeking is free, or
+ * that do their own reordering
+ */
+static void *noop_init(void) {
+	struct request_queue *fifo =
+		(struct request_queue *)kmalloc(sizeof(struct request_queue));
+	if (!fifo)
+		return NULL;
+
+	fifo->head = fifo->tail = NULL;
+	return fifo;
+}
+
+static void noop_exit(void *data) {
+	ASSERT(!((struct request_queue *)data)->head);
+	kfree(data);
+}
+
+static void noop_add(void *data, request_t *req) {
+	rq_insert((struct request_queue *)data, 0, NULL, req);
+}
+
+static void noop_remove(void *data, request_t *req) {
+	rq_remove((struct request_queue *)data, 0, req);
+}
+
+static request_t *noop_next(void *data) {
+	request_t *req = ((struct request_queue *)data)->head;
+	if (req)
+		noop_remove(data, req);
+	return req;
+}
+
+// Newest first, since that's what a sequential submitter just queued
+static request_t *noop_find_merge(void *data, request_t *req,
+		uint32_t max_sectors) {
+	request_t *target;
+	for (target = ((struct request_queue *)data)->tail; target;
+			target = target->link[0].prev)
+		if (elv_mergeable(target, req, max_sectors))
+			return target;
+
+	return NULL;
+}
+
+static struct io_scheduler noop_sched = {
+	.name = "noop",
+	.init = noop_init,
+	.exit = noop_exit,
+	.add = noop_add,
+	.next = noop_next,
+	.remove = noop_remove,
+	.find_merge = noop_find_merge,
+};
+
+/* deadline: C-LOOK over everything pending, always moving up the disk and
+ * jumping back to the lowest sector at the top. Each request also gets an
+ * expiry, reads much sooner than writes since somebody's usually waiting on
+ * them. Once the oldest of either has expired, it goes next and the sweep
+ * carries on from there
+ */
+#define DL_SORT	0
+#define DL_FIFO	1
+
+#define DL_DIR(req) (((req)->flags & BLOCK_DIR_WRITE) ? 1 : 0)
+
+struct deadline_data {
+	struct request_queue sorted;	// By first sector
+	struct request_queue fifo[2];	// Reads and writes, oldest first
+	uint32_t next_sector;			// Just past the last one sent
+};
+
+static const uint32_t deadline_expire[2] = {
+	DEADLINE_READ_EXPIRE,
+	DEADLINE_WRITE_EXPIRE
+};
+
+static void *deadline_init(void) {
+	struct deadline_data *dd =
+		(struct deadline_data *)kmalloc(sizeof(struct deadline_data));
+	if (!dd)
+		return NULL;
+
+	memset(dd, 0, sizeof(struct deadline_data));
+	return dd;
+}
+
+static void deadline_exit(void *data) {
+	ASSERT(!((struct deadline_data *)data)->sorted.head);
+	kfree(data);
+}
+
+static void deadline_sort(struct deadline_data *dd, request_t *req) {
+	// Behind anything for the same sector, so they stay in order
+	request_t *pos;
+	for (pos = dd->sorted.head; pos; pos = pos->link[DL_SORT].next)
+		if (pos->first_sector > req->first_sector)
+			break;
+	rq_insert(&dd->sorted, DL_SORT, pos, req);
+}
+
+static void deadline_add(void *data, request_t *req) {
+	struct deadline_data *dd = (struct deadline_data *)data;
+
+	req->deadline = tick + deadline_expire[DL_DIR(req)];
+	rq_insert(&dd->fifo[DL_DIR(req)], DL_FIFO, NULL, req);
+	deadline_sort(dd, req);
+}
+
+static void deadline_remove(void *data, request_t *req) {
+	struct deadline_data *dd = (struct deadline_data *)data;
+
+	rq_remove(&dd->sorted, DL_SORT, req);
+	rq_remove(&dd->fifo[DL_DIR(req)], DL_FIFO, req);
+}
+
+static request_t *deadline_next(void *data) {
+	struct deadline_data *dd = (struct deadline_data *)data;
+	request_t *req = NULL;
+
+	uint32_t dir;
+	for (dir = 0; dir < 2 && !req; dir++) {
+		request_t *oldest = dd->fifo[dir].head;
+		if (oldest && (int32_t)(tick - oldest->deadline) >= 0)
+			req = oldest;
+	}
+
+	if (!req) {
+		for (req = dd->sorted.head; req; req = req->link[DL_SORT].next)
+			if (req->first_sector >= dd->next_sector)
+				break;
+		if (!req)
+			req = dd->sorted.head;
+		if (!req)
+			return NULL;
+	}
+
+	deadline_remove(dd, req);
+	dd->next_sector = req->first_sector + req->nsectors;
+
+	return req;
+}
+
+// Only neighbours in sector order can be contiguous
+static request_t *deadline_find_merge(void *data, request_t *req,
+		uint32_t max_sectors) {
+	struct deadline_data *dd = (struct deadline_data *)data;
+
+	request_t *target;
+	for (target = dd->sorted.head; target; target = target->link[DL_SORT].next) {
+		if (target->first_sector > req->first_sector + req->nsectors)
+			break;
+		if (elv_mergeable(target, req, max_sectors))
+			return target;
+	}
+
+	return NULL;
+}
+
+// A front merge moves the start back. It keeps its place in the fifo
+static void deadline_merged(void *data, request_t *target) {
+	struct deadline_data *dd = (struct deadline_data *)data;
+
+	rq_remove(&dd->sorted, DL_SORT, target);
+	deadline_sort(dd, target);
+}
+
+static struct io_scheduler deadline_sched = {
+	.name = "deadline",
+	.init = deadline_init,
+	.exit = deadline_exit,
+	.add = deadline_add,
+	.next = deadline_next,
+	.remove = deadline_remove,
+	.find_merge = deadline_find_merge,
+	.merged = deadline_merged,
+};
+
+static struct io_scheduler *schedulers[] = {
+	&noop_sched,
+	&deadline_sched,
+};
+
+struct io_scheduler *find_iosched(const char *name) {
+	uint32_t i;
+	for (i = 0; i < sizeof(schedulers) / sizeof(*schedulers); i++)
+		if (strncmp(schedulers[i]->name, name, IOSCHED_NAME_MAX) == 0)
+			return schedulers[i];
+
+	return NULL;
+}
+
+// Give a new device its first scheduler
+int32_t elevator_init(blkdev_t *dev, const char *name) {
+	struct io_scheduler *sched = find_iosched(name);
+	if (!sched)
+		return -EINVAL;
+
+	void *data = sched->init();
+	if (!data)
+		return -ENOMEM;
+
+	dev->sched = sched;
+	dev->sched_data = data;
+	return 0;
+}
+
+void elevator_exit(blkdev_t *dev) {
+	if (!dev->sched)
+		return;
+
+	dev->sched->exit(dev->sched_data);
+	dev->sched = NULL;
+	dev->sched_data = NULL;
+}
+
+/* Change schedulers on a live device. Whatever's pending moves over in the
+ * order the old one would have sent it
+ */
+int32_t elevator_switch(blkdev_t *dev, const char *name) {
+	struct io_scheduler *sched = find_iosched(name);
+	if (!sched)
+		return -EINVAL;
+
+	void *data = sched->init();
+	if (!data)
+		return -ENOMEM;
+
+	acquire_mutex(dev->mutex);
+
+	if (sched == dev->sched) {
+		release_mutex(dev->mutex);
+		sched->exit(data);
+		return 0;
+	}
+
+	request_t *req;
+	while ((req = dev->sched->next(dev->sched_data)) != NULL)
+		sched->add(data, req);
+
+	dev->sched->exit(dev->sched_data);
+	dev->sched = sched;
+	dev->sched_data = data;
+
+	release_mutex(dev->mutex);
+
+	return 0;
+}
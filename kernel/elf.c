@@ -81,8 +81,9 @@ static int int_exec(const char *filename, uint32_t argc, char *argv[],
 			header->e_phoff);
 
 	// Deallocate memory of old process (not stack, we reuse it)
+	thread_group_t *group = current_task->group;
 	uintptr_t i;
-	for (i = current_task->start; i < current_task->brk_actual; i += PAGE_SIZE)
+	for (i = group->start; i < group->brk_actual; i += PAGE_SIZE)
 		free_frame(get_page(i, 0, current_dir));
 
 	// Allocate memory for new process
@@ -122,7 +123,7 @@ static int int_exec(const char *filename, uint32_t argc, char *argv[],
 	kfree(header);
 	kfree(prog_headers);
 
-	current_task->start = start;
+	group->start = start;
 
 	uintptr_t heap = end;
 	alloc_frame(get_page(heap, 1, current_dir), 0, 1);
@@ -153,8 +154,8 @@ static int int_exec(const char *filename, uint32_t argc, char *argv[],
 	heap += 1;
 	kfree(envp);
 
-	current_task->brk = (uint32_t)heap;
-	current_task->brk_actual = (uint32_t)heap_actual;
+	group->brk = (uint32_t)heap;
+	group->brk_actual = (uint32_t)heap_actual;
 
 	switch_user_mode(entry, argc, argv_, envp_, USER_STACK_TOP);
 error2:
@@ -168,6 +169,11 @@ int32_t execve(const char *filename, char *const argv[], char *const envp[]) {
 	if (!filename)
 		return -EFAULT;
 
+	// Other threads would be left running in an address space we're tearing
+	// down
+	if (current_task->group->threads > 1)
+		return -EBUSY;
+
 	if (!argv)
 		return -EFAULT;
 
@@ -28,37 +28,40 @@
 
 extern volatile task_t *current_task;
 
-static int32_t valid_fd(int32_t fd) {
+// Open file table is shared by every thread in the group
+struct filep *get_filep(int32_t fd) {
 	if (fd < 0)
-		return 0;
-	if (fd > MAX_OF)
-		return 0;
-	if (!current_task->files[fd].file)
-		return 0;
+		return NULL;
+	if (fd >= MAX_OF)
+		return NULL;
+	fs_node_t *file = current_task->group->files[fd].file;
+	if (!file || file == FILEP_RESERVED)
+		return NULL;
 
-	return 1;
+	return &current_task->group->files[fd];
 }
 
 off_t lseek(int32_t fd, off_t off, int32_t whence) {
-	if (!valid_fd(fd))
+	struct filep *filep = get_filep(fd);
+	if (!filep)
 		return -EBADF;
 
 	switch (whence) {
 	case SEEK_SET:
-		current_task->files[fd].off = off;
+		filep->off = off;
 		break;
 	case SEEK_CUR:
-		current_task->files[fd].off += off;
+		filep->off += off;
 		break;
 	case SEEK_END:
-		current_task->files[fd].off =
-			current_task->files[fd].file->len + off;
+		filep->off =
+			filep->file->len + off;
 		break;
 	default:
 		return -EINVAL;
 	}
 
-	return current_task->files[fd].off;
+	return filep->off;
 }
 
 static int check_flags(fs_node_t *file, uint32_t flags) {
@@ -94,60 +97,64 @@ static int check_flags(fs_node_t *file, uint32_t flags) {
 }
 
 ssize_t user_pread(int32_t fd, char *buf, size_t nbytes, off_t off) {
-	if (!valid_fd(fd))
+	struct filep *filep = get_filep(fd);
+	if (!filep)
 		return -EBADF;
 
 	if (!buf)
 		return -EFAULT;
 
-	if (!(current_task->files[fd].file->flags & O_RDONLY))
+	if (!(filep->file->flags & O_RDONLY))
 		return -EINVAL;
 
-	return read_vfs(current_task->files[fd].file, buf, nbytes, off);
+	return read_vfs(filep->file, buf, nbytes, off);
 }
 
 ssize_t user_read(int32_t fd, char *buf, size_t nbytes) {
-	if (!valid_fd(fd))
+	struct filep *filep = get_filep(fd);
+	if (!filep)
 		return -EBADF;
 
 	if (!buf)
 		return -EFAULT;
 
-	if (!(current_task->files[fd].file->flags & O_RDONLY))
+	if (!(filep->file->flags & O_RDONLY))
 		return -EINVAL;
 
-	ssize_t ret = read_vfs(current_task->files[fd].file, buf, nbytes,
-			current_task->files[fd].off);
-	current_task->files[fd].off += ret;
+	ssize_t ret = read_vfs(filep->file, buf, nbytes,
+			filep->off);
+	filep->off += ret;
 	return ret;
 }
 
 ssize_t user_pwrite(int32_t fd, const char *buf, size_t nbytes, off_t off) {
-	if (!valid_fd(fd))
+	struct filep *filep = get_filep(fd);
+	if (!filep)
 		return -EBADF;
 
 	if (!buf)
 		return -EFAULT;
 
-	if (!(current_task->files[fd].file->flags & O_WRONLY))
+	if (!(filep->file->flags & O_WRONLY))
 		return -EINVAL;
 
-	return write_vfs(current_task->files[fd].file, buf, nbytes, off);
+	return write_vfs(filep->file, buf, nbytes, off);
 }
 
 ssize_t user_write(int32_t fd, const char *buf, size_t nbytes) {
-	if (!valid_fd(fd))
+	struct filep *filep = get_filep(fd);
+	if (!filep)
 		return -EBADF;
 
 	if (!buf)
 		return -EFAULT;
 
-	if (!(current_task->files[fd].file->flags & O_WRONLY))
+	if (!(filep->file->flags & O_WRONLY))
 		return -EINVAL;
 
-	uint32_t ret = write_vfs(current_task->files[fd].file, buf, nbytes,
-			current_task->files[fd].off);
-	current_task->files[fd].off += ret;
+	uint32_t ret = write_vfs(filep->file, buf, nbytes,
+			filep->off);
+	filep->off += ret;
 	return ret;
 }
 
@@ -193,18 +200,9 @@ static fs_node_t *getparent(const char *path, char *child, int32_t *retval) {
 	return parent;
 }
 
-int32_t user_open(const char *path, uint32_t flags, mode_t mode) {
-	if (!path)
-		return -EFAULT;
-
-	int i;
-	for (i = 0; i < MAX_OF; i++)
-		if (current_task->files[i].file == NULL)
-			break;
-
-	if (i == MAX_OF)
-		return -ENFILE;
-
+// Fills in a slot user_open has reserved
+static int32_t open_slot(const char *path, uint32_t flags, mode_t mode,
+		struct filep *filep) {
 	int32_t ret;
 
 	if (flags & O_CREAT) {
@@ -229,8 +227,10 @@ int32_t user_open(const char *path, uint32_t flags, mode_t mode) {
 
 	fs_node_t *file = kopen(path, flags, &ret);
 	if (file && check_flags(file, flags)) {
-		current_task->files[i].file = file;
-		return i;
+		filep->off = 0;
+		__sync_synchronize();
+		filep->file = file;
+		return 0;
 	} else if (file) {
 		close_vfs(file);
 		ret = -EINVAL;
@@ -239,24 +239,50 @@ int32_t user_open(const char *path, uint32_t flags, mode_t mode) {
 	return ret;
 }
 
+int32_t user_open(const char *path, uint32_t flags, mode_t mode) {
+	if (!path)
+		return -EFAULT;
+
+	// Opening may sleep, so hold the slot so no other thread takes it
+	struct filep *files = current_task->group->files;
+	int i;
+	for (i = 0; i < MAX_OF; i++)
+		if (__sync_bool_compare_and_swap(&files[i].file, NULL, FILEP_RESERVED))
+			break;
+
+	if (i == MAX_OF)
+		return -ENFILE;
+
+	int32_t ret = open_slot(path, flags, mode, &files[i]);
+	if (ret < 0)
+		files[i].file = NULL;
+
+	return ret < 0 ? ret : i;
+}
+
 int32_t user_close(int32_t fd) {
-	if (!valid_fd(fd))
+	struct filep *filep = get_filep(fd);
+	if (!filep)
 		return -EBADF;
 
-	uint32_t ret = close_vfs(current_task->files[fd].file);
-	if (ret == 0)
-		current_task->files[fd].file = NULL;
-	return ret;
+	// Only one of several threads closing the same fd gets the node
+	fs_node_t *file = filep->file;
+	if (!file || file == FILEP_RESERVED ||
+			!__sync_bool_compare_and_swap(&filep->file, file, NULL))
+		return -EBADF;
+
+	return close_vfs(file);
 }
 
 int32_t user_readdir(int32_t fd, struct dirent *dirp, uint32_t index) {
-	if (!valid_fd(fd))
+	struct filep *filep = get_filep(fd);
+	if (!filep)
 		return -EBADF;
 
 	if (!dirp)
 		return -EFAULT;
 
-	return readdir_vfs(current_task->files[fd].file, dirp, index);
+	return readdir_vfs(filep->file, dirp, index);
 }
 
 int32_t user_stat(const char *path, struct stat *buff) {
@@ -276,32 +302,56 @@ int32_t user_stat(const char *path, struct stat *buff) {
 }
 
 int32_t user_chmod(int32_t fd, mode_t mode) {
-	if (!valid_fd(fd))
+	struct filep *filep = get_filep(fd);
+	if (!filep)
 		return -EBADF;
 
-	if (current_task->euid == current_task->files[fd].file->uid ||
+	if (current_task->euid == filep->file->uid ||
 			current_task->euid == 0)
-		return chmod_vfs(current_task->files[fd].file, mode);
+		return chmod_vfs(filep->file, mode);
 
 	return -EPERM;
 }
 
 int32_t user_chown(int32_t fd, uid_t uid, gid_t gid) {
-	if (!valid_fd(fd))
+	struct filep *filep = get_filep(fd);
+	if (!filep)
 		return -EBADF;
 	
-	if (current_task->euid == current_task->files[fd].file->uid ||
+	if (current_task->euid == filep->file->uid ||
 			current_task->euid == 0)
-		return chown_vfs(current_task->files[fd].file, uid, gid);
+		return chown_vfs(filep->file, uid, gid);
 
 	return -EPERM;
 }
 
 int32_t user_ioctl(int32_t fd, uint32_t request, void *ptr) {
-	if (!valid_fd(fd))
+	struct filep *filep = get_filep(fd);
+	if (!filep)
+		return -EBADF;
+
+	return ioctl_vfs(filep->file, request, ptr);
+}
+
+int32_t user_sync(void) {
+	sync_vfs();
+	return 0;
+}
+
+int32_t user_fsync(int32_t fd) {
+	struct filep *filep = get_filep(fd);
+	if (!filep)
+		return -EBADF;
+
+	return fsync_vfs(filep->file, 0);
+}
+
+int32_t user_fdatasync(int32_t fd) {
+	struct filep *filep = get_filep(fd);
+	if (!filep)
 		return -EBADF;
 
-	return ioctl_vfs(current_task->files[fd].file, request, ptr);
+	return fsync_vfs(filep->file, 1);
 }
 
 int32_t user_link(const char *oldpath, const char *newpath) {
@@ -0,0 +1,191 @@
+/* fpu.c - lazy FPU/SSE context switching. A task's FPU state is only saved
+ * and restored when somebody else actually touches the FPU, so tasks that
+ * never use it cost nothing on a context switch
+ */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <common.h>
+#include <fpu.h>
+#include <task.h>
+#include <idt.h>
+#include <cpuid.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <printf.h>
+#include <errno.h>
+
+// Defined in task.c
+extern volatile task_t *current_task;
+
+// Task whose state is currently loaded in the FPU
+static task_t *fpu_owner = NULL;
+static int have_fpu = 0;
+static int use_fxsr = 0;
+// Freshly initialized state handed to tasks on their first FPU instruction
+static fpu_state_t fpu_init_state;
+
+static inline uint32_t read_cr0(void) {
+	uint32_t cr0;
+	asm volatile("mov %%cr0, %0" : "=r"(cr0));
+	return cr0;
+}
+
+static inline void write_cr0(uint32_t cr0) {
+	asm volatile("mov %0, %%cr0" :: "r"(cr0));
+}
+
+static inline void clts(void) {
+	asm volatile("clts");
+}
+
+static inline void stts(void) {
+	write_cr0(read_cr0() | CR0_TS);
+}
+
+static void fpu_save(fpu_state_t *state) {
+	if (use_fxsr)
+		asm volatile("fxsave (%0)" :: "r"(state) : "memory");
+	else
+		// fnsave reinitializes the FPU, so put the state straight back
+		asm volatile("fnsave (%0); frstor (%0)" :: "r"(state) : "memory");
+}
+
+static void fpu_restore(fpu_state_t *state) {
+	if (use_fxsr)
+		asm volatile("fxrstor (%0)" :: "r"(state) : "memory");
+	else
+		asm volatile("frstor (%0)" :: "r"(state) : "memory");
+}
+
+// #NM. Raised by the first FPU/SSE instruction after a switch with CR0.TS set
+static void fpu_trap(registers_t *regs) {
+	task_t *task = (task_t *)current_task;
+
+	if (!have_fpu) {
+		printf("No FPU, killing %s\n", task->cmd);
+		exit_task(-ENOSYS);
+	}
+
+	clts();
+	if (fpu_owner == task)
+		return;
+
+	if (fpu_owner)
+		fpu_save(fpu_owner->fpu);
+	fpu_owner = NULL;
+
+	if (!task->fpu) {
+		task->fpu = (fpu_state_t *)kmemalign(16, sizeof(fpu_state_t));
+		if (!task->fpu) {
+			stts();
+			exit_task(-ENOMEM);
+		}
+		memcpy(task->fpu, &fpu_init_state, sizeof(fpu_state_t));
+	}
+
+	fpu_restore(task->fpu);
+	fpu_owner = task;
+}
+
+void init_fpu(void) {
+	uint32_t regs[3];
+	cpuid(CPUID_GET_FEATURES, regs);
+
+	ASSERT(register_interrupt_handler(7, &fpu_trap) == 0);
+
+	if (!(regs[2] & CPUID_FEAT_EDX_FPU)) {
+		// Leave CR0.EM set so every FPU instruction ends up in fpu_trap
+		printf("No FPU present\n");
+		return;
+	}
+	have_fpu = 1;
+
+	uint32_t cr0 = read_cr0();
+	cr0 &= ~(CR0_EM | CR0_TS);
+	cr0 |= CR0_MP | CR0_NE;
+	write_cr0(cr0);
+
+	if (regs[2] & CPUID_FEAT_EDX_FXSR) {
+		use_fxsr = 1;
+		uint32_t cr4;
+		asm volatile("mov %%cr4, %0" : "=r"(cr4));
+		cr4 |= CR4_OSFXSR;
+		if (regs[2] & CPUID_FEAT_EDX_SSE)
+			cr4 |= CR4_OSXMMEXCPT;
+		asm volatile("mov %0, %%cr4" :: "r"(cr4));
+	}
+
+	asm volatile("fninit");
+	if (regs[2] & CPUID_FEAT_EDX_SSE) {
+		uint32_t mxcsr = MXCSR_DEFAULT;
+		asm volatile("ldmxcsr %0" :: "m"(mxcsr));
+	}
+	fpu_save(&fpu_init_state);
+
+	// Nobody owns the FPU yet
+	stts();
+
+	printf("FPU: %s%s\n", use_fxsr ? "fxsave" : "fnsave",
+		(regs[2] & CPUID_FEAT_EDX_SSE) ? ", SSE" : "");
+}
+
+// Called with interrupts disabled on every context switch
+void fpu_switch(task_t *next) {
+	if (next == fpu_owner)
+		clts();
+	else
+		stts();
+}
+
+// The child starts with a copy of whatever the parent had in the FPU
+int32_t fpu_fork(task_t *parent, task_t *child) {
+	child->fpu = NULL;
+	if (!parent->fpu)
+		return 0;
+
+	child->fpu = (fpu_state_t *)kmemalign(16, sizeof(fpu_state_t));
+	if (!child->fpu)
+		return -ENOMEM;
+
+	uint32_t eflags = irq_save();
+	if (fpu_owner == parent) {
+		// Parent is running, so TS is already clear
+		fpu_save(parent->fpu);
+	}
+	irq_restore(eflags);
+
+	memcpy(child->fpu, parent->fpu, sizeof(fpu_state_t));
+
+	return 0;
+}
+
+void fpu_release(task_t *task) {
+	uint32_t eflags = irq_save();
+	if (fpu_owner == task) {
+		fpu_owner = NULL;
+		stts();
+	}
+	irq_restore(eflags);
+
+	if (task->fpu) {
+		kfree(task->fpu);
+		task->fpu = NULL;
+	}
+}
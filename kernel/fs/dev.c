@@ -23,6 +23,8 @@
 #include <fs/dev.h>
 #include <char.h>
 #include <block.h>
+#include <bcache.h>
+#include <paging.h>
 #include <string.h>
 #include <kmalloc.h>
 #include <printf.h>
@@ -45,6 +47,7 @@ static int32_t create(fs_node_t *parent, const char *fname, uid_t uid,
 		uid_t gid, mode_t mode, dev_t dev);
 static int32_t link(fs_node_t *parent, fs_node_t *child, const char *fname);
 static int32_t unlink(fs_node_t *parent, const char *fname);
+static int32_t fsync(fs_node_t *node, int32_t datasync);
 
 file_system_t dev_fs = {
 	.flags = FS_NODEV,
@@ -63,7 +66,8 @@ struct file_ops devfs_ops = {
 	.ioctl = ioctl,
 	.create = create,
 	.link = link,
-	.unlink = unlink
+	.unlink = unlink,
+	.fsync = fsync
 };
 
 void init_devfs(void) {
@@ -76,8 +80,10 @@ static int32_t close_fs(struct superblock *sb, uint32_t force) {
 	if (!force) {
 		struct dev_file *iter = container_of(sb->root, struct dev_file, node);
 		while (iter) {
-			if (iter->node.refcount > 0)
+			if (iter->node.refcount > 0) {
+				release_semaphore_write((rw_sem_t *)sb->private_data);
 				return -EBUSY;
+			}
 			iter = iter->next;
 		}
 	}
@@ -91,6 +97,7 @@ static int32_t close_fs(struct superblock *sb, uint32_t force) {
 		iter = next;
 	}
 
+	release_semaphore_write((rw_sem_t *)sb->private_data);
 	destroy_rw_semaphore((rw_sem_t *)sb->private_data);
 	kfree(sb);
 	return 0;
@@ -104,7 +111,7 @@ static struct superblock *return_sb(dev_t dev, uint32_t flags) {
 	if (!sb)
 		return NULL;
 
-	rw_sem_t *sem = create_rw_semaphore(32);
+	rw_sem_t *sem = create_rw_semaphore();
 	if (!sem) {
 		kfree(sb);
 		return NULL;
@@ -176,7 +183,14 @@ static void file_insert(struct superblock *sb, struct dev_file *file) {
 
 	// We're assuming that the inode is not 0 and is unique
 	file->next = prev->next;
-	prev->next = file;
+	rcu_assign_pointer(prev->next, file);
+}
+
+static void free_file(struct rcu_head *head) {
+	struct dev_file *file = container_of(head, struct dev_file, rcu);
+	if (file->node.mode & VFS_DIR)
+		list_destroy(file->node.private_data);
+	kfree(file);
 }
 
 static void file_remove(struct superblock *sb, ino_t inode) {
@@ -191,204 +205,234 @@ static void file_remove(struct superblock *sb, ino_t inode) {
 		iter = iter->next;
 	}
 
+	// Anyone looking at it can still follow iter->next
 	prev->next = iter->next;
-
-	if (iter->node.mode & VFS_DIR)
-		list_destroy(iter->node.private_data);
-	kfree(iter);
+	call_rcu(&iter->rcu, free_file);
 }
 
-static ssize_t read_blkdev(dev_t dev, void *buf, size_t count, off_t off) {
-	ssize_t ret = 0;
-	size_t sector_size = get_block_size(dev);
-	off_t delta = off % sector_size;
-	off -= delta;
-
-	request_t *req = create_request_blkdev(dev, off / sector_size, 0);
-	if (!req)
-		return -ENOMEM;
-
-	uint32_t nsects = (count + delta) / sector_size;
-	if ((count + delta) % sector_size)
-		nsects++;
-
-	void *bounce = kmemalign(sector_size, nsects * sector_size);
-	if (!bounce) {
-		free_request(req);
-		return -ENOMEM;
-	}
+// Block devices go through the buffer cache
+static ssize_t read_blkdev(dev_t dev, struct file_ra *ra, void *buf,
+		size_t count, off_t off) {
+	if (count)
+		file_readahead(ra, dev, off >> BCACHE_BLOCK_SHIFT,
+			((off + count - 1) >> BCACHE_BLOCK_SHIFT) -
+			(off >> BCACHE_BLOCK_SHIFT) + 1);
+
+	size_t done = 0;
+	while (done < count) {
+		struct buffer *block = bread(dev, off >> BCACHE_BLOCK_SHIFT);
+		if (!block)
+			break;
 
-	uintptr_t bounce_offset = 0;
-	while (nsects) {
-		bio_t *bio = (bio_t *)kmalloc(sizeof(bio_t));
-		if (!bio) {
-			ret = -ENOMEM;
-			goto fail;
+		size_t start = off % BCACHE_BLOCK_SIZE;
+		if (start >= block->size) {
+			brelse(block);
+			break;
 		}
 
-		bio->page = resolve_physical((uintptr_t)bounce + bounce_offset);
-		bio->offset = bio->page % PAGE_SIZE;
-		bio->page = (bio->page / PAGE_SIZE) * PAGE_SIZE;
-
-		if (PAGE_SIZE - bio->offset < nsects * sector_size)
-			bio->nsectors = (PAGE_SIZE - bio->offset) / sector_size;
-		else
-			bio->nsectors = nsects;
+		size_t n = block->size - start;
+		if (n > count - done)
+			n = count - done;
 
-		bounce_offset += bio->nsectors * sector_size;
-		nsects -= bio->nsectors;
+		memcpy((uint8_t *)buf + done, (uint8_t *)block->data + start, n);
+		brelse(block);
 
-		if ((ret = add_bio_to_request_blkdev(req, bio)) < 0) {
-			kfree(bio);
-			goto fail;
-		}
+		done += n;
+		off += n;
 	}
 
-	if ((ret = post_and_wait_blkdev(req)) < 0)
-		goto fail;
-
-	free_request(req);
-
-	memcpy(buf, bounce + delta, count);
-	return count;
-
-fail:
-	kfree(bounce);
-	free_request(req);
-	return ret;
-}
-
-static ssize_t read(fs_node_t *node, void *buf, size_t count, off_t off) {
-	if (node->mode & VFS_CHARDEV) {
-		struct chrdev_driver *driver = get_chrdev_driver(MAJOR(node->dev));
-		if (driver && driver->ops.read)
-			return driver->ops.read(node, buf, count, off);
-	} else if (node->mode & VFS_BLOCKDEV)
-		return read_blkdev(node->dev, buf, count, off);
+	// Running off the end is EOF, failing before then is an error
+	if (done == 0 && count && (uint64_t)off <
+			(uint64_t)get_dev_sectors(dev) * get_block_size(dev))
+		return -EIO;
 
-	return -EINVAL;
+	return done;
 }
 
-static ssize_t write_blkdev(dev_t dev, const void *buf, size_t count, off_t off) {
-	ssize_t ret = 0;
-	size_t sector_size = get_block_size(dev);
-	off_t delta = off % sector_size;
-	off -= delta;
-
-	request_t *req = NULL;
-
-	uint32_t nsects = (count + delta) / sector_size;
-	if ((count + delta) % sector_size)
-		nsects++;
+extern page_directory_t *current_dir;
 
-	void *bounce = kmemalign(sector_size, nsects * sector_size);
-	if (!bounce)
-		return -ENOMEM;
+// Bios straight over the caller's pages, which have to be there already
+static int32_t add_direct_bios(request_t *req, uintptr_t addr, uint32_t nsects,
+		int to_memory) {
+	size_t sector_size = req->dev->sector_size;
+	while (nsects) {
+		page_t *page = get_page(addr, 0, current_dir);
+		if (!page || !page->present || (to_memory && !page->rw))
+			return -EFAULT;
 
-	if (delta) {
-		req = create_request_blkdev(dev, off / sector_size, 0);
-		if (!req) {
-			kfree(bounce);
+		bio_t *bio = (bio_t *)kmalloc(sizeof(bio_t));
+		if (!bio)
 			return -ENOMEM;
-		}
-
-		bio_t *bio = kmalloc(sizeof(bio_t));
-		if (!bio) {
-			ret = -ENOMEM;
-			goto fail;
-		}
 
-		bio->page = resolve_physical((uintptr_t)bounce);
+		bio->page = resolve_physical(addr);
 		bio->offset = bio->page % PAGE_SIZE;
 		bio->page = (bio->page / PAGE_SIZE) * PAGE_SIZE;
-		bio->nsectors = 1;
+		bio->nsectors = (PAGE_SIZE - bio->offset) / sector_size;
+		if (bio->nsectors > nsects)
+			bio->nsectors = nsects;
 
-		if ((ret = add_bio_to_request_blkdev(req, bio)) < 0) {
+		int32_t ret = add_bio_to_request_blkdev(req, bio);
+		if (ret < 0) {
 			kfree(bio);
-			goto fail;
+			return ret;
 		}
 
-		if ((ret = post_and_wait_blkdev(req)) < 0)
-			goto fail;
-
-		free_request(req);
+		addr += bio->nsectors * sector_size;
+		nsects -= bio->nsectors;
 	}
 
-	if ((count + delta) % sector_size) {
-		req = create_request_blkdev(dev, off / sector_size + nsects - 1, 0);
-		if (!req) {
-			kfree(bounce);
-			return -ENOMEM;
-		}
+	return 0;
+}
 
-		bio_t *bio = kmalloc(sizeof(bio_t));
-		if (!bio) {
-			ret = -ENOMEM;
-			goto fail;
-		}
+#define DIRECT_BATCH	8	// Requests in flight at once
 
-		bio->page = resolve_physical((uintptr_t)bounce +
-			(nsects - 1) * sector_size);
-		bio->offset = bio->page % PAGE_SIZE;
-		bio->page = (bio->page / PAGE_SIZE) * PAGE_SIZE;
-		bio->nsectors = 1;
+/* O_DIRECT. The device reads into or writes out of buf itself, a batch of
+ * requests in flight at a time, with nothing copied. Only for whole sectors in a
+ * sector aligned buffer, so none of them straddle a page
+ */
+static ssize_t direct_blkdev(dev_t dev, void *buf, size_t count, off_t off,
+		uint32_t flags) {
+	blkdev_t *blockdev = get_blkdev(dev);
+	if (!blockdev)
+		return -ENODEV;
+
+	size_t sector_size = blockdev->sector_size;
+	uint64_t dev_bytes = (uint64_t)get_dev_sectors(dev) * sector_size;
+	if ((uint64_t)off >= dev_bytes)
+		return (flags & BLOCK_DIR_WRITE) ? -ENOSPC : 0;
+	if ((uint64_t)off + count > dev_bytes)
+		count = dev_bytes - off;
+	if (count == 0)
+		return 0;
 
-		if ((ret = add_bio_to_request_blkdev(req, bio)) < 0) {
-			kfree(bio);
-			goto fail;
+	// Anything newer in the cache has to reach the disk first
+	uint32_t first_block = off >> BCACHE_BLOCK_SHIFT;
+	uint32_t nblocks = ((off + count - 1) >> BCACHE_BLOCK_SHIFT) - first_block + 1;
+	int32_t ret = bflush_range(dev, first_block, nblocks);
+	if (ret < 0)
+		return ret;
+
+	uint32_t max = blockdev->max_sectors ? blockdev->max_sectors :
+		BLOCK_MAX_SECTORS;
+	uint32_t sector = off / sector_size;
+	uint32_t nsects = count / sector_size;
+	uintptr_t addr = (uintptr_t)buf;
+	size_t done = 0;
+
+	while (nsects && ret == 0) {
+		struct blk_completion batch;
+		init_completion_blkdev(&batch);
+		uint32_t posted = 0;
+
+		struct blk_plug plug;
+		blk_start_plug(&plug);
+
+		uint32_t nreqs;
+		for (nreqs = 0; nsects && nreqs < DIRECT_BATCH; nreqs++) {
+			uint32_t n = nsects < max ? nsects : max;
+			request_t *req = create_request_blkdev(dev, sector, flags);
+			if (!req) {
+				ret = -ENOMEM;
+				break;
+			}
+
+			ret = add_direct_bios(req, addr, n, !(flags & BLOCK_DIR_WRITE));
+			if (ret < 0) {
+				free_request(req);
+				break;
+			}
+
+			post_counted_blkdev(req, &batch);
+			posted += n;
+			sector += n;
+			nsects -= n;
+			addr += n * sector_size;
 		}
 
-		if ((ret = post_and_wait_blkdev(req)) < 0)
-			goto fail;
+		blk_finish_plug(&plug);
 
-		free_request(req);
+		int32_t err = wait_completion_blkdev(&batch);
+		if (err < 0)
+			ret = err;
+		else
+			done += posted * sector_size;
 	}
 
-	memcpy(bounce + delta, buf, count);
+	// What the cache has for it is out of date now
+	if ((flags & BLOCK_DIR_WRITE) && done)
+		binvalidate_range(dev, first_block, nblocks);
 
-	req = create_request_blkdev(dev, off / sector_size, BLOCK_DIR_WRITE);
-	if (!req) {
-		kfree(bounce);
-		return -ENOMEM;
-	}
+	return done ? (ssize_t)done : ret;
+}
 
-	uintptr_t bounce_offset = 0;
-	while (nsects) {
-		bio_t *bio = (bio_t *)kmalloc(sizeof(bio_t));
-		if (!bio) {
-			ret = -ENOMEM;
-			goto fail;
-		}
+static int direct_ok(fs_node_t *node, const void *buf, size_t count, off_t off) {
+	size_t sector_size = get_block_size(node->dev);
+	if (!(node->flags & O_DIRECT) || !sector_size)
+		return 0;
 
-		bio->page = resolve_physical((uintptr_t)bounce + bounce_offset);
-		bio->offset = bio->page % PAGE_SIZE;
-		bio->page = (bio->page / PAGE_SIZE) * PAGE_SIZE;
+	return off % sector_size == 0 && count % sector_size == 0 &&
+		(uintptr_t)buf % sector_size == 0;
+}
 
-		if (PAGE_SIZE - bio->offset < nsects * sector_size)
-			bio->nsectors = (PAGE_SIZE - bio->offset) / sector_size;
-		else
-			bio->nsectors = nsects;
+static ssize_t read(fs_node_t *node, void *buf, size_t count, off_t off) {
+	if (node->mode & VFS_CHARDEV) {
+		struct chrdev_driver *driver = get_chrdev_driver(MAJOR(node->dev));
+		if (driver && driver->ops.read)
+			return driver->ops.read(node, buf, count, off);
+	} else if (node->mode & VFS_BLOCKDEV) {
+		// Unaligned transfers still go through the cache
+		if (direct_ok(node, buf, count, off))
+			return direct_blkdev(node->dev, buf, count, off, 0);
+		return read_blkdev(node->dev, &node->ra, buf, count, off);
+	}
 
-		bounce_offset += bio->nsectors * sector_size;
-		nsects -= bio->nsectors;
+	return -EINVAL;
+}
 
-		if ((ret = add_bio_to_request_blkdev(req, bio)) < 0) {
-			kfree(bio);
-			goto fail;
+/* Partial blocks are read in first, whole ones just overwritten. They're
+ * written back later, unless too much is dirty already
+ */
+static ssize_t write_blkdev(dev_t dev, const void *buf, size_t count, off_t off) {
+	size_t done = 0;
+	int32_t ret = 0;
+	while (done < count) {
+		uint32_t index = off >> BCACHE_BLOCK_SHIFT;
+		size_t start = off % BCACHE_BLOCK_SIZE;
+
+		struct buffer *block = bget(dev, index);
+		if (!block || start >= block->size) {
+			if (block)
+				brelse(block);
+			ret = -ENOSPC;
+			break;
+		}
+
+		size_t n = block->size - start;
+		if (n > count - done)
+			n = count - done;
+
+		if (n < block->size && !(block->flags & BUF_UPTODATE)) {
+			brelse(block);
+			block = bread(dev, index);
+			if (!block) {
+				ret = -EIO;
+				break;
+			}
 		}
-	}
 
-	if ((ret = post_and_wait_blkdev(req)) < 0)
-		goto fail;
+		lock_buffer(block);
+		memcpy((uint8_t *)block->data + start, (const uint8_t *)buf + done, n);
+		bdirty(block);
+		unlock_buffer(block);
+		brelse(block);
 
-	free_request(req);
+		done += n;
+		off += n;
+	}
 
-	return count;
+	balance_dirty();
 
-fail:
-	kfree(bounce);
-	free_request(req);
-	return -ENOMEM;
+	return done ? (ssize_t)done : ret;
 }
 
 static ssize_t write(fs_node_t *node, const void *buf, size_t count, off_t off) {
@@ -396,8 +440,12 @@ static ssize_t write(fs_node_t *node, const void *buf, size_t count, off_t off)
 		struct chrdev_driver *driver = get_chrdev_driver(MAJOR(node->dev));
 		if (driver && driver->ops.write)
 			return driver->ops.write(node, buf, count, off);
-	} else if (node->mode & VFS_BLOCKDEV)
+	} else if (node->mode & VFS_BLOCKDEV) {
+		if (direct_ok(node, buf, count, off))
+			return direct_blkdev(node->dev, (void *)buf, count, off,
+				BLOCK_DIR_WRITE);
 		return write_blkdev(node->dev, buf, count, off);
+	}
 
 	return -EINVAL;
 }
@@ -424,8 +472,9 @@ static int32_t open(fs_node_t *node, uint32_t flags) {
 			ret = driver->ops.open(node, flags);
 	}
 
+	// Opens only hold the lock shared, so they can race each other here
 	if (ret == 0)
-		master->refcount++;
+		__sync_add_and_fetch(&master->refcount, 1);
 
 exit:
 	release_semaphore_read((rw_sem_t *)node->fs_sb->private_data);
@@ -476,64 +525,82 @@ static int32_t readdir(fs_node_t *node, struct dirent *dirp, uint32_t index) {
 	}
 
 	index -= 2;
+	int32_t ret = 0;
+	rcu_read_lock();
 	node_t *entry = list_get_index((list_t *)node->private_data, index);
-	if (!entry)
-		return 0;
+	if (entry) {
+		memcpy(dirp, entry->data, sizeof(struct dirent));
+		ret = 1;
+	}
+	rcu_read_unlock();
 
-	memcpy(dirp, entry->data, sizeof(struct dirent));
-	return 1;
+	return ret;
 }
 
+// Lookups only take the RCU read side, so they never wait on create/unlink
 static fs_node_t *finddir(fs_node_t *node, const char *fname) {
+	fs_node_t *ret = (fs_node_t *)kmalloc(sizeof(fs_node_t));
+	if (!ret)
+		return NULL;
+
+	rcu_read_lock();
+
 	node_t *entry;
 	foreach(entry, ((list_t *)node->private_data)) {
 		if (strcmp(((struct dirent *)entry->data)->d_name, fname) == 0)
 			break;
 	}
 
-	if (!entry)
-		return NULL;
+	fs_node_t *master = NULL;
+	if (entry)
+		master = get_inode(node->fs_sb, ((struct dirent *)entry->data)->d_ino);
+	if (master)
+		memcpy(ret, master, sizeof(fs_node_t));
 
-	fs_node_t *master = get_inode(node->fs_sb, 
-		((struct dirent *)entry->data)->d_ino);
-	if (!master)
-		return NULL;
+	rcu_read_unlock();
 
-	fs_node_t *ret = (fs_node_t *)kmalloc(sizeof(fs_node_t));
-	if (!ret)
+	if (!master) {
+		kfree(ret);
 		return NULL;
-
-	memcpy(ret, master, sizeof(fs_node_t));
+	}
 
 	return ret;
 }
 
 static int32_t chmod(fs_node_t *node, mode_t mode) {
+	rcu_read_lock();
 	fs_node_t *master = get_inode(node->fs_sb, node->inode);
-	if (!master)
-		return -ENOENT;
-	master->mode = (master->mode & VFS_TYPE_MASK) | (mode & VFS_PERM_MASK);
-	node->mode = master->mode;
+	if (master) {
+		master->mode = (master->mode & VFS_TYPE_MASK) | (mode & VFS_PERM_MASK);
+		node->mode = master->mode;
+	}
+	rcu_read_unlock();
 
-	return 0;
+	return master ? 0 : -ENOENT;
 }
 
 static int32_t chown(fs_node_t *node, uid_t uid, gid_t gid) {
+	rcu_read_lock();
 	fs_node_t *master = get_inode(node->fs_sb, node->inode);
-	if (!master)
-		return -ENOENT;
-	master->uid = node->uid = uid;
-	master->gid = node->gid = gid;
+	if (master) {
+		master->uid = node->uid = uid;
+		master->gid = node->gid = gid;
+	}
+	rcu_read_unlock();
 
-	return 0;
+	return master ? 0 : -ENOENT;
 }
 
 static int32_t ioctl(fs_node_t *node, uint32_t req, void *data) {
 	if (node->mode & VFS_CHARDEV) {
 		struct chrdev_driver *driver = get_chrdev_driver(MAJOR(node->dev));
 		if (driver && driver->ops.ioctl)
-			driver->ops.ioctl(node, req, data);
+			return driver->ops.ioctl(node, req, data);
 	} else if (node->mode & VFS_BLOCKDEV) {
+		int32_t ret = ioctl_blkdev(node->dev, req, data);
+		if (ret != -ENOTTY)
+			return ret;
+
 		struct blkdev_driver *driver = get_blkdev_driver(MAJOR(node->dev));
 		if (driver && driver->ops.ioctl)
 			return driver->ops.ioctl(node, req, data);
@@ -542,6 +609,14 @@ static int32_t ioctl(fs_node_t *node, uint32_t req, void *data) {
 	return -ENOTTY;
 }
 
+// Devices have no metadata of their own, so datasync makes no difference
+static int32_t fsync(fs_node_t *node, int32_t datasync) {
+	if (node->mode & VFS_BLOCKDEV)
+		return bflush(node->dev);
+
+	return 0;
+}
+
 static uint32_t get_empty_inode(struct superblock *sb) {
 	struct dev_file *file = container_of(sb->root, struct dev_file, node);
 	ino_t inode = 0;
@@ -660,7 +735,9 @@ static int32_t unlink(fs_node_t *parent, const char *fname) {
 		return -ENOENT;
 	}
 
-	list_remove((list_t *)parent->private_data, iter);
+	list_dequeue_rcu((list_t *)parent->private_data, iter);
+	kfree_rcu(iter->data);
+	kfree_rcu(iter);
 
 	if (--child->nlink == 0 && child->refcount == 0)
 		file_remove(parent->fs_sb, child->inode);
@@ -86,7 +86,7 @@ static struct superblock *return_sb(uint32_t flags, fs_node_t *dev) {
 		goto error;
 
 	sb->inode_list = NULL;
-	sb->lock = 0;
+	spin_lock_init(&sb->lock, "fat32");
 
 	fs_node_t *root = (fs_node_t *)kmalloc(sizeof(fs_node_t));
 	if (root == NULL)
@@ -0,0 +1,180 @@
+/* futex.c - user space locks that only enter the kernel when contended.
+ * Waiters are keyed by the physical address of the futex word, so anything
+ * mapping the same frame finds the same queue
+ */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <common.h>
+#include <futex.h>
+#include <task.h>
+#include <timer.h>
+#include <paging.h>
+#include <clocksource.h>
+#include <errno.h>
+
+// Defined in task.c
+extern volatile task_t *current_task;
+
+// Defined in paging.c
+extern page_directory_t *current_dir;
+
+// Defined in timer.c
+extern volatile uint32_t tick;
+
+// Timers take expiry ticks as a signed offset from now, so no further than this
+#define FUTEX_MAX_TICKS	0x7FFFFFF0
+
+// Unrelated futexes can share a bucket. Waiters check their key on wakeup
+static waitqueue_t *futex_queues[FUTEX_HASH_SIZE];
+
+struct futex_timeout {
+	struct timer timer;
+	task_t *task;
+	waitqueue_t *wq;
+	int expired;
+};
+
+void init_futex(void) {
+	uint32_t i;
+	for (i = 0; i < FUTEX_HASH_SIZE; i++) {
+		futex_queues[i] = create_waitqueue();
+		ASSERT(futex_queues[i]);
+	}
+}
+
+static waitqueue_t *futex_queue(uintptr_t key) {
+	// Multiplicative hash. The low 2 bits are always 0
+	return futex_queues[((key >> 2) * 0x9E370001) >> (32 - FUTEX_HASH_BITS)];
+}
+
+// Physical address of a user futex, or 0 if it can't be one
+static uintptr_t futex_key(uint32_t *uaddr) {
+	uintptr_t addr = (uintptr_t)uaddr;
+	if (!addr || addr % sizeof(uint32_t) || addr >= KERNEL_BASE)
+		return 0;
+
+	page_t *page = get_page(addr, 0, current_dir);
+	if (!page || !page->present || !page->user)
+		return 0;
+
+	return page->frame * PAGE_SIZE + addr % PAGE_SIZE;
+}
+
+// Called from the timer interrupt
+static void futex_timeout(struct timer *timer) {
+	struct futex_timeout *to = container_of(timer, struct futex_timeout, timer);
+	if ((to->task->sleep_flags & SLEEP_ASLEEP) && to->task->wq == to->wq) {
+		to->expired = 1;
+		wake_task(to->task);
+	}
+}
+
+static int32_t futex_wait(uint32_t *uaddr, uintptr_t key, uint32_t val,
+		const struct timespec *timeout) {
+	waitqueue_t *wq = futex_queue(key);
+	task_t *task = (task_t *)current_task;
+
+	struct futex_timeout to = {
+		.timer = TIMER_INITIALIZER(futex_timeout),
+		.task = task,
+		.wq = wq,
+		.expired = 0,
+	};
+
+	if (timeout) {
+		if (timeout->tv_nsec < 0 || timeout->tv_nsec >= (long)NSEC_PER_SEC)
+			return -EINVAL;
+
+		/* Round up, and one more since the current tick is partly gone.
+		 * Anything past what the timer wheel can reach waits that long
+		 */
+		uint64_t ticks = (uint64_t)timeout->tv_sec * HZ +
+			(timeout->tv_nsec + NSEC_PER_SEC / HZ - 1) / (NSEC_PER_SEC / HZ);
+		if (ticks > FUTEX_MAX_TICKS)
+			ticks = FUTEX_MAX_TICKS;
+		to.timer.expires = tick + (uint32_t)ticks + 1;
+	}
+
+	/* Checking the value and going to sleep have to be atomic, or a wake
+	 * between the two would be lost
+	 */
+	uint32_t eflags = irq_save();
+
+	if (*uaddr != val) {
+		irq_restore(eflags);
+		return -EAGAIN;
+	}
+
+	if (timeout)
+		add_timer(&to.timer);
+
+	task->futex = key;
+	int interrupted = sleep_thread(wq, SLEEP_INTERRUPTABLE);
+	task->futex = 0;
+
+	del_timer(&to.timer);
+	irq_restore(eflags);
+
+	if (to.expired)
+		return -ETIMEDOUT;
+	if (interrupted)
+		return -EINTR;
+	return 0;
+}
+
+static int32_t futex_wake(uintptr_t key, uint32_t count) {
+	waitqueue_t *wq = futex_queue(key);
+	int32_t woken = 0;
+
+	uint32_t eflags = irq_save();
+
+	node_t *node = wq->queue->head;
+	while (node && (uint32_t)woken < count) {
+		task_t *task = (task_t *)node->data;
+		node = node->next;
+		if (task->futex != key)
+			continue;
+
+		// Cleared here too, in case it's woken twice before it runs
+		task->futex = 0;
+		wake_task(task);
+		woken++;
+	}
+
+	irq_restore(eflags);
+
+	return woken;
+}
+
+int32_t futex(uint32_t *uaddr, int32_t op, uint32_t val,
+		const struct timespec *timeout) {
+	uintptr_t key = futex_key(uaddr);
+	if (!key)
+		return -EFAULT;
+
+	switch (op) {
+	case FUTEX_WAIT:
+		return futex_wait(uaddr, key, val, timeout);
+	case FUTEX_WAKE:
+		return futex_wake(key, val);
+	default:
+		return -ENOSYS;
+	}
+}
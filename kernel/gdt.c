@@ -26,7 +26,7 @@
 extern void gdt_flush(uint32_t);
 extern void tss_flush(void);
 
-gdt_entry_t gdt_entries[6];
+gdt_entry_t gdt_entries[GDT_NUM_ENTRIES];
 gdt_ptr_t gdt_ptr;
 tss_entry_t tss_entry;
 
@@ -72,7 +72,7 @@ static void write_tss(uint32_t num, uint16_t ss0, uint16_t esp0) {
 }
 
 void init_gdt(void) {
-	gdt_ptr.offset = (sizeof(gdt_entry_t) * 6) - 1;
+	gdt_ptr.offset = (sizeof(gdt_entry_t) * GDT_NUM_ENTRIES) - 1;
 	gdt_ptr.base = (uint32_t)&gdt_entries;
 
 	// Base flags
@@ -87,6 +87,7 @@ void init_gdt(void) {
 	gdt_set_gate(3, 0, 0xFFFFFFFF, cflags | GDT_DPL_RING3); // user
 	gdt_set_gate(4, 0, 0xFFFFFFFF, dflags | GDT_DPL_RING3);
 	write_tss(5, 0x10, 0x0);
+	set_tls_base(0);
 
 	gdt_flush((uint32_t)&gdt_ptr);
 	tss_flush();
@@ -95,3 +96,10 @@ void init_gdt(void) {
 void set_kernel_stack(uint32_t esp0) {
 	tss_entry.esp0 = esp0;
 }
+
+// Takes effect the next time gs is loaded
+void set_tls_base(uint32_t base) {
+	uint16_t flags = GDT_SEGMENT_GRANULAR | GDT_SEGMENT_PRESENT |
+		GDT_SEGMENT_DATA | GDT_DATA_32BIT | GDT_DATA_WRITE | GDT_DPL_RING3;
+	gdt_set_gate(GDT_TLS_ENTRY, base, 0xFFFFFFFF, flags);
+}
@@ -23,6 +23,7 @@
 #include <idt.h>
 #include <common.h>
 #include <printf.h>
+#include <task.h>
 
 // Flush IDT. Defined in descriptor_tables.s
 extern void idt_flush(uint32_t);
@@ -132,6 +133,9 @@ void isr_handler(registers_t *regs) {
 			regs->err_code);
 		halt();
 	}
+
+	check_resched(regs);
+	check_killed(regs);
 }
 
 void irq_ack(uint32_t int_no) {
@@ -146,4 +150,7 @@ void irq_handler(registers_t *regs) {
 		handler(regs);
 	else
 		irq_ack(regs->int_no);
+
+	check_resched(regs);
+	check_killed(regs);
 }
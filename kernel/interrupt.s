@@ -71,6 +71,7 @@ ISR_NOERRORCODE 128
 extern isr_handler
 
 ; Saves everything, goes kernel mode, calls fault handler, restores everything
+; gs is left alone: it holds the TLS selector, which the kernel never uses
 isr_common_stub:
 	pushad			; Push eax, ecx, edx, ebx, esp, ebp, esi, edi
 
@@ -81,17 +82,19 @@ isr_common_stub:
 	mov ds, ax
 	mov es, ax
 	mov fs, ax
-	mov gs, ax
 
 	push esp
 	call isr_handler
 	add esp, 4
 
+; Forked children start here, with esp pointing at their copy of the frame
+global isr_return
+isr_return:
+
 	pop eax			; reload segment descriptor
 	mov ds, ax
 	mov es, ax
 	mov fs, ax
-	mov gs, ax
 
 	popad			; Pop eax, ecx...
 	add esp, 8		; Gets rid of pushed error code and ISR number
@@ -135,7 +138,6 @@ irq_common_stub:
 	mov ds, ax
 	mov es, ax
 	mov fs, ax
-	mov gs, ax
 
 	push esp
 	call irq_handler
@@ -145,7 +147,6 @@ irq_common_stub:
 	mov ds, ax
 	mov es, ax
 	mov fs, ax
-	mov gs, ax
 
 	popad			; Pop eax, ecx...
 	add esp, 8		; Gets rid of pushed error code and ISR number
@@ -123,7 +123,9 @@ static unsigned long long l_inuse	 = 0;		///< Running total of used memory.
 static long long l_warningCount = 0;		///< Number of warnings encountered
 static long long l_errorCount = 0;			///< Number of actual errors
 static long long l_possibleOverruns = 0;	///< Number of possible overruns
-volatile spinlock_t kmalloc_lock = 0;
+// Interrupt handlers allocate too (wake_queue does), so interrupts stay off
+static DEFINE_SPINLOCK(kmalloc_lock);
+static uint32_t kmalloc_eflags;
 
 
 // ***********   HELPER FUNCTIONS  *******************************
@@ -178,7 +180,7 @@ static uintptr_t first_n_frames(uint32_t n) {
  * failure.
  */
 static int liballoc_lock() {
-	spin_lock(&kmalloc_lock);
+	kmalloc_eflags = spin_lock_irqsave(&kmalloc_lock);
 
 	return 0;
 }
@@ -190,7 +192,7 @@ static int liballoc_lock() {
  * \return 0 if the lock was successfully released.
  */
 static int liballoc_unlock(){
-	spin_unlock(&kmalloc_lock);
+	spin_unlock_irqrestore(&kmalloc_lock, kmalloc_eflags);
 
 	return 0;
 }
@@ -26,18 +26,29 @@
 #include <idt.h>
 #include <time.h>
 #include <timer.h>
+#include <clocksource.h>
+#include <fpu.h>
 #include <paging.h>
 #include <task.h>
 #include <syscall.h>
 #include <vfs.h>
 #include <block.h>
+#include <bcache.h>
 #include <char.h>
 #include <chardev/term.h>
+#include <chardev/schedstat.h>
+#include <chardev/lockstat.h>
+#include <chardev/iostat.h>
 #include <fs/dev.h>
 #include <pci.h>
 #include <pci_regs.h>
 #include <kmalloc.h>
+#include <workqueue.h>
+#include <futex.h>
+#include <rcu.h>
 #include <pci/ide.h>
+#include <blkdev/ramdisk.h>
+#include <blkdev/loop.h>
 #include <cpuid.h>
 
 #include <fileops.h>
@@ -78,19 +89,29 @@ void kmain(uint32_t magic, multiboot_info_t *mboot, uintptr_t ebp) {
 	printf("Initializing timers\n");
 	init_time();
 	init_timer();
+	init_clocksource();
+
+	printf("Initializing FPU\n");
+	init_fpu();
 
 	printf("Starting task scheduling\n");
 	init_tasking(ebp);
 	init_syscalls();
+	init_futex();
+	init_rcu();
+	init_workqueues();
 
 	printf("Initializing vfs\n");
 	init_vfs();
 
-	printf("Initializing driver subsystem\n");
 	init_blockdev();
+	init_bcache();
 
 	init_chardev();
 	init_term();
+	init_schedstat();
+	init_lockstat();
+	init_iostat();
 
 	printf("Enumerating PCI bus(ses)\n");
 	init_pci();
@@ -100,6 +121,8 @@ void kmain(uint32_t magic, multiboot_info_t *mboot, uintptr_t ebp) {
 	ASSERT(mount(NULL, "/dev", "devfs", 0) == 0);
 
 	init_ide();
+	init_ramdisk();
+	init_loop();
 
 	halt();
 }
\ No newline at end of file
@@ -47,7 +47,8 @@ page_directory_t *current_dir = NULL;
 #define INDEX_FROM_BIT(a) (a >> 5)
 #define OFFSET_FROM_BIT(a) (a & 0x1F)
 
-volatile spinlock_t frame_lock = 0;
+// Taken by kmalloc, which interrupt handlers use
+DEFINE_SPINLOCK(frame_lock);
 
 static void set_frame(uint32_t addr) {
 	uint32_t frame = addr / PAGE_SIZE;
@@ -86,7 +87,7 @@ void alloc_frame(page_t *page, int kernel, int rw) {
 	if (page->frame != 0) // Already allocated
 		return;
 
-	spin_lock(&frame_lock);
+	uint32_t eflags = spin_lock_irqsave(&frame_lock);
 	uint32_t i;
 	if ((i = first_frame()) == 0xFFFFFFFF)
 		PANIC("No free frames.");
@@ -96,12 +97,12 @@ void alloc_frame(page_t *page, int kernel, int rw) {
 	page->user = (kernel ? 0 : 1);
 	page->global = 0;
 	page->frame = i;
-	spin_unlock(&frame_lock);
+	spin_unlock_irqrestore(&frame_lock, eflags);
 }
 
 // Directly map a page
 void dm_frame(page_t *page, int kernel, int rw, uintptr_t addr) {
-	spin_lock(&frame_lock);
+	uint32_t eflags = spin_lock_irqsave(&frame_lock);
 	if ((addr / PAGE_SIZE) < nframes)
 		set_frame(addr);
 	page->present = 1;
@@ -109,19 +110,19 @@ void dm_frame(page_t *page, int kernel, int rw, uintptr_t addr) {
 	page->user = kernel ? 0 : 1;
 	page->global = 0;
 	page->frame = addr / PAGE_SIZE;
-	spin_unlock(&frame_lock);
+	spin_unlock_irqrestore(&frame_lock, eflags);
 }
 
 // Directly unmap page
 void du_frame(page_t *page, int free) {
 	if (!page)
 		return;
-	spin_lock(&frame_lock);
+	uint32_t eflags = spin_lock_irqsave(&frame_lock);
 	if ((page->frame) < nframes && free) {
 		clear_frame(page->frame << 12);
 	}
 	page->present = 0;
-	spin_unlock(&frame_lock);
+	spin_unlock_irqrestore(&frame_lock, eflags);
 }
 
 uintptr_t kernel_map(uintptr_t addr) {
@@ -143,6 +144,7 @@ void kernel_unmap(uintptr_t addr) {
 	ASSERT(addr >= FREE_MAP_BASE && addr < FREE_MAP_BASE + FREE_MAP_MAX);
 
 	du_frame(get_page(addr, 0, current_dir), 0);
+	asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
 }
 
 void free_frame(page_t *page) {
@@ -226,6 +228,12 @@ void init_paging(uint32_t memlength, uintptr_t mmap_addr,
 	for (i = KHEAP_START; i < KHEAP_MAX; i += PAGE_SIZE)
 		get_page(i, 1, kernel_dir);
 
+	/* Same for the temporary mapping window. Kernel tasks map through
+	 * whichever directory they've borrowed, so it has to be shared
+	 */
+	for (i = FREE_MAP_BASE; i < FREE_MAP_BASE + FREE_MAP_MAX; i += PAGE_SIZE)
+		get_page(i, 1, kernel_dir);
+
 	// Identity page lowest MB. We shouldn't write to it
 	for (i = 0; i < 0x100000; i += PAGE_SIZE)
 		dm_frame(get_page(i, 1, kernel_dir), 1, 1, i);
@@ -267,22 +267,12 @@ static void driver_search(struct pci_driver *driver) {
 	}
 }
 
-spinlock_t pci_lock = 0;
+DEFINE_SPINLOCK(pci_lock);
 
 int32_t register_pci(const char *name, const struct pci_dev_id *table,
 		int (*probe)(struct pci_dev*, const struct pci_dev_id*)) {
 	ASSERT(name && table && probe);
 
-	node_t *node;
-	foreach(node, drivers) {
-		struct pci_driver *driver = (struct pci_driver *)node->data;
-		if (strcmp(driver->name, name) == 0)
-			break;
-	}
-
-	if (node)
-		return -EEXIST;
-
 	struct pci_driver *driver =
 		(struct pci_driver *)kmalloc(sizeof(struct pci_driver));
 	if (!driver)
@@ -292,7 +282,18 @@ int32_t register_pci(const char *name, const struct pci_dev_id *table,
 	driver->table = table;
 	driver->probe = probe;
 
+	// The list can be walked locklessly, but registrations have to agree
 	spin_lock(&pci_lock);
+	node_t *node;
+	foreach(node, drivers) {
+		struct pci_driver *iter = (struct pci_driver *)node->data;
+		if (strcmp(iter->name, name) == 0) {
+			spin_unlock(&pci_lock);
+			kfree(driver);
+			return -EEXIST;
+		}
+	}
+
 	node = list_insert(drivers, driver);
 	if (!node) {
 		spin_unlock(&pci_lock);
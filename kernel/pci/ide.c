@@ -31,6 +31,7 @@
 #include <errno.h>
 #include <block.h>
 #include <paging.h>
+#include <workqueue.h>
 
 extern volatile uint32_t tick;
 uint8_t ide_irq_invoked = 0;
@@ -50,6 +51,7 @@ struct pci_dev_id ide_ids[] = {
 };
 
 waitqueue_t *ide_wq = NULL;
+static workqueue_t *ide_workqueue = NULL;
 
 static void wake_ide() {
 	wake_queue(ide_wq);
@@ -155,6 +157,7 @@ static blkdev_t *ide_blkdev_create(struct IDEDevice *ide) {
 	dev->sector_size = IDE_SECTOR_SIZE;
 	dev->size = ide->size;
 	dev->handler = request_ide;
+	dev->max_sectors = IDE_MAX_TRANSFER_28;
 	dev->private_data = ide;
 
 	return dev;
@@ -166,7 +169,7 @@ static void waste400(struct IDEChannelRegisters *channel) {
 		ide_read(channel, ATA_REG_ALTSTATUS);
 }
 
-static void ide_tasklet(void *argp);
+static void ide_work(struct work *work);
 
 static int ide_probe(struct pci_dev *pci, const struct pci_dev_id *id) {
 	if (claim_pci_dev(pci) < 0)
@@ -354,12 +357,8 @@ static int ide_probe(struct pci_dev *pci, const struct pci_dev_id *id) {
 				break;
 			}
 
-			dev->servicer = create_tasklet(ide_tasklet, "[ide]",
-				blkdevs[2 * i + j]);
-			if (!dev->servicer) {
-				refs--;
-				break;
-			}
+			init_work(&dev->servicer, ide_work);
+			dev->blkdev = blkdevs[2 * i + j];
 		}
 		if (refs == 0) {
 			destroy_mutex(channel->mutex);
@@ -379,7 +378,7 @@ static int ide_probe(struct pci_dev *pci, const struct pci_dev_id *id) {
 					ide->channel->channel, ide->drive);
 				struct part *part = (struct part *)kmalloc(sizeof(struct part));
 				if (!part) {
-					destroy_tasklet(ide->servicer);
+					cancel_work_sync(&ide->servicer);
 					kfree(ide);
 					free_blkdev(blkdevs[i]);
 					continue;
@@ -391,7 +390,7 @@ static int ide_probe(struct pci_dev *pci, const struct pci_dev_id *id) {
 				node_t *node = list_insert(blkdevs[i]->partitions, part);
 				if (!node) {
 					kfree(part);
-					destroy_tasklet(ide->servicer);
+					cancel_work_sync(&ide->servicer);
 					kfree(ide);
 					free_blkdev(blkdevs[i]);
 					continue;
@@ -403,7 +402,7 @@ static int ide_probe(struct pci_dev *pci, const struct pci_dev_id *id) {
 					destroy_mutex(ide->channel->mutex);
 					kfree(ide->channel);
 				}
-				destroy_tasklet(ide->servicer);
+				cancel_work_sync(&ide->servicer);
 				kfree(ide);
 				free_blkdev(blkdevs[i]);
 				continue;
@@ -421,7 +420,7 @@ fail:
 				destroy_mutex(ide->channel->mutex);
 				kfree(ide->channel);
 			}
-			destroy_tasklet(ide->servicer);
+			cancel_work_sync(&ide->servicer);
 			kfree(ide);
 			free_blkdev(blkdevs[i]);
 		}
@@ -439,6 +438,19 @@ void init_ide(void) {
 		return;
 	}
 
+	/* Each drive has its own work item, and there are two workers. Drives on
+	 * different channels can be serviced at once. Drives sharing a channel
+	 * take turns on its mutex, and may hold both workers while doing it
+	 */
+	ide_workqueue = create_workqueue("[ide]", 2);
+	if (!ide_workqueue) {
+		printf("IDE: error creating workqueue");
+		return;
+	}
+
+	if (set_workqueue_scheduler(ide_workqueue, SCHED_FIFO, IDE_RT_PRIO) < 0)
+		printf("IDE: error making servicers real-time\n");
+
 	while ((ret = register_blkdev(IDE_MAJOR, "IDE", ide_fops)) == -ENOMEM)
 		continue;
 
@@ -457,36 +469,30 @@ void init_ide(void) {
 static int32_t request_ide(blkdev_t *dev) {
 	struct IDEDevice *ide = (struct IDEDevice *)dev->private_data;
 
-	reset_and_reschedule(ide->servicer);
+	// Requesters above the servicers' own priority lend it theirs
+	queue_work_inherit(ide_workqueue, &ide->servicer);
 
 	return 0;
 }
 
 static int32_t ide_ata_access(struct IDEDevice *dev, request_t *req);
 
-static void ide_tasklet(void *argp) {
-	blkdev_t *dev = (blkdev_t *)argp;
-	struct IDEDevice *ide = (struct IDEDevice *)dev->private_data;
+static void ide_work(struct work *work) {
+	struct IDEDevice *ide = container_of(work, struct IDEDevice, servicer);
+	blkdev_t *dev = ide->blkdev;
 	acquire_mutex(ide->channel->mutex);
 
 	while (1) {
-		node_t *node = next_ready_request_blkdev(dev);
-		if (!node)
+		request_t *req = next_ready_request_blkdev(dev);
+		if (!req)
 			break;
 
-		request_t *req = (request_t *)node->data;
 		int32_t sectors_xferred = ide_ata_access(ide, req);
-		int32_t cont;
 
 		if (sectors_xferred < 0)
-			cont = end_request(req, 0, 0);
+			end_request(req, sectors_xferred, 0);
 		else
-			cont = end_request(req, 1, (uint32_t)sectors_xferred);
-
-		if (cont == 0) {
-			list_dequeue(dev->queue, node);
-			kfree(node);
-		}
+			end_request(req, 0, (uint32_t)sectors_xferred);
 	}
 
 	release_mutex(ide->channel->mutex);
@@ -501,18 +507,12 @@ static int statusgood(uint8_t status) {
 	return 1;
 }
 
-static int32_t wait_irq(struct IDEDevice *dev, uint32_t timeout) {
-	struct timer *timer = (struct timer *)kmalloc(sizeof(struct timer));
-	if (!timer)
-		return -ENOMEM;
-
-	timer->expires = tick + timeout * HZ;
-	timer->callback = wake_ide;
-	if (add_timer(timer) < 0) {
-		kfree(timer);
-		return -ENOMEM;
-	}
+static void ide_timeout(struct timer *timer) {
+	wake_ide();
+}
 
+static int32_t wait_irq(struct IDEDevice *dev, uint32_t timeout) {
+	struct timer timer = TIMER_INITIALIZER(ide_timeout);
 	int32_t ret = 0;
 
 	uint32_t status;
@@ -522,7 +522,7 @@ static int32_t wait_irq(struct IDEDevice *dev, uint32_t timeout) {
 		if (!(status & ATA_SR_BSY))
 			break;
 
-		timer->expires = tick + timeout * HZ;
+		mod_timer(&timer, tick + timeout * HZ);
 		interrupted = sleep_thread(ide_wq, SLEEP_INTERRUPTABLE);
 	} while (interrupted == 0);
 
@@ -533,8 +533,7 @@ static int32_t wait_irq(struct IDEDevice *dev, uint32_t timeout) {
 		ret = -EIO;
 	}
 
-	del_timer(timer);
-	kfree(timer);
+	del_timer(&timer);
 
 	return ret;
 }
@@ -681,58 +680,66 @@ static int32_t ide_ata_access(struct IDEDevice *dev, request_t *req) {
 			nsects += bio->nbytes / KERNEL_BLOCKSIZE;
 		} */
 	} else {
-		bio_t *bio = (bio_t *)req->bios->head->data;
+		// Merged requests go out as one command, as far as it can take them
+		uint32_t max = lba_ext ? IDE_MAX_TRANSFER_48 : IDE_MAX_TRANSFER_28;
+		void *maps[IDE_MAX_SEGMENTS];
+		uint32_t nmaps = 0;
+		uint32_t nsects = 0;
+
+		node_t *node;
+		foreach(node, req->bios) {
+			if (nmaps == IDE_MAX_SEGMENTS || nsects == max)
+				break;
 
-		uint32_t nsects = bio->nsectors;
+			bio_t *bio = (bio_t *)node->data;
+			maps[nmaps] = (void *)kernel_map(bio->page);
+			if (!maps[nmaps])
+				break;
+			nmaps++;
 
-		if (lba_ext) {
-			if (nsects > IDE_MAX_TRANSFER_48)
-				nsects = IDE_MAX_TRANSFER_48;
-			ide_write(dev->channel, ATA_REG_SECCOUNT1, (nsects >> 8) & 0xFF);
-		} else {
-			if (nsects > IDE_MAX_TRANSFER_28)
-				nsects = IDE_MAX_TRANSFER_28;
+			nsects += bio->nsectors;
+			if (nsects > max)
+				nsects = max;
 		}
 
-		ide_write(dev->channel, ATA_REG_SECCOUNT0, nsects & 0xFF);
-
-		void *edi = (void *)kernel_map(bio->page);
-		if (!edi)
+		if (nmaps == 0)
 			return 0;
 
-		uintptr_t offset = 0;
+		if (lba_ext)
+			ide_write(dev->channel, ATA_REG_SECCOUNT1, (nsects >> 8) & 0xFF);
+		ide_write(dev->channel, ATA_REG_SECCOUNT0, nsects & 0xFF);
 
 		ide_write(dev->channel, ATA_REG_COMMAND, cmd);	// Send command
 
-		if (direction == ATA_READ) { // PIO read
-			uint32_t i;
-			for (i = 0; i < nsects; i++) {
-				int32_t error = wait_irq(dev, IDE_TIMEOUT);
-				if (error < 0) {
-					kernel_unmap((uintptr_t)edi);
-					return error;
-				}
+		int32_t ret = (int32_t)nsects;
+		uint32_t done = 0;
+		uint32_t i;
+		node = req->bios->head;
+		for (i = 0; i < nmaps && done < nsects; i++, node = node->next) {
+			bio_t *bio = (bio_t *)node->data;
+			void *edi = maps[i] + bio->offset;
 
-				insw(bus, edi + bio->offset + offset, IDE_SECTOR_SIZE / 2);
-				offset += IDE_SECTOR_SIZE;
-			}
-		} else { // PIO write
-			uint32_t i;
-			for (i = 0; i < nsects; i++) {
+			uint32_t j;
+			for (j = 0; j < bio->nsectors && done < nsects; j++, done++) {
 				int32_t error = wait_irq(dev, IDE_TIMEOUT);
 				if (error < 0) {
-					kernel_unmap((uintptr_t)edi);
-					return error;
+					ret = error;
+					goto out;
 				}
 
-				outsw(bus, edi + bio->offset + offset, IDE_SECTOR_SIZE / 2);
-				offset += IDE_SECTOR_SIZE;
+				if (direction == ATA_READ)	// PIO read
+					insw(bus, edi, IDE_SECTOR_SIZE / 2);
+				else						// PIO write
+					outsw(bus, edi, IDE_SECTOR_SIZE / 2);
+				edi += IDE_SECTOR_SIZE;
 			}
 		}
 
-		kernel_unmap((uintptr_t)edi);
+out:
+		for (i = 0; i < nmaps; i++)
+			kernel_unmap((uintptr_t)maps[i]);
 
-		return (int32_t)nsects;
+		return ret;
 	}
 
 	return 0;
@@ -71,7 +71,36 @@ copy_page_physical:
 	pop ebx
 	ret
 
-global read_eip
-read_eip:
-	pop eax
-	jmp eax
+; void switch_context(uintptr_t *old_esp, uintptr_t new_esp, uintptr_t new_cr3)
+; Saves the callee-saved registers, flags and gs on the current stack, stores
+; the stack pointer in *old_esp and resumes whatever was saved on the new stack.
+; New tasks get a hand-built frame (see push_switch_frame in task.c)
+global switch_context
+switch_context:
+	mov eax, [esp + 4]	; Where to save the old stack pointer
+	mov edx, [esp + 8]	; New stack pointer
+	mov ecx, [esp + 12]	; New page directory
+
+	push ebp
+	push ebx
+	push esi
+	push edi
+	pushf
+	push gs
+
+	mov [eax], esp
+	mov esp, edx
+
+	mov eax, cr3		; Don't flush the TLB if we don't have to
+	cmp eax, ecx
+	je .same_dir
+	mov cr3, ecx
+.same_dir:
+
+	pop gs				; Also picks up the new thread's TLS descriptor
+	popf
+	pop edi
+	pop esi
+	pop ebx
+	pop ebp
+	ret
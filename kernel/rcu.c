@@ -0,0 +1,127 @@
+/* rcu.c - Read-copy-update. Writers publish new versions and put off
+ * freeing the old ones until every reader that could have seen them is gone
+ */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <common.h>
+#include <rcu.h>
+#include <task.h>
+#include <kmalloc.h>
+
+// Defined in task.c
+extern volatile task_t *current_task;
+
+// Completed grace periods
+static volatile uint32_t rcu_gp = 0;
+
+// Callbacks waiting on a grace period, oldest first
+static struct rcu_head *rcu_pending = NULL;
+static struct rcu_head **rcu_tail = &rcu_pending;
+
+static waitqueue_t *rcu_wq = NULL;
+
+struct rcu_kfree {
+	struct rcu_head head;
+	void *ptr;
+};
+
+void init_rcu(void) {
+	rcu_wq = create_waitqueue();
+	ASSERT(rcu_wq);
+}
+
+// Interrupt handlers can read too. They count against whoever they interrupted
+void rcu_read_lock(void) {
+	if (current_task)
+		current_task->rcu_nesting++;
+	__asm__ volatile ("" ::: "memory");
+}
+
+void rcu_read_unlock(void) {
+	__asm__ volatile ("" ::: "memory");
+	if (current_task) {
+		ASSERT(current_task->rcu_nesting);
+		current_task->rcu_nesting--;
+	}
+}
+
+// func is run from the timer interrupt, so it mustn't sleep
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *)) {
+	head->func = func;
+	head->next = NULL;
+
+	uint32_t eflags = irq_save();
+	head->gp = rcu_gp + 1;
+	*rcu_tail = head;
+	rcu_tail = &head->next;
+	irq_restore(eflags);
+}
+
+static void rcu_kfree_callback(struct rcu_head *head) {
+	struct rcu_kfree *defer = container_of(head, struct rcu_kfree, head);
+	kfree(defer->ptr);
+	kfree(defer);
+}
+
+// Free something readers may still be looking at. May sleep if memory is short
+void kfree_rcu(void *ptr) {
+	struct rcu_kfree *defer = (struct rcu_kfree *)kmalloc(sizeof(struct rcu_kfree));
+	if (!defer) {
+		synchronize_rcu();
+		kfree(ptr);
+		return;
+	}
+
+	defer->ptr = ptr;
+	call_rcu(&defer->head, rcu_kfree_callback);
+}
+
+// Wait out a full grace period
+void synchronize_rcu(void) {
+	ASSERT(!current_task->rcu_nesting);
+
+	uint32_t eflags = irq_save();
+	uint32_t target = rcu_gp + 1;
+	while ((int32_t)(rcu_gp - target) < 0)
+		sleep_thread(rcu_wq, 0);
+	irq_restore(eflags);
+}
+
+// A task that's been switched out has left any read section. Interrupts off
+void rcu_note_switch(void) {
+	rcu_gp++;
+}
+
+// Called from the timer interrupt
+void rcu_tick(void) {
+	if (!current_task || !current_task->rcu_nesting)
+		rcu_gp++;
+
+	while (rcu_pending && (int32_t)(rcu_gp - rcu_pending->gp) >= 0) {
+		struct rcu_head *head = rcu_pending;
+		rcu_pending = head->next;
+		if (!rcu_pending)
+			rcu_tail = &rcu_pending;
+		head->func(head);
+	}
+
+	if (rcu_wq && rcu_wq->queue->head)
+		wake_queue_all(rcu_wq);
+}
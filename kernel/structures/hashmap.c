@@ -108,6 +108,8 @@ int hashmap_insert(hashmap_t *hashmap, const char *key, void *value) {
 		entry->value = value;
 		entry->next = NULL;
 
+		// Lookups may be running without a lock. Fill the entry in first
+		__sync_synchronize();
 		hashmap->array[i] = entry;
 	} else {
 		kv_t *x = hashmap->array[i];
@@ -130,6 +132,7 @@ int hashmap_insert(hashmap_t *hashmap, const char *key, void *value) {
 		entry->key = key_cpy;
 		entry->value = value;
 		entry->next = NULL;
+		__sync_synchronize();
 		p->next = entry;
 	}
 
@@ -22,6 +22,11 @@
 #include <structures/list.h>
 #include <kmalloc.h>
 
+/* New nodes are filled in before they're linked in, so lockless readers
+ * walking forward (see rcu.h) only ever see complete ones
+ */
+#define publish()	__sync_synchronize()
+
 list_t *list_create(void) {
 	list_t *list = (list_t *)kmalloc(sizeof(list_t));
 	if (!list)
@@ -65,13 +70,15 @@ node_t *list_insert(list_t *list, void *data) {
 
 	if (!list->head) {
 		node->prev = NULL;
+		publish();
 		list->head = node;
 		list->tail = node;
 		return node;
 	}
 
-	list->tail->next = node;
 	node->prev = list->tail;
+	publish();
+	list->tail->next = node;
 	list->tail = node;
 	return node;
 }
@@ -89,6 +96,7 @@ node_t *list_push(list_t *list, void *data) {
 	node->prev = NULL;
 
 	node->next = list->head;
+	publish();
 	list->head = node;
 
 	if (!list->tail) {
@@ -115,9 +123,12 @@ node_t *list_insert_after(list_t *list, node_t *node, void *data) {
 
 	newnode->next = node->next;
 	newnode->prev = node;
+	publish();
 	node->next = newnode;
 
-	if (!newnode->next)
+	if (newnode->next)
+		newnode->next->prev = newnode;
+	else
 		list->tail = newnode;
 
 	return newnode;
@@ -138,9 +149,12 @@ node_t *list_insert_before(list_t *list, node_t *node, void *data) {
 
 	newnode->next = node;
 	newnode->prev = node->prev;
+	publish();
 	node->prev = newnode;
 
-	if (!newnode->prev)
+	if (newnode->prev)
+		newnode->prev->next = newnode;
+	else
 		list->head = newnode;
 
 	return newnode;
@@ -177,6 +191,30 @@ node_t *list_dequeue(list_t *list, node_t *node) {
 	return node;
 }
 
+/* Unlink a node that lockless readers may be standing on. Its own next
+ * pointer is left alone so they can carry on past it. Free it with
+ * kfree_rcu
+ */
+node_t *list_dequeue_rcu(list_t *list, node_t *node) {
+	if (!list || !node)
+		return NULL;
+
+	ASSERT(node->owner == list);
+
+	if (list->head == node)
+		list->head = node->next;
+	if (list->tail == node)
+		list->tail = node->prev;
+	if (node->prev)
+		node->prev->next = node->next;
+	if (node->next)
+		node->next->prev = node->prev;
+
+	node->owner = NULL;
+
+	return node;
+}
+
 node_t *list_find(list_t *list, void *key) {
 	if (!list || !key)
 		return NULL;
@@ -220,6 +258,7 @@ void list_merge(list_t *dest, list_t *src) {
 		dest->head = src->head;
 		dest->tail = src->tail;
 	} else {
+		dest->tail->next = src->head;
 		src->head->prev = dest->tail;
 		dest->tail = src->tail;
 	}
@@ -22,12 +22,20 @@
 #include <structures/mutex.h>
 #include <kmalloc.h>
 
+// Defined in task.c
+extern volatile task_t *current_task;
+
+// Far longer than any real chain. Stops us going round a deadlock forever
+#define PI_MAX_DEPTH	16
+
 mutex_t *create_mutex(uint32_t locked) {
 	mutex_t *mutex = (mutex_t *)kmalloc(sizeof(mutex_t));
 	if (!mutex)
 		return NULL;
 
-	mutex->mutex = locked ? 1 : 0;
+	mutex->owner = locked ? (task_t *)current_task : NULL;
+	mutex->prio = 0;
+	mutex->pi_next = NULL;
 	mutex->wq = create_waitqueue();
 	if (!mutex->wq) {
 		kfree(mutex);
@@ -42,15 +50,138 @@ void destroy_mutex(mutex_t *mutex) {
 	kfree(mutex);
 }
 
+// Highest priority waiter, first come first served among equals
+static node_t *top_waiter(volatile mutex_t *mutex) {
+	node_t *node, *top = NULL;
+	foreach(node, mutex->wq->queue) {
+		if (!top || ((task_t *)node->data)->prio > ((task_t *)top->data)->prio)
+			top = node;
+	}
+	return top;
+}
+
+static uint32_t top_waiter_prio(volatile mutex_t *mutex) {
+	node_t *node = top_waiter(mutex);
+	return node ? ((task_t *)node->data)->prio : 0;
+}
+
+static void pi_link(volatile mutex_t *mutex, task_t *owner) {
+	mutex->pi_next = owner->pi_mutexes;
+	owner->pi_mutexes = (mutex_t *)mutex;
+}
+
+static void pi_unlink(volatile mutex_t *mutex, task_t *owner) {
+	mutex_t **iter;
+	for (iter = &owner->pi_mutexes; *iter; iter = &(*iter)->pi_next) {
+		if (*iter == mutex) {
+			*iter = mutex->pi_next;
+			break;
+		}
+	}
+	mutex->pi_next = NULL;
+}
+
+/* Recompute the boost of a task from the mutexes it holds, and follow the
+ * chain of owners along for as long as it keeps changing something.
+ * Interrupts must be off
+ */
+static void pi_adjust(task_t *task) {
+	uint32_t depth;
+	for (depth = 0; task && depth < PI_MAX_DEPTH; depth++) {
+		uint32_t prio = 0;
+		mutex_t *held;
+		for (held = task->pi_mutexes; held; held = held->pi_next) {
+			if (held->prio > prio)
+				prio = held->prio;
+		}
+
+		if (prio == task->pi_prio)
+			return;
+		sched_pi_set(task, prio);
+
+		mutex_t *mutex = task->blocked_on;
+		if (!mutex)
+			return;
+		mutex->prio = top_waiter_prio(mutex);
+		task = mutex->owner;
+	}
+}
+
+// A waiting task's priority moved. Interrupts must be off
+void mutex_prio_changed(task_t *task) {
+	mutex_t *mutex = task->blocked_on;
+	if (!mutex)
+		return;
+
+	mutex->prio = top_waiter_prio(mutex);
+	pi_adjust(mutex->owner);
+}
+
+// Returns 1 if we got it, 0 if somebody else has it
+int try_acquire_mutex(volatile mutex_t *mutex) {
+	return __sync_bool_compare_and_swap(&mutex->owner, NULL, current_task);
+}
+
+/* There's only the one cpu, so an owner we're waiting on is never running
+ * and spinning for it would be wasted. Sleep straight away instead, lending
+ * it our priority so it gets out of the way quickly
+ */
 void acquire_mutex(volatile mutex_t *mutex) {
-	wait_event_interruptable(mutex->wq,
-		__sync_lock_test_and_set(&mutex->mutex, 1) != 1);
+	if (try_acquire_mutex(mutex))
+		return;
 
+	uint32_t eflags = irq_save();
+	task_t *self = (task_t *)current_task;
+
+	ASSERT(mutex->owner != self);
+
+	// Released between the two checks?
+	if (!mutex->owner)
+		mutex->owner = self;
+
+	// The releaser makes us the owner before waking us
+	while (mutex->owner != self) {
+		if (!mutex->wq->queue->head)
+			pi_link(mutex, mutex->owner);
+		self->blocked_on = (mutex_t *)mutex;
+		if (self->prio > mutex->prio) {
+			mutex->prio = self->prio;
+			pi_adjust(mutex->owner);
+		}
+		sleep_thread(mutex->wq, SLEEP_EXCLUSIVE);
+	}
+
+	irq_restore(eflags);
 }
 
 void release_mutex(volatile mutex_t *mutex) {
-	__sync_lock_release(&mutex->mutex);
-	wake_queue(mutex->wq);
+	uint32_t eflags = irq_save();
+	task_t *self = (task_t *)current_task;
+
+	ASSERT(mutex->owner == self);
+
+	node_t *node = top_waiter(mutex);
+	if (node) {
+		task_t *next = (task_t *)node->data;
+		pi_unlink(mutex, self);
+
+		mutex->owner = next;
+		next->blocked_on = NULL;
+		wake_task(next);
+
+		// The rest of the waiters now lean on the new owner
+		mutex->prio = top_waiter_prio(mutex);
+		if (mutex->wq->queue->head) {
+			pi_link(mutex, next);
+			pi_adjust(next);
+		}
+
+		// And stop leaning on us
+		pi_adjust(self);
+	} else
+		mutex->owner = NULL;
+
+	irq_restore(eflags);
 }
 
 sem_t *create_semaphore(uint32_t max) {
@@ -89,18 +220,25 @@ void release_semaphore(volatile sem_t *sem) {
 	wake_queue(sem->wq);
 }
 
-rw_sem_t *create_rw_semaphore(uint32_t max) {
+rw_sem_t *create_rw_semaphore(void) {
 	rw_sem_t *sem = (rw_sem_t *)kmalloc(sizeof(rw_sem_t));
+	if (!sem)
+		return NULL;
 
-	sem->write = create_mutex(0);
-	if (!sem->write) {
+	sem->state = 0;
+	sem->writer = NULL;
+	sem->read_waiting = 0;
+	sem->read_batch = 0;
+
+	sem->rq = create_waitqueue();
+	if (!sem->rq) {
 		kfree(sem);
 		return NULL;
 	}
 
-	sem->semaphore = create_semaphore(max);
-	if (!sem->semaphore) {
-		destroy_mutex(sem->write);
+	sem->wq = create_waitqueue();
+	if (!sem->wq) {
+		destroy_waitqueue(sem->rq);
 		kfree(sem);
 		return NULL;
 	}
@@ -109,29 +247,108 @@ rw_sem_t *create_rw_semaphore(uint32_t max) {
 }
 
 void destroy_rw_semaphore(rw_sem_t *sem) {
-	destroy_mutex(sem->write);
-	destroy_semaphore(sem->semaphore);
+	ASSERT(sem->state == 0);
+	destroy_waitqueue(sem->rq);
+	destroy_waitqueue(sem->wq);
 	kfree(sem);
 }
 
-void acquire_semaphore_read(volatile rw_sem_t *sem) {
-	acquire_semaphore(sem->semaphore);
+/* Hands a free lock to whoever's next. Called with interrupts off.
+ * Readers that queued up while a writer held the lock go first, all
+ * together, so a steady stream of writers can't starve them; otherwise
+ * the writer at the head of the queue gets it
+ */
+static void rwsem_wake(volatile rw_sem_t *sem, int after_write) {
+	node_t *node = sem->wq->queue->head;
+
+	if (sem->read_waiting && (after_write || !node)) {
+		uint32_t waiters = node ? RWSEM_WAITERS : 0;
+		sem->state = sem->read_waiting | waiters;
+		sem->read_waiting = 0;
+		sem->read_batch++;
+		wake_queue_all(sem->rq);
+	} else if (node) {
+		task_t *next = (task_t *)node->data;
+		uint32_t waiters = (node->next || sem->read_waiting) ?
+			RWSEM_WAITERS : 0;
+		sem->writer = next;
+		sem->state = RWSEM_WRITER | waiters;
+		wake_task(next);
+	} else
+		sem->state = 0;
 }
 
-void release_semaphore_read(volatile rw_sem_t *sem) {
-	release_semaphore(sem->semaphore);
+void acquire_semaphore_read(volatile rw_sem_t *sem) {
+	uint32_t old = sem->state;
+	if (!(old & (RWSEM_WRITER | RWSEM_WAITERS)) &&
+			__sync_bool_compare_and_swap(&sem->state, old, old + 1))
+		return;
+
+	uint32_t eflags = irq_save();
+
+	ASSERT(sem->writer != current_task);
+
+	old = sem->state;
+	if (!(old & (RWSEM_WRITER | RWSEM_WAITERS))) {
+		__sync_add_and_fetch(&sem->state, 1);
+		irq_restore(eflags);
+		return;
+	}
+
+	// The releaser counts us in before waking us
+	uint32_t batch = sem->read_batch;
+	sem->read_waiting++;
+	__sync_or_and_fetch(&sem->state, RWSEM_WAITERS);
+	while (sem->read_batch == batch)
+		sleep_thread(sem->rq, 0);
+
+	irq_restore(eflags);
 }
 
 void acquire_semaphore_write(volatile rw_sem_t *sem) {
-	acquire_mutex(sem->write);
-		uint32_t i;
-		for (i = 0; i < sem->semaphore->max; i++)
-			acquire_semaphore(sem->semaphore);
+	if (__sync_bool_compare_and_swap(&sem->state, 0, RWSEM_WRITER)) {
+		sem->writer = (task_t *)current_task;
+		return;
+	}
+
+	uint32_t eflags = irq_save();
+
+	ASSERT(sem->writer != current_task);
+
+	if (__sync_bool_compare_and_swap(&sem->state, 0, RWSEM_WRITER))
+		sem->writer = (task_t *)current_task;
+	else
+		__sync_or_and_fetch(&sem->state, RWSEM_WAITERS);
+
+	// As with mutexes, the releaser makes us the owner before waking us
+	while (sem->writer != current_task)
+		sleep_thread(sem->wq, SLEEP_EXCLUSIVE);
 
-	release_mutex(sem->write);
+	irq_restore(eflags);
+}
+
+void release_semaphore_read(volatile rw_sem_t *sem) {
+	ASSERT(sem->state & RWSEM_READERS);
+
+	uint32_t state = __sync_sub_and_fetch(&sem->state, 1);
+	if (state != RWSEM_WAITERS)
+		return;
+
+	// Last reader out with somebody queued
+	uint32_t eflags = irq_save();
+	if (sem->state == RWSEM_WAITERS)
+		rwsem_wake(sem, 0);
+	irq_restore(eflags);
 }
 
 void release_semaphore_write(volatile rw_sem_t *sem) {
-	sem->semaphore->semaphore -= sem->semaphore->max;
-	wake_queue(sem->semaphore->wq);
-}
\ No newline at end of file
+	ASSERT(sem->writer == current_task);
+
+	sem->writer = NULL;
+	if (__sync_bool_compare_and_swap(&sem->state, RWSEM_WRITER, 0))
+		return;
+
+	uint32_t eflags = irq_save();
+	rwsem_wake(sem, 1);
+	irq_restore(eflags);
+}
@@ -151,5 +151,10 @@ void tree_inherit_children(tree_t *tree, tree_node_t *newparent,
 		return;
 
 	ASSERT(newparent->owner == tree);
+
+	node_t *node;
+	foreach(node, oldparent->children)
+		((tree_node_t *)node->data)->parent = newparent;
+
 	list_merge(newparent->children, oldparent->children);
 }
\ No newline at end of file
@@ -25,6 +25,11 @@
 #include <fileops.h>
 #include <vfs.h>
 #include <elf.h>
+#include <clocksource.h>
+#include <futex.h>
+
+// Defined in task.c
+extern volatile task_t *current_task;
 
 DEFN_SYSCALL0(fork, 0);
 DEFN_SYSCALL1(exit, 1, int32_t);
@@ -59,6 +64,24 @@ DEFN_SYSCALL2(umount, 28, const char*, uint32_t);
 DEFN_SYSCALL1(sbrk, 29, uintptr_t);
 DEFN_SYSCALL3(execve, 30, const char*, char *const*, char *const*);
 DEFN_SYSCALL1(chdir, 31, const char*);
+DEFN_SYSCALL2(clock_gettime, 32, clockid_t, struct timespec*);
+DEFN_SYSCALL3(clone, 33, uint32_t, uintptr_t, uintptr_t);
+DEFN_SYSCALL0(gettid, 34);
+DEFN_SYSCALL1(exit_thread, 35, int32_t);
+DEFN_SYSCALL1(set_thread_area, 36, uintptr_t);
+DEFN_SYSCALL3(waitpid, 37, pid_t, int32_t*, int32_t);
+DEFN_SYSCALL4(wait4, 38, pid_t, int32_t*, int32_t, struct rusage*);
+DEFN_SYSCALL1(times, 39, struct tms*);
+DEFN_SYSCALL2(getrusage, 40, int32_t, struct rusage*);
+DEFN_SYSCALL4(futex, 41, uint32_t*, int32_t, uint32_t,
+	const struct timespec*);
+DEFN_SYSCALL3(sched_setscheduler, 42, pid_t, int32_t,
+	const struct sched_param*);
+DEFN_SYSCALL1(sched_getscheduler, 43, pid_t);
+DEFN_SYSCALL2(sched_getparam, 44, pid_t, struct sched_param*);
+DEFN_SYSCALL0(sync, 45);
+DEFN_SYSCALL1(fsync, 46, int32_t);
+DEFN_SYSCALL1(fdatasync, 47, int32_t);
 
 static void *syscalls[] = {
 	// Defined in task.c
@@ -93,11 +116,30 @@ static void *syscalls[] = {
 	user_umount,
 	sbrk,
 	execve,
-	chdir
+	chdir,
+	clock_gettime,
+	clone,
+	gettid,
+	exit_thread,
+	set_thread_area,
+	waitpid,
+	wait4,
+	times,
+	getrusage,
+	futex,
+	sched_setscheduler,
+	sched_getscheduler,
+	sched_getparam,
+	user_sync,
+	user_fsync,
+	user_fdatasync
 };
 uint32_t num_syscalls;
 
 void syscall_handler(registers_t *regs) {
+	// fork needs to find the frame to hand the child
+	current_task->regs = regs;
+
 	if (regs->eax < num_syscalls) {
 		void *location = syscalls[regs->eax];
 		int32_t reta, retd;
@@ -33,9 +33,14 @@
 #include <idt.h>
 #include <gdt.h>
 #include <vfs.h>
+#include <fpu.h>
+#include <clocksource.h>
+#include <timer.h>
 #include <errno.h>
 #include <structures/tree.h>
 #include <structures/list.h>
+#include <structures/mutex.h>
+#include <rcu.h>
 
 #define PUSH(esp, type, object) ({ \
 	esp -= sizeof(type); \
@@ -45,7 +50,14 @@
 extern uint32_t initial_esp;
 
 // Defined in process.s
-extern uint32_t read_eip(void);
+extern void switch_context(uintptr_t *old_esp, uintptr_t new_esp,
+	uintptr_t new_cr3);
+
+// Defined in interrupt.s
+extern void isr_return(void);
+
+// Defined in timer.c
+extern volatile uint32_t tick;
 
 // Defined in paging.c
 extern page_directory_t *current_dir;
@@ -55,7 +67,114 @@ task_t *kidle = NULL;
 volatile task_t *current_task = NULL;
 list_t *processes = NULL;
 list_t *run_queue = NULL;
+list_t *rt_queue = NULL;		// Real-time tasks, highest priority first
+volatile uint32_t need_resched = 0;
 tree_t *proc_tree = NULL;
+// Exited threads whose stacks can't be freed until we're off them
+static list_t *dead_threads = NULL;
+// Protects processes and proc_tree. The run queues are only ever touched
+// with interrupts off
+static DEFINE_SPINLOCK(proc_lock);
+
+// Real-time throttling, see RT_RUNTIME
+static uint32_t rt_period_start = 0;
+static uint32_t rt_used = 0;
+static uint32_t rt_throttled = 0;
+
+// System wide scheduler statistics
+uint32_t nr_switches = 0;
+uint32_t sched_lat_hist[SCHED_HIST_BUCKETS];
+
+/* Recycled task_t's and kernel stacks, so fork/exit heavy loads run in
+ * steady state instead of going back to the heap every time
+ */
+static task_t *task_cache[TASK_CACHE_SIZE];
+static uint32_t task_cache_count = 0;
+static void *stack_cache[TASK_CACHE_SIZE];
+static uint32_t stack_cache_count = 0;
+
+static task_t *alloc_task(void) {
+	task_t *task = NULL;
+
+	uint32_t eflags = irq_save();
+	if (task_cache_count > 0)
+		task = task_cache[--task_cache_count];
+	irq_restore(eflags);
+
+	if (!task)
+		task = (task_t *)kmalloc(sizeof(task_t));
+	if (task)
+		memset(task, 0, sizeof(task_t));
+
+	return task;
+}
+
+static void free_task(task_t *task) {
+	uint32_t eflags = irq_save();
+	if (task_cache_count < TASK_CACHE_SIZE) {
+		task_cache[task_cache_count++] = task;
+		task = NULL;
+	}
+	irq_restore(eflags);
+
+	if (task)
+		kfree(task);
+}
+
+static void *alloc_kstack(void) {
+	void *stack = NULL;
+
+	uint32_t eflags = irq_save();
+	if (stack_cache_count > 0)
+		stack = stack_cache[--stack_cache_count];
+	irq_restore(eflags);
+
+	if (!stack)
+		stack = kmalloc(KERNEL_STACK_SIZE);
+
+	return stack;
+}
+
+static void free_kstack(void *stack) {
+	uint32_t eflags = irq_save();
+	if (stack_cache_count < TASK_CACHE_SIZE) {
+		stack_cache[stack_cache_count++] = stack;
+		stack = NULL;
+	}
+	irq_restore(eflags);
+
+	if (stack)
+		kfree(stack);
+}
+
+static thread_group_t *alloc_group(void) {
+	thread_group_t *group = (thread_group_t *)kmalloc(sizeof(thread_group_t));
+	if (!group)
+		return NULL;
+
+	memset(group, 0, sizeof(thread_group_t));
+
+	group->zombies = list_create();
+	if (!group->zombies) {
+		kfree(group);
+		return NULL;
+	}
+
+	group->child_exit = create_waitqueue();
+	if (!group->child_exit) {
+		list_destroy(group->zombies);
+		kfree(group);
+		return NULL;
+	}
+
+	return group;
+}
+
+static void free_group(thread_group_t *group) {
+	destroy_waitqueue(group->child_exit);
+	list_destroy(group->zombies);
+	kfree(group);
+}
 
 // We get the first free pid, rather than go in order
 static pid_t nextpid(void) {
@@ -94,12 +213,17 @@ static task_t *get_task(pid_t pid) {
 }
 
 static task_t *get_ready_task() {
+	// Throttled real-time tasks still run if nothing else wants to
+	list_t *queue = run_queue;
+	if (rt_queue->head && (!rt_throttled || !run_queue->head))
+		queue = rt_queue;
+
 	// It would be really bad to run out of memory right here...
 	node_t *queue_node;
-	queue_node = run_queue->head;
+	queue_node = queue->head;
 	task_t *task = NULL;
 	if (queue_node) {
-		list_dequeue(run_queue, queue_node);
+		list_dequeue(queue, queue_node);
 		task = (task_t *)queue_node->data;
 		kfree(queue_node);
 	} else
@@ -107,14 +231,148 @@ static task_t *get_ready_task() {
 	return task;
 }
 
-static void context_switch(void) {
-	asm volatile("mov %0, %%ecx; \
-		mov %1, %%esp; \
-		mov %2, %%ebp; \
-		mov %3, %%cr3; \
-		mov $0x12345, %%eax; \
-		jmp *%%ecx" : : "r"(current_task->eip), "r"(current_task->esp),
-		"r"(current_task->ebp), "r"(current_dir->physical_address) : "ecx");
+static void ns_to_timeval(uint64_t ns, struct timeval *tv) {
+	tv->tv_sec = (time_t)(ns / NSEC_PER_SEC);
+	tv->tv_usec = (long)(ns % NSEC_PER_SEC / NSEC_PER_USEC);
+}
+
+static clock_t ns_to_clock(uint64_t ns) {
+	return (clock_t)(ns / (NSEC_PER_SEC / HZ));
+}
+
+// Charge the time since the task's last state change as runtime
+static void account_run(task_t *task, uint64_t now) {
+	task->stats.runtime += now - task->stats.last;
+	task->stats.last = now;
+}
+
+// The task just came off the run queue and is about to run
+static void account_dispatch(task_t *task, uint64_t now) {
+	nr_switches++;
+	rcu_note_switch();
+
+	// kidle is never queued, it just fills the gaps
+	if (task != kidle) {
+		uint64_t wait = now - task->stats.last;
+		task->stats.wait_time += wait;
+		if (wait > task->stats.max_wait)
+			task->stats.max_wait = wait;
+
+		if (task->stats.woken) {
+			uint32_t us = (wait >> 32) ? 0xFFFFFFFF :
+				(uint32_t)wait / NSEC_PER_USEC;
+			uint32_t bucket = 0;
+			while (us && bucket < SCHED_HIST_BUCKETS - 1) {
+				us >>= 1;
+				bucket++;
+			}
+			task->stats.lat_hist[bucket]++;
+			sched_lat_hist[bucket]++;
+			task->stats.woken = 0;
+		}
+	}
+
+	task->stats.last = now;
+}
+
+/* Real-time tasks are kept sorted by priority, FIFO within each level. A
+ * preempted one goes back in at the front of its level, so it picks up
+ * where it left off. Interrupts must be off
+ */
+static node_t *queue_task(task_t *task, int head) {
+	if (!task->prio)
+		return list_insert(run_queue, task);
+
+	node_t *node;
+	foreach(node, rt_queue) {
+		uint32_t prio = ((task_t *)node->data)->prio;
+		if (prio < task->prio || (head && prio == task->prio))
+			break;
+	}
+
+	if (node)
+		return list_insert_before(rt_queue, node, task);
+	return list_insert(rt_queue, task);
+}
+
+/* Queue a task that's been asleep or has never run. Interrupts must be off.
+ * Preempted tasks go back on directly in switch_task
+ */
+static node_t *enqueue_task(task_t *task) {
+	node_t *node = queue_task(task, 0);
+	if (!node)
+		return NULL;
+
+	// Taken care of on the way out of the current interrupt or syscall
+	if (current_task && (task->prio > current_task->prio ||
+			current_task == kidle))
+		need_resched = 1;
+
+	uint64_t now = monotonic_ns();
+	if (task->stats.last)
+		task->stats.sleep_time += now - task->stats.last;
+	task->stats.last = now;
+	task->stats.woken = 1;
+
+	return node;
+}
+
+#define SWITCH_FRAME_SIZE	(7 * sizeof(uint32_t))
+
+/* Build the frame switch_context expects to find on a new task's stack.
+ * Interrupts stay off until the task turns them on itself
+ */
+static void push_switch_frame(uintptr_t *esp, uintptr_t eip, uint32_t gs) {
+	PUSH(*esp, uintptr_t, eip);
+	PUSH(*esp, uint32_t, 0);		// ebp
+	PUSH(*esp, uint32_t, 0);		// ebx
+	PUSH(*esp, uint32_t, 0);		// esi
+	PUSH(*esp, uint32_t, 0);		// edi
+	PUSH(*esp, uint32_t, 0x002);	// eflags
+	PUSH(*esp, uint32_t, gs);
+}
+
+// Write into another address space through a temporary mapping
+static int32_t copy_to_dir(page_directory_t *dir, uintptr_t dest,
+		const void *src, size_t len) {
+	while (len) {
+		page_t *page = get_page(dest, 0, dir);
+		if (!page || !page->present)
+			return -EFAULT;
+
+		uintptr_t map = kernel_map(page->frame * PAGE_SIZE);
+		if (!map)
+			return -ENOMEM;
+
+		uintptr_t off = dest % PAGE_SIZE;
+		size_t count = PAGE_SIZE - off;
+		if (count > len)
+			count = len;
+
+		memcpy((void *)(map + off), src, count);
+		kernel_unmap(map);
+
+		dest += count;
+		src = (const uint8_t *)src + count;
+		len -= count;
+	}
+
+	return 0;
+}
+
+static void switch_to(task_t *prev, task_t *next) {
+	/* Kernel-only tasks never touch user memory, so instead of flushing
+	 * the TLB to load kernel_dir they borrow whatever directory is loaded.
+	 * Kernel space is the same in all of them
+	 */
+	if (next->group)
+		current_dir = next->page_dir;
+	if (next->kernel_stack)
+		set_kernel_stack(next->kernel_stack);
+	set_tls_base(next->tls);
+	fpu_switch(next);
+
+	switch_context(&prev->esp, next->esp, current_dir->physical_address);
 }
 
 static void move_stack(void *new_stack_start, void *old_stack_start, size_t size) {
@@ -164,36 +422,46 @@ void init_tasking(uintptr_t ebp) {
 	move_stack((void *)KERNEL_STACK_TOP, (void *)ebp, KERNEL_STACK_SIZE);
 
 	run_queue = list_create();
+	rt_queue = list_create();
 	processes = list_create();
 	proc_tree = tree_create();
+	dead_threads = list_create();
 	ASSERT(run_queue);
+	ASSERT(rt_queue);
 	ASSERT(processes);
 	ASSERT(proc_tree);
+	ASSERT(dead_threads);
 
 	// Create init
-	task_t *init = (task_t *)kmalloc(sizeof(task_t));
+	task_t *init = alloc_task();
 	ASSERT(init);
 
-	memset(init, 0, sizeof(task_t));
-
 	init->pid = nextpid();
 	ASSERT(init->pid != 0);
+	init->tgid = init->pid;
 	init->gid = init->pid;
 	init->sid = init->pid;
 	init->page_dir = current_dir;
+	init->kernel_stack = KERNEL_STACK_TOP;
 	init->nice = 0;
 	init->euid = init->suid = init->ruid = 0;
 	init->egid = init->rgid = init->sgid = 0;
-	init->cwd = kmalloc(2);
-	ASSERT(init->cwd);
-	init->cwd[0] = PATH_DELIMITER;
-	init->cwd[1] = '\0';
 	init->cmd = kmalloc(7);
 	strcpy(init->cmd, "[init]");
+	init->stats.last = monotonic_ns();
+
+	init->group = alloc_group();
+	ASSERT(init->group);
+	init->group->threads = 1;
+	init->group->leader = init;
+	init->group->cwd = kmalloc(2);
+	ASSERT(init->group->cwd);
+	init->group->cwd[0] = PATH_DELIMITER;
+	init->group->cwd[1] = '\0';
 
 	// No open files yet
 	for (i = 0; i < MAX_OF; i++)
-		init->files[i].file = NULL;
+		init->group->files[i].file = NULL;
 
 	// Create kidle
 	tasklet_t *kidle_tasklet = (tasklet_t *)kmalloc(sizeof(tasklet_t));
@@ -201,18 +469,18 @@ void init_tasking(uintptr_t ebp) {
 
 	kidle = &kidle_tasklet->task;
 
-	memset(kidle_tasklet, 0, sizeof(task_t));
+	memset(kidle_tasklet, 0, sizeof(tasklet_t));
 
 	kidle_tasklet->task.pid = -1;
 	kidle_tasklet->task.page_dir = kernel_dir;
 	kidle_tasklet->task.cmd = kmalloc(8);
 	ASSERT(kidle_tasklet->task.cmd);
 	strcpy(kidle_tasklet->task.cmd, "[kidle]");
-	kidle_tasklet->stack = kmalloc(KERNEL_STACK_SIZE);
+	kidle_tasklet->stack = alloc_kstack();
 	ASSERT(kidle_tasklet->stack);
 	kidle_tasklet->task.esp = (uintptr_t)kidle_tasklet->stack + KERNEL_STACK_SIZE;
-	kidle_tasklet->task.ebp = kidle_tasklet->task.esp;
-	kidle_tasklet->task.eip = (uintptr_t)&_kidle;
+	push_switch_frame(&kidle_tasklet->task.esp, (uintptr_t)&_kidle,
+		KERNEL_DATA_SEL);
 
 	// Create a user stack
 	for (i = USER_STACK_BOTTOM; i < USER_STACK_TOP; i += PAGE_SIZE)
@@ -227,127 +495,281 @@ void init_tasking(uintptr_t ebp) {
 	asm volatile("sti");
 }
 
+// Kept sorted by pid so nextpid can find holes
+static node_t *insert_process(task_t *task) {
+	node_t *proc;
+	foreach(proc, processes) {
+		if (((task_t *)proc->data)->pid > task->pid)
+			break;
+	}
+	if (proc)
+		return list_insert_before(processes, proc, task);
+	return list_insert(processes, task);
+}
+
+/* Free threads that have exited since the last call. They can't do it
+ * themselves since they're still running on their stacks when they go
+ */
+static void reap_dead_threads(void) {
+	while (1) {
+		uint32_t eflags = irq_save();
+		node_t *node = dead_threads->head;
+		if (node)
+			list_dequeue(dead_threads, node);
+		irq_restore(eflags);
+
+		if (!node)
+			break;
+
+		task_t *task = (task_t *)node->data;
+		kfree(node);
+		free_kstack(task->stack);
+		kfree(task->cmd);
+		free_task(task);
+	}
+}
+
 pid_t fork(void) {
-	asm volatile("cli");
+	reap_dead_threads();
+
+	uint32_t eflags = spin_lock_irqsave(&proc_lock);
 	int i;
+	task_t *parent = (task_t *)current_task;
 	page_directory_t *directory = clone_directory(current_dir);
 
 	// Create a new process
-	task_t *new_task = (task_t *)kmalloc(sizeof(task_t));
-	if (!new_task) {
-		free_dir(directory);
-		return -ENOMEM;
-	}
+	task_t *new_task = alloc_task();
+	if (!new_task)
+		goto error0;
 
-	memset(new_task, 0, sizeof(task_t));
+	thread_group_t *group = alloc_group();
+	if (!group)
+		goto error1;
 
 	new_task->pid = nextpid();
 	if (new_task->pid == 0) {
+		free_group(group);
+		free_task(new_task);
 		free_dir(directory);
-		kfree(new_task);
-		asm volatile("sti");
+		spin_unlock_irqrestore(&proc_lock, eflags);
 		return -EAGAIN;
 	}
-	new_task->gid = current_task->gid;
-	new_task->sid = current_task->sid;
-	if (current_task->pid == 1)
+	new_task->tgid = new_task->pid;
+	new_task->gid = parent->gid;
+	new_task->sid = parent->sid;
+	if (parent->pid == 1)
 		new_task->gid = new_task->sid = new_task->pid;
-	else if (current_task->pid == current_task->sid)
+	else if (parent->pid == parent->sid)
 		new_task->gid = new_task->pid;
 
 	new_task->page_dir = directory;
-	new_task->brk = current_task->brk;
-	new_task->brk_actual = current_task->brk_actual;
-	new_task->start = current_task->start;
-	// Inherit niceness and ids of parent
-	new_task->nice = current_task->nice;
-	new_task->euid = current_task->euid;
-	new_task->ruid = current_task->ruid;
-	new_task->suid = current_task->suid;
-	new_task->egid = current_task->egid;
-	new_task->rgid = current_task->rgid;
-	new_task->sgid = current_task->sgid;
-	new_task->cwd = (char *)kmalloc(strlen(current_task->cwd) + 1);
-	if (!new_task->cwd)
-		goto error1;
-	new_task->cmd = (char *)kmalloc(strlen(current_task->cmd) + 1);
+	new_task->group = group;
+	new_task->tls = parent->tls;
+	// Inherit niceness, scheduling class and ids of parent
+	new_task->nice = parent->nice;
+	new_task->policy = parent->policy;
+	new_task->rt_priority = parent->rt_priority;
+	new_task->prio = parent->rt_priority;
+	new_task->time_slice = RR_TIMESLICE;
+	new_task->euid = parent->euid;
+	new_task->ruid = parent->ruid;
+	new_task->suid = parent->suid;
+	new_task->egid = parent->egid;
+	new_task->rgid = parent->rgid;
+	new_task->sgid = parent->sgid;
+	new_task->cmd = (char *)kmalloc(strlen(parent->cmd) + 1);
 	if (!new_task->cmd)
 		goto error2;
-	strcpy(new_task->cwd, current_task->cwd);
-	strcpy(new_task->cmd, current_task->cmd);
+	strcpy(new_task->cmd, parent->cmd);
+
+	group->threads = 1;
+	group->leader = new_task;
+	group->brk = parent->group->brk;
+	group->brk_actual = parent->group->brk_actual;
+	group->start = parent->group->start;
+	group->cwd = (char *)kmalloc(strlen(parent->group->cwd) + 1);
+	if (!group->cwd)
+		goto error3;
+	strcpy(group->cwd, parent->group->cwd);
 
 	// Copy open files
 	for (i = 0; i < MAX_OF; i++) {
-		if (current_task->files[i].file != NULL) {
-			new_task->files[i].file = clone_file(current_task->files[i].file);
-			new_task->files[i].off = current_task->files[i].off;
+		fs_node_t *file = parent->group->files[i].file;
+		if (file != NULL && file != FILEP_RESERVED) {
+			group->files[i].file = clone_file(file);
+			group->files[i].off = parent->group->files[i].off;
 		} else
-			new_task->files[i].file = NULL;
+			group->files[i].file = NULL;
 	}
 
-	tree_node_t *treenode = tree_insert_node(proc_tree, current_task->treenode,
+	// Children of any thread belong to the whole process
+	tree_node_t *treenode = tree_insert_node(proc_tree, parent->treenode,
 		new_task);
 	if (!treenode)
-		goto error3;
+		goto error4;
 
 	new_task->treenode = treenode;
 
-	node_t *proc;
-	node_t *proc_node = NULL;
-	foreach(proc, processes) {
-		if (((task_t *)proc->data)->pid > new_task->pid)
-			break;
-	}
-	if (proc)
-		proc_node = list_insert_before(processes, proc, new_task);
-	else
-		proc_node = list_insert(processes, new_task);
+	node_t *proc_node = insert_process(new_task);
 	if (!proc_node)
-		goto error4;
+		goto error5;
+
+	if (fpu_fork(parent, new_task))
+		goto error6;
 
-	node_t *queue_node = list_insert(run_queue, new_task);
+	/* The child gets a kernel stack in the usual place and starts out by
+	 * returning to user mode through a copy of our trap frame, with eax = 0
+	 */
+	registers_t regs;
+	memcpy(&regs, parent->regs, sizeof(registers_t));
+	regs.eax = 0;
+
+	uintptr_t frame[SWITCH_FRAME_SIZE / sizeof(uintptr_t)];
+	uintptr_t esp = (uintptr_t)frame + SWITCH_FRAME_SIZE;
+	push_switch_frame(&esp, (uintptr_t)&isr_return, TLS_SEL);
+
+	uintptr_t child_regs = KERNEL_STACK_TOP - sizeof(registers_t);
+	new_task->kernel_stack = KERNEL_STACK_TOP;
+	new_task->esp = child_regs - SWITCH_FRAME_SIZE;
+	if (copy_to_dir(directory, child_regs, &regs, sizeof(registers_t)) ||
+			copy_to_dir(directory, new_task->esp, frame, SWITCH_FRAME_SIZE))
+		goto error7;
+
+	node_t *queue_node = enqueue_task(new_task);
 	if (!queue_node)
-		goto error5;
+		goto error7;
 
-	// Entry point for new process
-	uint32_t esp;
-	uint32_t ebp;
-	asm volatile("mov %%esp, %0" : "=r" (esp));
-	asm volatile("mov %%ebp, %0" : "=r" (ebp));
-	uint32_t eip = read_eip();
-
-	// Are we parent or child? See switch_task for explanation
-	if (eip != 0x12345) {
-		new_task->esp = esp;
-		new_task->ebp = ebp;
-		new_task->eip = eip;
-		asm volatile("sti");
-		return new_task->pid;
-	} else
-		return 0;
+	spin_unlock_irqrestore(&proc_lock, eflags);
+	return new_task->pid;
 
-error5:
+error7:
+	fpu_release(new_task);
+error6:
 	list_dequeue(processes, proc_node);
 	kfree(proc_node);
-error4:
+error5:
 	tree_detach_branch(proc_tree, treenode);
 	tree_delete_node(treenode);
-error3:
+error4:
 	for (i = 0; i < MAX_OF; i++) {
-		if (current_task->files[i].file != NULL) {
-			close_vfs(new_task->files[i].file);
+		if (group->files[i].file != NULL) {
+			close_vfs(group->files[i].file);
 		}
 	}
+	kfree(group->cwd);
+error3:
 	kfree(new_task->cmd);
 error2:
-	kfree(new_task->cwd);
+	free_group(group);
 error1:
+	free_task(new_task);
+error0:
 	free_dir(directory);
-	kfree(new_task);
-	asm volatile("sti");
+	spin_unlock_irqrestore(&proc_lock, eflags);
 	return -ENOMEM;
 }
 
+/* Only whole threads for now: shared address space, file table and cwd,
+ * with a fresh user stack and optionally a new TLS base. With no flags
+ * this is just fork
+ */
+pid_t clone(uint32_t flags, uintptr_t stack, uintptr_t tls) {
+	if (flags == 0)
+		return fork();
+
+	if ((flags & ~CLONE_SETTLS) != CLONE_THREAD_FLAGS)
+		return -EINVAL;
+
+	if (!stack)
+		return -EINVAL;
+
+	reap_dead_threads();
+
+	int32_t ret = -ENOMEM;
+	task_t *parent = (task_t *)current_task;
+
+	task_t *thread = alloc_task();
+	if (!thread)
+		return -ENOMEM;
+
+	thread->stack = alloc_kstack();
+	if (!thread->stack)
+		goto error1;
+
+	thread->cmd = (char *)kmalloc(strlen(parent->cmd) + 1);
+	if (!thread->cmd)
+		goto error2;
+	strcpy(thread->cmd, parent->cmd);
+
+	if (fpu_fork(parent, thread))
+		goto error3;
+
+	// Same trap frame as ours, but returning 0 on the new user stack
+	thread->kernel_stack = (uintptr_t)thread->stack + KERNEL_STACK_SIZE;
+	registers_t *regs = (registers_t *)(thread->kernel_stack -
+		sizeof(registers_t));
+	memcpy(regs, parent->regs, sizeof(registers_t));
+	regs->eax = 0;
+	regs->useresp = stack;
+	thread->esp = (uintptr_t)regs;
+	push_switch_frame(&thread->esp, (uintptr_t)&isr_return, TLS_SEL);
+
+	thread->tgid = parent->tgid;
+	thread->gid = parent->gid;
+	thread->sid = parent->sid;
+	thread->page_dir = parent->page_dir;
+	thread->group = parent->group;
+	thread->treenode = parent->treenode;
+	thread->tls = (flags & CLONE_SETTLS) ? tls : parent->tls;
+	thread->flags = parent->flags & TASK_KILLED;
+	thread->nice = parent->nice;
+	thread->policy = parent->policy;
+	thread->rt_priority = parent->rt_priority;
+	thread->prio = parent->rt_priority;
+	thread->time_slice = RR_TIMESLICE;
+	thread->euid = parent->euid;
+	thread->ruid = parent->ruid;
+	thread->suid = parent->suid;
+	thread->egid = parent->egid;
+	thread->rgid = parent->rgid;
+	thread->sgid = parent->sgid;
+
+	uint32_t eflags = spin_lock_irqsave(&proc_lock);
+
+	thread->pid = nextpid();
+	if (thread->pid == 0) {
+		ret = -EAGAIN;
+		goto error4;
+	}
+
+	node_t *proc_node = insert_process(thread);
+	if (!proc_node)
+		goto error4;
+
+	node_t *queue_node = enqueue_task(thread);
+	if (!queue_node)
+		goto error5;
+
+	thread->group->threads++;
+
+	spin_unlock_irqrestore(&proc_lock, eflags);
+	return thread->pid;
+
+error5:
+	list_dequeue(processes, proc_node);
+	kfree(proc_node);
+error4:
+	spin_unlock_irqrestore(&proc_lock, eflags);
+	fpu_release(thread);
+error3:
+	kfree(thread->cmd);
+error2:
+	free_kstack(thread->stack);
+error1:
+	free_task(thread);
+	return ret;
+}
+
 void _tasklet_finish(void) {
 	asm volatile("cli");
 
@@ -367,12 +789,12 @@ tasklet_t *create_tasklet(tasklet_body_t body, const char *name, void *argp) {
 
 	memset(tasklet, 0, sizeof(tasklet_t));
 
-	asm volatile("cli");
+	uint32_t eflags = spin_lock_irqsave(&proc_lock);
 
 	tasklet->task.pid = nextpid();
 	if (tasklet->task.pid == 0) {
 		kfree(tasklet);
-		asm volatile("sti");
+		spin_unlock_irqrestore(&proc_lock, eflags);
 		return NULL;
 	}
 
@@ -383,7 +805,7 @@ tasklet_t *create_tasklet(tasklet_body_t body, const char *name, void *argp) {
 		goto error1;
 	strcpy(tasklet->task.cmd, name);
 
-	tasklet->stack = kmalloc(KERNEL_STACK_SIZE);
+	tasklet->stack = alloc_kstack();
 	if (!tasklet->stack)
 		goto error2;
 
@@ -391,12 +813,7 @@ tasklet_t *create_tasklet(tasklet_body_t body, const char *name, void *argp) {
 	tasklet->argp = argp;
 	tasklet->scheduled = 0;
 
-	tasklet->task.esp = (uintptr_t)tasklet->stack + KERNEL_STACK_SIZE;
-	tasklet->task.ebp = tasklet->task.esp;
-	tasklet->task.eip = tasklet->entry;
-
-	PUSH(tasklet->task.esp, uintptr_t, tasklet->argp);
-	PUSH(tasklet->task.esp, uintptr_t, &_tasklet_finish);
+	reset_tasklet(tasklet);
 
 	tree_node_t *treenode = tree_insert_node(proc_tree, proc_tree->root,
 		&tasklet->task);
@@ -404,55 +821,46 @@ tasklet_t *create_tasklet(tasklet_body_t body, const char *name, void *argp) {
 		goto error3;
 	tasklet->task.treenode = treenode;
 
-	node_t *proc;
-	node_t *proc_node = NULL;
-	foreach(proc, processes) {
-		if (((task_t *)proc->data)->pid > tasklet->task.pid)
-			break;
-	}
-	if (proc)
-		proc_node = list_insert_before(processes, proc, &tasklet->task);
-	else
-		proc_node = list_insert(processes, &tasklet->task);
+	node_t *proc_node = insert_process(&tasklet->task);
 	if (!proc_node)
 		goto error4;
 
-	asm volatile("sti");
+	spin_unlock_irqrestore(&proc_lock, eflags);
 	return tasklet;
 
 error4:
 	tree_detach_branch(proc_tree, treenode);
 	tree_delete_node(treenode);
 error3:
-	kfree(tasklet->stack);
+	free_kstack(tasklet->stack);
 error2:
 	kfree(tasklet->task.cmd);
 error1:
 	kfree(tasklet);
-	asm volatile("sti");
+	spin_unlock_irqrestore(&proc_lock, eflags);
 	return NULL;
 }
 
 int32_t schedule_tasklet(tasklet_t *tasklet) {
-	asm volatile("cli");
+	uint32_t eflags = irq_save();
 
 	ASSERT(tasklet);
 
 	if (tasklet->scheduled) {
-		asm volatile("sti");
+		irq_restore(eflags);
 		return 0;
 	}
 
-	node_t *queue_node = list_insert(run_queue, &tasklet->task);
+	node_t *queue_node = enqueue_task(&tasklet->task);
 
 	if (!queue_node) {
-		asm volatile("sti");
+		irq_restore(eflags);
 		return -ENOMEM;
 	}
 
 	tasklet->scheduled = 1;
 
-	asm volatile("sti");
+	irq_restore(eflags);
 
 	return 0;
 }
@@ -461,11 +869,11 @@ void reset_tasklet(tasklet_t *tasklet) {
 	ASSERT(!tasklet->scheduled);
 
 	tasklet->task.esp = (uintptr_t)tasklet->stack + KERNEL_STACK_SIZE;
-	tasklet->task.ebp = tasklet->task.esp;
-	tasklet->task.eip = tasklet->entry;
 
+	// Body is entered as if called from _tasklet_finish with argp
 	PUSH(tasklet->task.esp, uintptr_t, tasklet->argp);
 	PUSH(tasklet->task.esp, uintptr_t, &_tasklet_finish);
+	push_switch_frame(&tasklet->task.esp, tasklet->entry, KERNEL_DATA_SEL);
 }
 
 int32_t reset_and_reschedule(tasklet_t *tasklet) {
@@ -481,7 +889,7 @@ void destroy_tasklet(tasklet_t *tasklet) {
 	if (!tasklet)
 		return;
 
-	asm volatile("cli");
+	uint32_t eflags = spin_lock_irqsave(&proc_lock);
 
 	ASSERT(!tasklet->scheduled);
 
@@ -494,87 +902,643 @@ void destroy_tasklet(tasklet_t *tasklet) {
 	kfree(proc_node);
 
 	kfree(tasklet->task.cmd);
-	kfree(tasklet->stack);
+	free_kstack(tasklet->stack);
 	kfree(tasklet);
 
-	asm volatile("sti");
+	spin_unlock_irqrestore(&proc_lock, eflags);
 }
 
+// Whether a real-time task that's been preempted can carry on anyway
+static int keep_running(task_t *task) {
+	if (!task->prio)
+		return 0;
+
+	if (rt_throttled && run_queue->head)
+		return 0;
+
+	task_t *next = rt_queue->head ? (task_t *)rt_queue->head->data : NULL;
+	if (next && next->prio > task->prio)
+		return 0;
+
+	// Round robin only takes turns within its own level
+	if (task->policy == SCHED_RR && task->time_slice == 0) {
+		task->time_slice = RR_TIMESLICE;
+		if (next && next->prio == task->prio)
+			return 0;
+	}
+
+	return 1;
+}
+
+// Must be called with interrupts disabled
 int switch_task(int reschedule) {
 	if (current_task) {
-		uint32_t esp, ebp, eip;
-		asm volatile("mov %%esp, %0" : "=r" (esp));
-		asm volatile("mov %%ebp, %0" : "=r" (ebp));
-
-		/* Cunning logic time!
-		 * We're going to be in one of 2 states after this call
-		 * Either read_eip just returned, or we've just switched tasks and
-		 * have come back here
-		 * If it's the latter, we need to return. To detect it, the former
-		 * will return 0x12345
+		task_t *prev = (task_t *)current_task;
+
+		/* RCU readers and spinlock holders can't be preempted. Catch them
+		 * on the next interrupt, or as they let go of their last lock
 		 */
-		eip = read_eip();
-		if (eip == 0x12345)
-			return current_task->nice;
+		if (reschedule && (prev->rcu_nesting || prev->preempt_count)) {
+			need_resched = 1;
+			return prev->nice;
+		}
+
+		uint64_t now = monotonic_ns();
+		account_run(prev, now);
+		need_resched = 0;
 
-		current_task->eip = eip;
-		current_task->esp = esp;
-		current_task->ebp = ebp;
+		// Round robin tasks that have had their turn go to the back
+		int expired = (prev->policy == SCHED_RR && prev->time_slice == 0);
+		if (reschedule && keep_running(prev))
+			return prev->nice;
 
 		// It would be really bad to run out of memory right here...
 		node_t *queue_node;
-		if (reschedule && current_task->pid != -1) {
-			queue_node = list_insert(run_queue, (task_t *)current_task);
+		if (reschedule && prev->pid != -1) {
+			queue_node = queue_task(prev, !expired);
 			ASSERT(queue_node);
 		}
 
-		current_task = get_ready_task();
+		task_t *next = get_ready_task();
+		if (next != prev) {
+			if (reschedule)
+				prev->stats.nivcsw++;
+			else
+				prev->stats.nvcsw++;
+			account_dispatch(next, now);
 
-		esp = current_task->esp;
-		ebp = current_task->ebp;
-		eip = current_task->eip;
-
-		current_dir = current_task->page_dir;
-		set_kernel_stack(esp);
+			current_task = next;
+			switch_to(prev, next);
+		}
 
-		context_switch();
+		// We've been switched back to
+		return current_task->nice;
 	}
 
 	return 0;
 }
 
+// Take a single task off whatever it's sleeping on. Interrupts must be off
+void wake_task(task_t *task) {
+	if (!(task->sleep_flags & SLEEP_ASLEEP))
+		return;
+
+	node_t *node = list_find(task->wq->queue, task);
+	if (node) {
+		list_dequeue(task->wq->queue, node);
+		kfree(node);
+	}
+
+	task->sleep_flags &= ~SLEEP_ASLEEP;
+	task->wq = NULL;
+	node = enqueue_task(task);
+	ASSERT(node);
+}
+
+// Wake a task out of an interruptable sleep. Interrupts must be off
+static void interrupt_task(task_t *task) {
+	if (!(task->sleep_flags & SLEEP_ASLEEP) ||
+			!(task->sleep_flags & SLEEP_INTERRUPTABLE))
+		return;
+
+	task->sleep_flags |= SLEEP_INTERRUPTED;
+	wake_task(task);
+}
+
+// Exit the whole process, taking every thread in it along
 void exit_task(int32_t status) {
-	asm volatile("cli");
-	ASSERT(current_task->pid != 1); // Init doesn't exit
+	thread_group_t *group = current_task->group;
+
+	spin_lock_irqsave(&proc_lock);
+
+	if (!group->exiting) {
+		group->exiting = 1;
+		group->exit = status;
 
+		// Everybody else goes the next time they head back to user mode
+		node_t *node;
+		foreach(node, processes) {
+			task_t *task = (task_t *)node->data;
+			if (task->group != group || task == current_task)
+				continue;
+			task->flags |= TASK_KILLED;
+			interrupt_task(task);
+		}
+	}
+
+	// Interrupts stay off, we're not coming back
+	spin_unlock(&proc_lock);
+	exit_thread(group->exit);
+}
+
+// Exit just the calling thread. The last one out tears down the process
+void exit_thread(int32_t status) {
 	task_t *current_cache = (task_t *)current_task;
+	thread_group_t *group = current_cache->group;
+	task_t *leader = group->leader;
+
+	reap_dead_threads();
+
+	asm volatile("cli");
+	int last = (--group->threads == 0);
+	ASSERT(!last || leader->pid != 1); // Init doesn't exit
 
 	current_cache->exit = status;
 
-	// Switch tasks
-	current_task = get_ready_task();
+	// Closing may sleep, so do it while we're still a proper task
+	int i;
+	if (last) {
+		for (i = 0; i < MAX_OF; i++)
+			if (group->files[i].file &&
+					group->files[i].file != FILEP_RESERVED)
+				close_vfs(group->files[i].file);
+	}
 
-	// We don't delete from the process tree/list because we haven't been
-	// waited on
+	asm volatile("cli");
+	spin_lock(&proc_lock);
+
+	// Our time goes to the process
+	uint64_t now = monotonic_ns();
+	account_run(current_cache, now);
+	current_cache->stats.nvcsw++;
+
+	struct cputime ct;
+	task_cputime(current_cache, &ct);
+	group->dead.utime += ct.utime;
+	group->dead.stime += ct.stime;
+
+	if (last) {
+		// The leader stands in for the process until it's waited on
+		leader->exit = group->exiting ? group->exit : status;
+		leader->exit_time.utime = group->dead.utime + group->children.utime;
+		leader->exit_time.stime = group->dead.stime + group->children.stime;
+		leader->flags |= TASK_ZOMBIE;
+		leader->group = NULL;
+
+		// Init inherits orphans, along with any it has to reap
+		task_t *init = (task_t *)proc_tree->root->data;
+		tree_inherit_children(proc_tree, proc_tree->root,
+			current_cache->treenode);
+		if (group->zombies->head) {
+			list_merge(init->group->zombies, group->zombies);
+			wake_queue(init->group->child_exit);
+		}
 
-	// Init inherits orphans
-	tree_inherit_children(proc_tree, proc_tree->root, current_cache->treenode);
+		// Hand ourselves to the parent
+		task_t *parent = (task_t *)current_cache->treenode->parent->data;
+		node_t *node = list_insert(parent->group->zombies, leader);
+		ASSERT(node);
+		wake_queue(parent->group->child_exit);
 
-	// Use new current_task's paging dir, because we're about to trash ours
-	current_dir = current_task->page_dir;
-	set_kernel_stack(current_task->esp);
-	asm volatile("mov %0, %%cr3" : : "r"(current_dir->physical_address));
+		kfree(group->cwd);
+		free_group(group);
 
-	// Free everything
-	int i;
-	for (i = 0; i < MAX_OF; i++)
-		if (current_cache->files[i].file)
-			close_vfs(current_cache->files[i].file);
+		/* We're still running on a stack in this directory, and it's still
+		 * loaded, so it goes with the leader and whoever reaps it frees it
+		 */
+		leader->page_dir = current_cache->page_dir;
+
+		// Nobody may borrow it after us
+		current_dir = kernel_dir;
+	}
+
+	fpu_release(current_cache);
+	current_cache->flags |= TASK_EXITED;
+
+	/* Threads share the leader's place in the process tree, so it keeps
+	 * the group for as long as any of them might look it up
+	 */
+	if (current_cache != leader) {
+		current_cache->group = NULL;
+		current_cache->page_dir = NULL;
+	}
+
+	// Other threads vanish entirely once we're off their stack
+	if (current_cache != leader) {
+		node_t *node = list_find(processes, current_cache);
+		list_dequeue(processes, node);
+		kfree(node);
+		node = list_insert(dead_threads, current_cache);
+		ASSERT(node);
+	}
+
+	spin_unlock(&proc_lock);
+
+	task_t *next = get_ready_task();
+	account_dispatch(next, now);
+	current_task = next;
+	switch_to(current_cache, next);
+
+	PANIC("Exited task rescheduled");
+}
+
+static int wait_matches(task_t *task, pid_t pid) {
+	if (pid > 0)
+		return task->pid == pid;
+	if (pid == -1)
+		return 1;
+	if (pid == 0)
+		return task->gid == current_task->gid;
+	return task->gid == -pid;
+}
+
+// Last traces of a process, once its exit status has been collected
+static void release_task(task_t *task) {
+	node_t *node = list_find(processes, task);
+	list_dequeue(processes, node);
+	kfree(node);
+
+	tree_detach_branch(proc_tree, task->treenode);
+	tree_delete_node(task->treenode);
+
+	// Left behind by the last thread out. Nobody has it loaded any more
+	if (task->page_dir)
+		free_dir(task->page_dir);
+
+	kfree(task->cmd);
+	free_task(task);
+}
+
+/* Exiting children put themselves on their parent's zombie list, so
+ * collecting one doesn't involve looking through everybody
+ */
+pid_t wait4(pid_t pid, int32_t *status, int32_t options,
+		struct rusage *rusage) {
+	thread_group_t *group = current_task->group;
+	tree_node_t *treenode = current_task->treenode;
+
+	uint32_t eflags = spin_lock_irqsave(&proc_lock);
+
+	while (1) {
+		node_t *node;
+		foreach(node, group->zombies) {
+			if (wait_matches((task_t *)node->data, pid))
+				break;
+		}
+
+		if (node) {
+			task_t *zombie = (task_t *)node->data;
+			list_dequeue(group->zombies, node);
+			kfree(node);
+
+			pid_t ret = zombie->pid;
+			int32_t exit = zombie->exit;
+			struct cputime ct = zombie->exit_time;
+			group->children.utime += ct.utime;
+			group->children.stime += ct.stime;
+			release_task(zombie);
+			spin_unlock_irqrestore(&proc_lock, eflags);
+
+			if (status)
+				*status = (exit & 0xFF) << 8;
+			if (rusage) {
+				memset(rusage, 0, sizeof(struct rusage));
+				ns_to_timeval(ct.utime, &rusage->ru_utime);
+				ns_to_timeval(ct.stime, &rusage->ru_stime);
+			}
+
+			return ret;
+		}
+
+		// Anything left that could still exit? Tasklets don't count
+		foreach(node, treenode->children) {
+			task_t *child = (task_t *)((tree_node_t *)node->data)->data;
+			if (child->group && wait_matches(child, pid))
+				break;
+		}
+
+		if (!node) {
+			spin_unlock_irqrestore(&proc_lock, eflags);
+			return -ECHILD;
+		}
+
+		if (options & WNOHANG) {
+			spin_unlock_irqrestore(&proc_lock, eflags);
+			return 0;
+		}
+
+		// Interrupts stay off in between, so the wakeup can't be missed
+		spin_unlock(&proc_lock);
+		int interrupted = sleep_thread(group->child_exit, SLEEP_INTERRUPTABLE);
+		spin_lock(&proc_lock);
+
+		if (interrupted) {
+			spin_unlock_irqrestore(&proc_lock, eflags);
+			return -EINTR;
+		}
+	}
+}
+
+pid_t waitpid(pid_t pid, int32_t *status, int32_t options) {
+	return wait4(pid, status, options, NULL);
+}
+
+/* Sample where the timer caught the current task, to split its runtime,
+ * and charge real-time tasks for their slices and budget
+ */
+void account_tick(registers_t *regs) {
+	task_t *task = (task_t *)current_task;
+	if (!task)
+		return;
+
+	if ((regs->cs & 0x03) == 0x03)
+		task->stats.uticks++;
+	else
+		task->stats.sticks++;
+
+	if (task->prio) {
+		if (task->policy == SCHED_RR && task->time_slice &&
+				--task->time_slice == 0)
+			need_resched = 1;
+
+		if (++rt_used >= RT_RUNTIME && !rt_throttled) {
+			rt_throttled = 1;
+			need_resched = 1;
+		}
+	}
+
+	if (tick - rt_period_start >= RT_PERIOD) {
+		rt_period_start = tick;
+		rt_used = 0;
+		if (rt_throttled) {
+			rt_throttled = 0;
+			if (rt_queue->head)
+				need_resched = 1;
+		}
+	}
+}
+
+/* Only the total is measured exactly. It's split between user and system
+ * time in proportion to where the timer ticks landed
+ */
+void task_cputime(task_t *task, struct cputime *ct) {
+	uint64_t runtime = task->stats.runtime;
+	if (task == current_task)
+		runtime += monotonic_ns() - task->stats.last;
+
+	uint32_t ticks = task->stats.uticks + task->stats.sticks;
+	if (ticks == 0) {
+		ct->utime = 0;
+		ct->stime = runtime;
+		return;
+	}
+
+	ct->utime = runtime / ticks * task->stats.uticks;
+	ct->stime = runtime - ct->utime;
+}
+
+// Every thread in the group, living or dead
+static void group_cputime(thread_group_t *group, struct cputime *ct) {
+	uint32_t eflags = irq_save();
+
+	*ct = group->dead;
+
+	node_t *node;
+	foreach(node, processes) {
+		task_t *task = (task_t *)node->data;
+		if (task->group != group || (task->flags & TASK_EXITED))
+			continue;
+
+		struct cputime thread;
+		task_cputime(task, &thread);
+		ct->utime += thread.utime;
+		ct->stime += thread.stime;
+	}
+
+	irq_restore(eflags);
+}
+
+// Times in ticks of HZ. Returns ticks since boot
+clock_t times(struct tms *buf) {
+	if (buf) {
+		thread_group_t *group = current_task->group;
+		struct cputime self;
+		group_cputime(group, &self);
+
+		buf->tms_utime = ns_to_clock(self.utime);
+		buf->tms_stime = ns_to_clock(self.stime);
+		buf->tms_cutime = ns_to_clock(group->children.utime);
+		buf->tms_cstime = ns_to_clock(group->children.stime);
+	}
+
+	return tick;
+}
+
+int32_t getrusage(int32_t who, struct rusage *usage) {
+	if (!usage)
+		return -EFAULT;
+
+	struct cputime ct;
+	switch (who) {
+	case RUSAGE_SELF:
+		group_cputime(current_task->group, &ct);
+		break;
+	case RUSAGE_CHILDREN:
+		ct = current_task->group->children;
+		break;
+	case RUSAGE_THREAD:
+		task_cputime((task_t *)current_task, &ct);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	memset(usage, 0, sizeof(struct rusage));
+	ns_to_timeval(ct.utime, &usage->ru_utime);
+	ns_to_timeval(ct.stime, &usage->ru_stime);
+
+	return 0;
+}
+
+/* Called on the way back out of an interrupt, to act on a wakeup or expired
+ * slice straight away. Code that had interrupts off is left alone
+ */
+void check_resched(registers_t *regs) {
+	if (!need_resched)
+		return;
+
+	if ((regs->cs & 0x03) != 0x03 && !(regs->eflags & 0x200))
+		return;
+
+	uint32_t eflags = irq_save();
+	switch_task(1);
+	irq_restore(eflags);
+}
+
+/* Spinlocks hold these around themselves, so a holder or a waiter with a
+ * ticket can't be switched out from under a task that's spinning for it.
+ * Interrupt handlers count against whoever they interrupted
+ */
+void preempt_disable(void) {
+	if (current_task)
+		current_task->preempt_count++;
+	__asm__ volatile ("" ::: "memory");
+}
+
+// Gives up the cpu if something wanted it while we couldn't
+void preempt_enable(void) {
+	__asm__ volatile ("" ::: "memory");
+	if (!current_task)
+		return;
+
+	ASSERT(current_task->preempt_count);
+	if (--current_task->preempt_count || !need_resched)
+		return;
+
+	uint32_t eflags = irq_save();
+	if (eflags & 0x200)
+		switch_task(1);
+	irq_restore(eflags);
+}
+
+// Interrupts must be off
+static void set_prio(task_t *task, uint32_t prio) {
+	if (prio == task->prio)
+		return;
+
+	// Queued tasks have to move to their new place
+	node_t *node = list_find(task->prio ? rt_queue : run_queue, task);
+	if (node) {
+		list_dequeue(task->prio ? rt_queue : run_queue, node);
+		kfree(node);
+	}
+
+	task->prio = prio;
+
+	if (node) {
+		node = queue_task(task, 0);
+		ASSERT(node);
+		if (prio > current_task->prio)
+			need_resched = 1;
+	}
+
+	// Dropping below a waiting task means giving it the cpu
+	if (task == current_task && rt_queue->head &&
+			((task_t *)rt_queue->head->data)->prio > prio)
+		need_resched = 1;
+}
+
+// Effective priority from everything that feeds into it. Interrupts must be off
+static void update_prio(task_t *task) {
+	uint32_t prio = task->rt_priority;
+	if (task->inherited_prio > prio)
+		prio = task->inherited_prio;
+	if (task->pi_prio > prio)
+		prio = task->pi_prio;
+	set_prio(task, prio);
+}
+
+// Kernel internal. No permission checks
+int32_t set_scheduler(task_t *task, uint32_t policy, uint32_t prio) {
+	switch (policy) {
+	case SCHED_NORMAL:
+		if (prio != 0)
+			return -EINVAL;
+		break;
+	case SCHED_FIFO:
+	case SCHED_RR:
+		if (prio < 1 || prio > RT_PRIO_MAX)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	uint32_t eflags = irq_save();
+	task->policy = policy;
+	task->rt_priority = prio;
+	task->time_slice = RR_TIMESLICE;
+	update_prio(task);
+	// Whoever holds what we're waiting for may need a different boost
+	if (task->blocked_on)
+		mutex_prio_changed(task);
+	irq_restore(eflags);
+
+	return 0;
+}
+
+// Lend a task a priority while it does something for a more important one
+void sched_inherit(task_t *task, uint32_t prio) {
+	uint32_t eflags = irq_save();
+	if (prio > task->inherited_prio) {
+		task->inherited_prio = prio;
+		update_prio(task);
+	}
+	irq_restore(eflags);
+}
+
+void sched_uninherit(task_t *task) {
+	uint32_t eflags = irq_save();
+	task->inherited_prio = 0;
+	update_prio(task);
+	irq_restore(eflags);
+}
+
+// Boost from mutex waiters. Interrupts must be off
+void sched_pi_set(task_t *task, uint32_t prio) {
+	task->pi_prio = prio;
+	update_prio(task);
+}
+
+static task_t *get_sched_task(pid_t pid) {
+	task_t *task = pid ? get_task(pid) : (task_t *)current_task;
+	if (!task || (task->flags & (TASK_ZOMBIE | TASK_EXITED)))
+		return NULL;
+	return task;
+}
+
+int32_t sched_setscheduler(pid_t pid, int32_t policy,
+		const struct sched_param *param) {
+	if (!param)
+		return -EFAULT;
+	if (pid < 0)
+		return -EINVAL;
+
+	task_t *task = get_sched_task(pid);
+	if (!task)
+		return -ESRCH;
+
+	// Only root can go real-time, or touch other users' tasks
+	if (current_task->euid != 0) {
+		if (policy != SCHED_NORMAL)
+			return -EPERM;
+		if (task->euid != current_task->euid &&
+				task->ruid != current_task->ruid)
+			return -EPERM;
+	}
+
+	return set_scheduler(task, policy, param->sched_priority);
+}
 
-	free_dir(current_cache->page_dir);
-	kfree(current_cache->cwd);
+int32_t sched_getscheduler(pid_t pid) {
+	if (pid < 0)
+		return -EINVAL;
+
+	task_t *task = get_sched_task(pid);
+	if (!task)
+		return -ESRCH;
 
-	context_switch();
+	return task->policy;
+}
+
+int32_t sched_getparam(pid_t pid, struct sched_param *param) {
+	if (!param)
+		return -EFAULT;
+	if (pid < 0)
+		return -EINVAL;
+
+	task_t *task = get_sched_task(pid);
+	if (!task)
+		return -ESRCH;
+
+	param->sched_priority = task->rt_priority;
+	return 0;
+}
+
+// Called on the way back out of an interrupt
+void check_killed(registers_t *regs) {
+	if ((regs->cs & 0x03) == 0x03 && (current_task->flags & TASK_KILLED))
+		exit_thread(current_task->group->exit);
 }
 
 waitqueue_t *create_waitqueue(void) {
@@ -598,13 +1562,8 @@ void destroy_waitqueue(waitqueue_t *queue) {
 }
 
 int sleep_thread(waitqueue_t *wq, uint32_t flags) {
-	/* Normally, switch_task is called from an interrupt context,
-	 * so all registers are saved automatically. Here, that's not the
-	 * case, so we have to convince gcc to save everything for us
-	 */
-	asm volatile("" : : : "ebx", "esi", "edi");
-
 	ASSERT(wq);
+	ASSERT(!current_task->rcu_nesting && "Sleeping in an RCU read section");
 	asm volatile("cli");
 
 	current_task->sleep_flags = SLEEP_ASLEEP | flags;
@@ -617,29 +1576,54 @@ int sleep_thread(waitqueue_t *wq, uint32_t flags) {
 	return current_task->sleep_flags & SLEEP_INTERRUPTED;
 }
 
-void wake_queue(waitqueue_t *wq) {
+static void __wake_queue(waitqueue_t *wq, int all) {
 	ASSERT(wq);
 
-	asm volatile("cli");
+	uint32_t eflags = irq_save();
+	int woke_exclusive = 0;
 	node_t *node = wq->queue->head;
 	while (node) {
 		node_t *cache = node;
 		node = node->next;
 		task_t *task = (task_t *)cache->data;
+
+		if (task->sleep_flags & SLEEP_EXCLUSIVE) {
+			if (woke_exclusive && !all)
+				continue;
+			woke_exclusive = 1;
+		}
+
 		list_dequeue(wq->queue, cache);
 		kfree(cache);
 
 		task->sleep_flags &= ~SLEEP_ASLEEP;
 		task->wq = NULL;
-		cache = list_insert(run_queue, task);
+		cache = enqueue_task(task);
 		ASSERT(cache);
 	}
-	asm volatile("sti");
+	irq_restore(eflags);
+}
+
+/* Wakes every ordinary sleeper, but only the first exclusive one, since
+ * they're each after something only one of them can have. Safe to call
+ * from interrupt handlers
+ */
+void wake_queue(waitqueue_t *wq) {
+	__wake_queue(wq, 0);
+}
+
+// Everybody, exclusive or not
+void wake_queue_all(waitqueue_t *wq) {
+	__wake_queue(wq, 1);
 }
 
 void switch_user_mode(uint32_t entry, int32_t argc, char **argv, char **envp,
 		uint32_t stack) {
-	set_kernel_stack(current_task->esp);
+	set_kernel_stack(current_task->kernel_stack);
+
+	// Fresh image, fresh TLS
+	current_task->tls = 0;
+	set_tls_base(0);
 
 	// First entry on stack will be 0. Protects from page fault.
 	stack -= 4;
@@ -653,6 +1637,7 @@ void switch_user_mode(uint32_t entry, int32_t argc, char **argv, char **envp,
 		mov %%ax, %%ds; \
 		mov %%ax, %%es; \
 		mov %%ax, %%fs; \
+		mov $0x33, %%ax; \
 		mov %%ax, %%gs; \
 		mov %%esp, %%eax; \
 		pushl $0x23; \
@@ -668,15 +1653,26 @@ void switch_user_mode(uint32_t entry, int32_t argc, char **argv, char **envp,
 }
 
 pid_t getpid(void) {
+	return current_task->tgid;
+}
+
+pid_t gettid(void) {
 	return current_task->pid;
 }
 
-pid_t setpgid(pid_t pid, pid_t pgid) {
-	if (pid < 0 || pgid < 0)
-		return -EINVAL;
+int32_t set_thread_area(uintptr_t base) {
+	current_task->tls = base;
+	set_tls_base(base);
 
-	asm volatile("cli");
+	// Reload gs so the new base takes effect
+	uint16_t sel = TLS_SEL;
+	asm volatile("mov %0, %%gs" :: "r"(sel));
+
+	return 0;
+}
 
+// Called with proc_lock held
+static pid_t do_setpgid(pid_t pid, pid_t pgid) {
 	task_t *task = (task_t *)current_task;
 	if (pid != 0) {
 		task = get_task(pid);
@@ -731,6 +1727,17 @@ pid_t setpgid(pid_t pid, pid_t pgid) {
 	return pgid;
 }
 
+pid_t setpgid(pid_t pid, pid_t pgid) {
+	if (pid < 0 || pgid < 0)
+		return -EINVAL;
+
+	uint32_t eflags = spin_lock_irqsave(&proc_lock);
+	pid_t ret = do_setpgid(pid, pgid);
+	spin_unlock_irqrestore(&proc_lock, eflags);
+
+	return ret;
+}
+
 pid_t getpgid(pid_t pid) {
 	if (pid < 0)
 		return -EINVAL;
@@ -747,12 +1754,13 @@ pid_t getpgid(pid_t pid) {
 pid_t setsid(void) {
 	if (current_task->gid == current_task->pid)
 		return -EPERM;
-	asm volatile("cli");
 
+	uint32_t eflags = spin_lock_irqsave(&proc_lock);
 	tree_detach_branch(proc_tree, current_task->treenode);
 	tree_insert_direct(proc_tree, proc_tree->root, current_task->treenode);
 
 	current_task->sid = current_task->gid = current_task->pid;
+	spin_unlock_irqrestore(&proc_lock, eflags);
 
 	return current_task->sid;
 }
@@ -866,13 +1874,14 @@ int32_t getresgid(gid_t *rgid, gid_t *egid, gid_t *sgid) {
 }
 
 uintptr_t sbrk(uintptr_t inc) {
-	uintptr_t ret = current_task->brk;
-	while (current_task->brk_actual < current_task->brk + inc) {
-		current_task->brk_actual += 0x1000;
-		alloc_frame(get_page(current_task->brk_actual, 1, current_dir), 0, 1);
+	thread_group_t *group = current_task->group;
+	uintptr_t ret = group->brk;
+	while (group->brk_actual < group->brk + inc) {
+		group->brk_actual += 0x1000;
+		alloc_frame(get_page(group->brk_actual, 1, current_dir), 0, 1);
 	}
 
-	current_task->brk += inc;
+	group->brk += inc;
 
 	return ret;
 }
@@ -883,9 +1892,9 @@ uint32_t chdir(const char *path) {
 	if (!path)
 		return -EFAULT;
 
-	char *new_cwd = canonicalize_path(current_task->cwd, path);
-	kfree(current_task->cwd);
-	current_task->cwd = new_cwd;
+	char *new_cwd = canonicalize_path(current_task->group->cwd, path);
+	kfree(current_task->group->cwd);
+	current_task->group->cwd = new_cwd;
 
 	return 0;
 }
\ No newline at end of file
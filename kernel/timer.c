@@ -23,8 +23,7 @@
 #include <idt.h>
 #include <task.h>
 #include <time.h>
-#include <structures/list.h>
-#include <kmalloc.h>
+#include <rcu.h>
 
 // Defined in time.c
 extern time_t current_time;
@@ -32,23 +31,122 @@ extern time_t current_time;
 volatile uint32_t tick = 0;
 int32_t task_tick = 200;
 uint32_t rtc_tick = 1024;
-list_t *timers = NULL;
 
 waitqueue_t *timer_wq = NULL;
 
+/* Timers live in a hierarchical wheel, as in linux. tv1 holds everything
+ * due in the next TVR_SIZE ticks, one slot per tick. tv2-tv5 hold timers
+ * further out, and get cascaded down a level every time the one below wraps.
+ * Adding and removing are O(1), and each tick only touches what's due.
+ */
+struct timer_vec {
+	struct timer *vec[TVN_SIZE];
+};
+
+struct timer_vec_root {
+	struct timer *vec[TVR_SIZE];
+};
+
+static struct timer_vec_root tv1;
+static struct timer_vec tv2, tv3, tv4, tv5;
+
+// Next tick whose slot hasn't been run yet
+static uint32_t timer_ticks = 0;
+
+#define INDEX(n) ((timer_ticks >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+static void timer_link(struct timer **slot, struct timer *timer) {
+	timer->next = *slot;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+static void timer_unlink(struct timer *timer) {
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+static void internal_add_timer(struct timer *timer) {
+	uint32_t expires = timer->expires;
+	uint32_t idx = expires - timer_ticks;
+	struct timer **slot;
+
+	if ((int32_t)idx < 0) {
+		// Already due. Runs the next time the wheel turns
+		slot = &tv1.vec[timer_ticks & TVR_MASK];
+	} else if (idx < TVR_SIZE) {
+		slot = &tv1.vec[expires & TVR_MASK];
+	} else if (idx < 1 << (TVR_BITS + TVN_BITS)) {
+		slot = &tv2.vec[(expires >> TVR_BITS) & TVN_MASK];
+	} else if (idx < 1 << (TVR_BITS + 2 * TVN_BITS)) {
+		slot = &tv3.vec[(expires >> (TVR_BITS + TVN_BITS)) & TVN_MASK];
+	} else if (idx < 1 << (TVR_BITS + 3 * TVN_BITS)) {
+		slot = &tv4.vec[(expires >> (TVR_BITS + 2 * TVN_BITS)) & TVN_MASK];
+	} else {
+		slot = &tv5.vec[(expires >> (TVR_BITS + 3 * TVN_BITS)) & TVN_MASK];
+	}
+
+	timer_link(slot, timer);
+}
+
+// Re-sorts one outer slot into the levels below it
+static uint32_t cascade(struct timer_vec *tv, uint32_t index) {
+	struct timer *timer = tv->vec[index];
+	tv->vec[index] = NULL;
+
+	while (timer) {
+		struct timer *next = timer->next;
+		timer->next = NULL;
+		timer->pprev = NULL;
+		internal_add_timer(timer);
+		timer = next;
+	}
+
+	return index;
+}
+
+// Called with interrupts off. Catches up on any ticks we've missed
+static void run_timers(void) {
+	while ((int32_t)(tick - timer_ticks) >= 0) {
+		uint32_t index = timer_ticks & TVR_MASK;
+
+		if (!index &&
+				!cascade(&tv2, INDEX(0)) &&
+				!cascade(&tv3, INDEX(1)) &&
+				!cascade(&tv4, INDEX(2)))
+			cascade(&tv5, INDEX(3));
+
+		timer_ticks++;
+
+		// Move the due list somewhere private so callbacks can safely add or
+		// delete any timer, including the ones still waiting to run
+		struct timer *due = tv1.vec[index];
+		tv1.vec[index] = NULL;
+		if (due)
+			due->pprev = &due;
+
+		while (due) {
+			struct timer *timer = due;
+			timer_unlink(timer);
+			timer->callback(timer);
+		}
+	}
+}
+
 static void pit_callback(registers_t *regs) {
 	++tick;
+	account_tick(regs);
+	rcu_tick();
 
 	irq_ack(regs->int_no);
 
-	node_t *node;
-	foreach(node, timers) {
-		struct timer *timer = (struct timer *)node->data;
-		if (timer->expires == tick)
-			timer->callback();
-	}
+	run_timers();
 }
-
 static void rtc_callback(registers_t *regs) {
 	if (--rtc_tick <= 0) {
 		current_time++;
@@ -70,8 +168,6 @@ void init_timer(void) {
 
 	uint32_t divisor = 1193182 / HZ;
 
-	timers = list_create();
-	ASSERT(timers);
 	timer_wq = create_waitqueue();
 	ASSERT(timer_wq);
 
@@ -95,34 +191,59 @@ void init_timer(void) {
 }
 
 int add_timer(struct timer *timer) {
-	ASSERT(timer);
-	node_t *node = list_insert(timers, timer);
-	if (!node)
-		return -1;
+	ASSERT(timer && timer->callback);
+
+	uint32_t eflags = irq_save();
+	if (timer_pending(timer))
+		timer_unlink(timer);
+	internal_add_timer(timer);
+	irq_restore(eflags);
+
 	return 0;
 }
 
-void del_timer(struct timer *timer) {
+// Returns 1 if the timer was pending beforehand, 0 otherwise
+int mod_timer(struct timer *timer, uint32_t expires) {
+	ASSERT(timer && timer->callback);
+
+	uint32_t eflags = irq_save();
+	int ret = timer_pending(timer) ? 1 : 0;
+	if (ret)
+		timer_unlink(timer);
+	timer->expires = expires;
+	internal_add_timer(timer);
+	irq_restore(eflags);
+
+	return ret;
+}
+
+// Returns 1 if the timer was pending, 0 if it had already fired or was never
+// added
+int del_timer(struct timer *timer) {
 	ASSERT(timer);
-	node_t *node = list_find(timers, timer);
-	list_remove(timers, node);
+
+	uint32_t eflags = irq_save();
+	int ret = timer_pending(timer) ? 1 : 0;
+	if (ret)
+		timer_unlink(timer);
+	irq_restore(eflags);
+
+	return ret;
 }
 
-void wake_timers() {
+static void wake_timers(struct timer *timer) {
 	wake_queue(timer_wq);
 }
 
 void sleep_until(uint32_t expires) {
 	if (expires <= tick)
 		return;
-	struct timer *timer = (struct timer *)kmalloc(sizeof(struct timer));
-	ASSERT(timer);
 
-	timer->callback = wake_timers;
-	timer->expires = expires;
-	add_timer(timer);
+	struct timer timer = TIMER_INITIALIZER(wake_timers);
+	timer.expires = expires;
+	add_timer(&timer);
 
 	wait_event(timer_wq, tick >= expires);
 
-	del_timer(timer);
-}
\ No newline at end of file
+	del_timer(&timer);
+}
@@ -30,6 +30,7 @@
 #include <structures/tree.h>
 #include <task.h>
 #include <block.h>
+#include <bcache.h>
 
 fs_node_t *vfs_root = NULL;
 hashmap_t *fs_types = NULL;
@@ -37,8 +38,10 @@ tree_t *filesystem = NULL;
 
 extern volatile task_t *current_task;
 
-volatile spinlock_t vfs_lock = 0;
-volatile spinlock_t refcount_lock = 0;
+// Guards the mount tree. Lookups may sleep on I/O, so this can't be a spinlock
+static rw_sem_t *mount_sem = NULL;
+DEFINE_SPINLOCK(refcount_lock);
+static DEFINE_SPINLOCK(fs_types_lock);
 
 void init_vfs(void) {
 	ASSERT(!filesystem && !fs_types && "Double initialization");
@@ -48,6 +51,9 @@ void init_vfs(void) {
 
 	fs_types = hashmap_create(32, NULL);
 	ASSERT(fs_types);
+
+	mount_sem = create_rw_semaphore();
+	ASSERT(mount_sem);
 }
 
 // tokenizes path in place, returns depth
@@ -199,6 +205,7 @@ int32_t open_vfs(fs_node_t *node, uint32_t flags) {
 		return -EROFS;
 
 	node->flags = flags;
+	memset(&node->ra, 0, sizeof(struct file_ra));
 
 	if (node->refcount == -1)
 		return 0;
@@ -314,6 +321,20 @@ int32_t ioctl_vfs(fs_node_t *node, uint32_t req, void *data) {
 	return -EINVAL;
 }
 
+// Get what's been written to the file onto the disk
+int32_t fsync_vfs(fs_node_t *node, int32_t datasync) {
+	if (!node)
+		return -EBADF;
+	if (node->ops.fsync)
+		return node->ops.fsync(node, datasync);
+	return -EINVAL;
+}
+
+// Everything that's dirty, everywhere
+int32_t sync_vfs(void) {
+	return bflush(0);
+}
+
 int32_t create_vfs(fs_node_t *parent, const char *fname, uid_t uid, 
 		gid_t gid, mode_t mode, dev_t dev) {
 	if (!parent)
@@ -357,8 +378,12 @@ int32_t unlink_vfs(fs_node_t *parent, const char *fname) {
 	return -EACCES;
 }
 
+// mount looks fs_types up without locking. Only registrations serialize
 int32_t register_fs(const char *name, struct file_system_type *fs) {
-	return hashmap_insert(fs_types, name, fs);
+	spin_lock(&fs_types_lock);
+	int32_t ret = hashmap_insert(fs_types, name, fs);
+	spin_unlock(&fs_types_lock);
+	return ret;
 }
 
 static void vfs_prune(tree_node_t *node) {
@@ -401,26 +426,29 @@ int32_t mount(fs_node_t *dev, const char *relpath, const char *fs_name,
 	if (dev && !(dev->mode & VFS_BLOCKDEV))
 		return -ENOTBLK;
 
-	char *path = canonicalize_path(current_task->cwd, relpath);
-	if (!path) {
-		spin_unlock(&vfs_lock);
+	char *path = canonicalize_path(current_task->group->cwd, relpath);
+	if (!path)
 		return -ENOMEM;
-	}
 
 	uint32_t depth = vfs_tokenize(path);
 
-	spin_lock(&vfs_lock);
+	acquire_semaphore_write(mount_sem);
 
 	if (!filesystem->root) {
 		struct mountpoint *root =
 			(struct mountpoint *)kmalloc(sizeof(struct mountpoint));
-		if (!root)
+		if (!root) {
+			release_semaphore_write(mount_sem);
+			kfree(path);
 			return -ENOMEM;
+		}
 
 		root->name = "[root]";
 		root->sb = NULL;
 		if (!tree_set_root(filesystem, root)) {
+			release_semaphore_write(mount_sem);
 			kfree(root);
+			kfree(path);
 			return -ENOMEM;
 		}
 	}
@@ -449,7 +477,7 @@ int32_t mount(fs_node_t *dev, const char *relpath, const char *fs_name,
 			if (!entry) {
 				kfree(path);
 				vfs_prune(node);
-				spin_unlock(&vfs_lock);
+				release_semaphore_write(mount_sem);
 				return -ENOMEM;
 			}
 			entry->name = (char *)kmalloc(strlen(off) + 1);
@@ -457,7 +485,7 @@ int32_t mount(fs_node_t *dev, const char *relpath, const char *fs_name,
 				kfree(entry);
 				kfree(path);
 				vfs_prune(node);
-				spin_unlock(&vfs_lock);
+				release_semaphore_write(mount_sem);
 				return -ENOMEM;
 			}
 			strcpy(entry->name, off);
@@ -471,7 +499,7 @@ int32_t mount(fs_node_t *dev, const char *relpath, const char *fs_name,
 
 	if (entry->sb) {
 		vfs_prune(node);
-		spin_unlock(&vfs_lock);
+		release_semaphore_write(mount_sem);
 		return -EBUSY;
 	}
 
@@ -481,14 +509,14 @@ int32_t mount(fs_node_t *dev, const char *relpath, const char *fs_name,
 	else
 		sb = fs->get_super(0, flags);
 	if (!sb) {
-		spin_unlock(&vfs_lock);
 		vfs_prune(node);
+		release_semaphore_write(mount_sem);
 		return -ENODEV;
 	}
 
 	sb->root->refcount = -1;
 	entry->sb = sb;
-	spin_unlock(&vfs_lock);
+	release_semaphore_write(mount_sem);
 	return 0;
 }
 
@@ -497,14 +525,14 @@ int32_t umount(const char *relpath, uint32_t flags) {
 	if (!filesystem)
 		return -EINVAL;
 	
-	char *path = canonicalize_path(current_task->cwd, relpath);
+	char *path = canonicalize_path(current_task->group->cwd, relpath);
 	if (!path)
 		return -ENOMEM;
 
 	char *off;
 	uint32_t depth = vfs_tokenize(path);
 
-	spin_lock(&vfs_lock);
+	acquire_semaphore_write(mount_sem);
 	tree_node_t *node = filesystem->root;
 	struct mountpoint *entry = (struct mountpoint *)node->data;
 
@@ -527,7 +555,7 @@ int32_t umount(const char *relpath, uint32_t flags) {
 
 		if (!exist) {
 			kfree(path);
-			spin_unlock(&vfs_lock);
+			release_semaphore_write(mount_sem);
 			return -ENOENT;
 		}
 		off += strlen(off);
@@ -536,24 +564,24 @@ int32_t umount(const char *relpath, uint32_t flags) {
 	kfree(path);
 
 	if (!entry->sb) {
-		spin_unlock(&vfs_lock);
+		release_semaphore_write(mount_sem);
 		return -EINVAL;
 	}
 
 	if (!(flags & MNT_DETACH) && node->children->head != node->children->tail) {
-		spin_unlock(&vfs_lock);
+		release_semaphore_write(mount_sem);
 		return -EBUSY;
 	}
 
 
 	if (entry->sb->close_fs(entry->sb, flags & MNT_FORCE) != 0) {
-		spin_unlock(&vfs_lock);
+		release_semaphore_write(mount_sem);
 		return -EBUSY;
 	}
 
 	entry->sb = NULL;
 	vfs_prune(node);
-	spin_unlock(&vfs_lock);
+	release_semaphore_write(mount_sem);
 	return 0;
 }
 
@@ -610,21 +638,21 @@ fs_node_t *kopen(const char *relpath, int32_t flags, int32_t *openret) {
 	if (!relpath)
 		return NULL;
 
-	char *path = canonicalize_path(current_task->cwd, relpath);
+	char *path = canonicalize_path(current_task->group->cwd, relpath);
 	if (!path)
 		return NULL;
 
 	uint32_t depth = vfs_tokenize(path);
 	char *off = path;
 
-	spin_lock(&vfs_lock);
+	acquire_semaphore_read(mount_sem);
 
 	if (depth == 1) {
 		fs_node_t *root = (fs_node_t *)kmalloc(sizeof(fs_node_t));
 		memcpy(root, (fs_node_t *)filesystem->root->data, sizeof(fs_node_t));
 		kfree(path);
 		int32_t ret = open_vfs(root, flags);
-		spin_unlock(&vfs_lock);
+		release_semaphore_read(mount_sem);
 		if (ret < 0) {
 			kfree(root);
 			root = NULL;
@@ -639,7 +667,7 @@ fs_node_t *kopen(const char *relpath, int32_t flags, int32_t *openret) {
 
 	if (!cur_node) {
 		kfree(path);
-		spin_unlock(&vfs_lock);
+		release_semaphore_read(mount_sem);
 		if (openret)
 			*openret = -ENOENT;
 		return NULL;
@@ -652,7 +680,7 @@ fs_node_t *kopen(const char *relpath, int32_t flags, int32_t *openret) {
 			kfree(cur_node);
 			cur_node = NULL;
 		}
-		spin_unlock(&vfs_lock);
+		release_semaphore_read(mount_sem);
 		if (openret)
 			*openret = ret;
 		return cur_node;
@@ -664,7 +692,7 @@ fs_node_t *kopen(const char *relpath, int32_t flags, int32_t *openret) {
 		cur_node = next_node;
 		if (!cur_node) {
 			kfree(path);
-			spin_unlock(&vfs_lock);
+			release_semaphore_read(mount_sem);
 			if (openret)
 				*openret = -ENOENT;
 			return NULL;
@@ -675,7 +703,7 @@ fs_node_t *kopen(const char *relpath, int32_t flags, int32_t *openret) {
 				kfree(cur_node);
 				cur_node = NULL;
 			}
-			spin_unlock(&vfs_lock);
+			release_semaphore_read(mount_sem);
 			if (openret)
 				*openret = ret;
 			return cur_node;
@@ -684,7 +712,7 @@ fs_node_t *kopen(const char *relpath, int32_t flags, int32_t *openret) {
 	}
 
 	kfree(path);
-	spin_unlock(&vfs_lock);
+	release_semaphore_read(mount_sem);
 	return NULL;
 }
 
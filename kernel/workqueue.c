@@ -0,0 +1,364 @@
+/* workqueue.c - deferred work run by pools of kernel threads. Drivers queue
+ * small work items instead of owning a thread of their own, and several
+ * workers per queue let one item sleep while another makes progress
+ */
+
+/* Copyright (C) 2015 Bth8 <bth8fwd@gmail.com>
+ *
+ *  This file is part of Dionysus.
+ *
+ *  Dionysus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Dionysus is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Dionysus.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <common.h>
+#include <workqueue.h>
+#include <task.h>
+#include <timer.h>
+#include <kmalloc.h>
+#include <string.h>
+
+// Defined in timer.c
+extern volatile uint32_t tick;
+
+// Defined in task.c
+extern volatile task_t *current_task;
+
+workqueue_t *system_wq = NULL;
+
+static void worker_thread(void *argp) {
+	workqueue_t *wq = (workqueue_t *)argp;
+
+	while (1) {
+		asm volatile("cli");
+		// One idle worker per wakeup is plenty
+		while (!wq->head && !wq->dying)
+			sleep_thread(wq->more_work, SLEEP_EXCLUSIVE);
+
+		if (!wq->head)
+			break;
+
+		struct work *work = wq->head;
+		wq->head = work->next;
+		if (!wq->head)
+			wq->tail = NULL;
+		work->next = NULL;
+
+		work->flags |= WORK_RUNNING;
+		wq->active++;
+
+		// Anything queued in the meantime is folded into one more run
+		while (work->flags & WORK_PENDING) {
+			work->flags &= ~WORK_PENDING;
+
+			// Run at the priority of whoever is waiting on us
+			uint32_t prio = work->prio;
+			work->prio = 0;
+			if (prio)
+				sched_inherit((task_t *)current_task, prio);
+
+			asm volatile("sti");
+			work->func(work);
+			asm volatile("cli");
+
+			if (prio)
+				sched_uninherit((task_t *)current_task);
+		}
+
+		work->flags &= ~WORK_RUNNING;
+		wq->active--;
+		wake_queue(wq->done);
+	}
+
+	// Back to _tasklet_finish, which destroy_workqueue waits for
+}
+
+void init_workqueues(void) {
+	system_wq = create_workqueue("[events]", SYSTEM_WQ_WORKERS);
+	ASSERT(system_wq);
+}
+
+workqueue_t *create_workqueue(const char *name, uint32_t nworkers) {
+	ASSERT(name);
+	ASSERT(nworkers > 0);
+
+	workqueue_t *wq = (workqueue_t *)kmalloc(sizeof(workqueue_t));
+	if (!wq)
+		return NULL;
+
+	memset(wq, 0, sizeof(workqueue_t));
+
+	wq->workers = (tasklet_t **)kmalloc(nworkers * sizeof(tasklet_t *));
+	if (!wq->workers)
+		goto error1;
+
+	wq->more_work = create_waitqueue();
+	if (!wq->more_work)
+		goto error2;
+
+	wq->done = create_waitqueue();
+	if (!wq->done)
+		goto error3;
+
+	for (wq->nworkers = 0; wq->nworkers < nworkers; wq->nworkers++) {
+		tasklet_t *worker = create_tasklet(worker_thread, name, wq);
+		if (!worker)
+			goto error4;
+
+		if (schedule_tasklet(worker) < 0) {
+			destroy_tasklet(worker);
+			goto error4;
+		}
+
+		wq->workers[wq->nworkers] = worker;
+	}
+
+	return wq;
+
+error4:
+	destroy_workqueue(wq);
+	return NULL;
+error3:
+	destroy_waitqueue(wq->more_work);
+error2:
+	kfree(wq->workers);
+error1:
+	kfree(wq);
+	return NULL;
+}
+
+// Runs everything still queued, then stops and frees the workers
+void destroy_workqueue(workqueue_t *wq) {
+	ASSERT(wq);
+
+	flush_workqueue(wq);
+
+	uint32_t eflags = irq_save();
+	wq->dying = 1;
+	wake_queue_all(wq->more_work);
+
+	/* scheduled is cleared by _tasklet_finish right as the worker leaves for
+	 * good, and nobody tells us when, so just keep yielding until it has
+	 */
+	uint32_t i;
+	for (i = 0; i < wq->nworkers; i++) {
+		while (wq->workers[i]->scheduled)
+			switch_task(1);
+	}
+	irq_restore(eflags);
+
+	for (i = 0; i < wq->nworkers; i++)
+		destroy_tasklet(wq->workers[i]);
+
+	destroy_waitqueue(wq->done);
+	destroy_waitqueue(wq->more_work);
+	kfree(wq->workers);
+	kfree(wq);
+}
+
+// Put every worker in a scheduling class, e.g. real-time for drivers
+int32_t set_workqueue_scheduler(workqueue_t *wq, uint32_t policy,
+		uint32_t prio) {
+	ASSERT(wq);
+
+	uint32_t i;
+	for (i = 0; i < wq->nworkers; i++) {
+		int32_t ret = set_scheduler(&wq->workers[i]->task, policy, prio);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+void init_work(struct work *work, void (*func)(struct work *)) {
+	ASSERT(work && func);
+
+	work->func = func;
+	work->next = NULL;
+	work->flags = 0;
+	work->wq = NULL;
+	work->prio = 0;
+}
+
+void init_delayed_work(struct delayed_work *dwork,
+		void (*func)(struct work *)) {
+	ASSERT(dwork);
+
+	init_work(&dwork->work, func);
+	dwork->timer = (struct timer)TIMER_INITIALIZER(delayed_work_timer);
+	dwork->wq = NULL;
+}
+
+/* Returns 1 if the work was queued, 0 if it was already pending. Safe to
+ * call from interrupt handlers and timer callbacks
+ */
+int queue_work(workqueue_t *wq, struct work *work) {
+	ASSERT(wq && work && work->func);
+
+	uint32_t eflags = irq_save();
+
+	if (work->flags & WORK_PENDING) {
+		irq_restore(eflags);
+		return 0;
+	}
+
+	work->flags |= WORK_PENDING;
+	work->wq = wq;
+
+	// Whoever is running it will go round again
+	if (work->flags & WORK_RUNNING) {
+		irq_restore(eflags);
+		return 1;
+	}
+
+	work->next = NULL;
+	if (wq->tail)
+		wq->tail->next = work;
+	else
+		wq->head = work;
+	wq->tail = work;
+
+	wake_queue(wq->more_work);
+	irq_restore(eflags);
+
+	return 1;
+}
+
+/* queue_work on behalf of the calling task. The work is run at the
+ * caller's priority if that's higher than the worker's own. Not for
+ * interrupt handlers, which have no caller to speak of
+ */
+int queue_work_inherit(workqueue_t *wq, struct work *work) {
+	uint32_t eflags = irq_save();
+	if (current_task->prio > work->prio)
+		work->prio = current_task->prio;
+	int ret = queue_work(wq, work);
+	irq_restore(eflags);
+
+	return ret;
+}
+
+void delayed_work_timer(struct timer *timer) {
+	struct delayed_work *dwork = container_of(timer, struct delayed_work,
+		timer);
+	queue_work(dwork->wq, &dwork->work);
+}
+
+// Queue work after delay ticks. Returns 0 if it was already waiting
+int queue_delayed_work(workqueue_t *wq, struct delayed_work *dwork,
+		uint32_t delay) {
+	ASSERT(wq && dwork);
+
+	if (delay == 0)
+		return queue_work(wq, &dwork->work);
+
+	uint32_t eflags = irq_save();
+
+	if (timer_pending(&dwork->timer) ||
+			(dwork->work.flags & WORK_PENDING)) {
+		irq_restore(eflags);
+		return 0;
+	}
+
+	dwork->wq = wq;
+	mod_timer(&dwork->timer, tick + delay);
+
+	irq_restore(eflags);
+
+	return 1;
+}
+
+/* Take work off its queue if it hasn't started yet, or stop it from being
+ * run again if it has. Returns 1 if it was pending
+ */
+int cancel_work(struct work *work) {
+	ASSERT(work);
+
+	uint32_t eflags = irq_save();
+
+	if (!(work->flags & WORK_PENDING)) {
+		irq_restore(eflags);
+		return 0;
+	}
+
+	work->flags &= ~WORK_PENDING;
+
+	if (!(work->flags & WORK_RUNNING)) {
+		workqueue_t *wq = work->wq;
+		struct work **link = &wq->head;
+		struct work *prev = NULL;
+		while (*link && *link != work) {
+			prev = *link;
+			link = &(*link)->next;
+		}
+
+		ASSERT(*link);
+		*link = work->next;
+		if (wq->tail == work)
+			wq->tail = prev;
+		work->next = NULL;
+	}
+
+	irq_restore(eflags);
+
+	return 1;
+}
+
+// Like cancel_work, but also waits for a run in progress to finish
+int cancel_work_sync(struct work *work) {
+	int ret = cancel_work(work);
+	flush_work(work);
+	return ret;
+}
+
+int cancel_delayed_work(struct delayed_work *dwork) {
+	ASSERT(dwork);
+
+	int ret = del_timer(&dwork->timer);
+	ret |= cancel_work(&dwork->work);
+
+	return ret;
+}
+
+int cancel_delayed_work_sync(struct delayed_work *dwork) {
+	int ret = cancel_delayed_work(dwork);
+	flush_work(&dwork->work);
+	return ret;
+}
+
+// Wait until work is neither queued nor running
+void flush_work(struct work *work) {
+	ASSERT(work);
+
+	workqueue_t *wq = work->wq;
+	if (!wq)
+		return;
+
+	uint32_t eflags = irq_save();
+	while (work->flags & (WORK_PENDING | WORK_RUNNING))
+		sleep_thread(wq->done, 0);
+	irq_restore(eflags);
+}
+
+/* Wait until the queue is empty and no worker is busy. Work that keeps
+ * requeueing itself will keep us here
+ */
+void flush_workqueue(workqueue_t *wq) {
+	ASSERT(wq);
+
+	uint32_t eflags = irq_save();
+	while (wq->head || wq->active)
+		sleep_thread(wq->done, 0);
+	irq_restore(eflags);
+}